@@ -0,0 +1,305 @@
+/*
+ * addrmap.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nrf24-mqtt.h"
+#include "debug.h"
+#include "addrmap.h"
+
+/* empty slots have a NULL map, so key 0 is fine as a real key */
+static uint64_t addrmap_key(const uint8_t *addr, uint8_t prefix_len) {
+    uint64_t key = 0;
+    int pos;
+
+    for(pos = 0; pos < 5; pos++) {
+        key <<= 8;
+        if(pos < prefix_len)
+            key |= addr[pos];
+    }
+
+    return key | ((uint64_t)prefix_len << 40);
+}
+
+static uint32_t addrmap_hash(uint64_t key) {
+    return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static addr_map_t *addrmap_probe(const addrmap_t *index, uint64_t key) {
+    uint32_t pos = addrmap_hash(key) & index->mask;
+
+    while(index->slots[pos].map) {
+        if(index->slots[pos].key == key)
+            return index->slots[pos].map;
+        pos = (pos + 1) & index->mask;
+    }
+
+    return NULL;
+}
+
+/* 2 if pinned to this pipe, 1 if heard on any pipe, 0 if not here */
+static int addrmap_rank(const addr_map_t *map, int pipe) {
+    if(pipe < 0 || map->pipe < 0)
+        return 1;
+    return map->pipe == pipe ? 2 : 0;
+}
+
+/*
+ * Index the entries heard on the given pipe (those pinned to it, and
+ * those that aren't pinned anywhere), or all of them for pipe -1.
+ */
+bool addrmap_build(addrmap_t *index, addr_map_t *list, int pipe) {
+    addr_map_t *pmap;
+    uint32_t entries = 0;
+    uint32_t size = 16;
+    int rank;
+
+    memset(index, 0, sizeof(addrmap_t));
+
+    for(pmap = list; pmap; pmap = pmap->next) {
+        if(addrmap_rank(pmap, pipe))
+            entries++;
+    }
+
+    /* keep the load factor under 50% so probe chains stay short */
+    while(size < entries * 2)
+        size <<= 1;
+
+    index->slots = (addrmap_slot_t *)calloc(size, sizeof(addrmap_slot_t));
+    if(!index->slots) {
+        ERROR("Malloc error");
+        return false;
+    }
+    index->mask = size - 1;
+
+    /* entries pinned to this pipe go in first, and win over the rest */
+    for(rank = 2; rank > 0; rank--) {
+        for(pmap = list; pmap; pmap = pmap->next) {
+            uint64_t key = addrmap_key(pmap->addr, pmap->prefix_len);
+            uint32_t pos = addrmap_hash(key) & index->mask;
+
+            if(addrmap_rank(pmap, pipe) != rank)
+                continue;
+
+            while(index->slots[pos].map && index->slots[pos].key != key)
+                pos = (pos + 1) & index->mask;
+
+            /* list is newest-first, so the first insert wins, like a list walk */
+            if(index->slots[pos].map) {
+                if(addrmap_rank(index->slots[pos].map, pipe) == rank)
+                    WARN("Duplicate map entry for %s, ignoring",
+                         pmap->sensor_name);
+                continue;
+            }
+
+            index->slots[pos].key = key;
+            index->slots[pos].map = pmap;
+            index->count++;
+
+            if(pmap->prefix_len < 5)
+                index->prefix_lens |= (1 << pmap->prefix_len);
+        }
+    }
+
+    return true;
+}
+
+void addrmap_free(addrmap_t *index) {
+    if(index->slots)
+        free(index->slots);
+    memset(index, 0, sizeof(addrmap_t));
+}
+
+/*
+ * Exact matches first, then the longest wildcard prefix that
+ * matches.  Only prefix lengths actually configured get probed.
+ */
+addr_map_t *addrmap_find(const addrmap_t *index, const uint8_t *addr) {
+    addr_map_t *pmap;
+    int len;
+
+    if(!index->slots)
+        return NULL;
+
+    pmap = addrmap_probe(index, addrmap_key(addr, 5));
+    if(pmap || !index->prefix_lens)
+        return pmap;
+
+    for(len = 4; len >= 0; len--) {
+        if(!(index->prefix_lens & (1 << len)))
+            continue;
+
+        pmap = addrmap_probe(index, addrmap_key(addr, len));
+        if(pmap)
+            return pmap;
+    }
+
+    return NULL;
+}
+
+/*
+ * Wildcard names take one conversion per wildcard byte, in address
+ * order: %x, %X or %d with an optional (up to two digit) zero-padded
+ * width, like %02x.
+ * Returns the number of conversions, or -1 if the name is malformed.
+ */
+int addrmap_name_conversions(const char *name) {
+    int count = 0;
+
+    while(*name) {
+        if(*name++ != '%')
+            continue;
+
+        if(*name == '%') {
+            name++;
+            continue;
+        }
+
+        if(*name >= '0' && *name <= '9')
+            name++;
+        if(*name >= '0' && *name <= '9')
+            name++;
+
+        if(*name != 'x' && *name != 'X' && *name != 'd')
+            return -1;
+
+        name++;
+        count++;
+    }
+
+    return count;
+}
+
+size_t addrmap_format_name(const addr_map_t *map, const uint8_t *addr,
+                           char *buf, size_t len) {
+    const char *name = map->sensor_name;
+    int next = map->prefix_len;
+    size_t out = 0;
+
+    if(!len)
+        return 0;
+
+    if(map->prefix_len == 5) {
+        out = strlen(name);
+        if(out >= len)
+            out = len - 1;
+        memcpy(buf, name, out);
+        buf[out] = '\0';
+        return out;
+    }
+
+    while(*name && out < len - 1) {
+        char spec[8] = "%";
+        int spos = 1;
+        int written;
+
+        if(*name != '%') {
+            buf[out++] = *name++;
+            continue;
+        }
+
+        name++;
+        if(*name == '%') {
+            buf[out++] = *name++;
+            continue;
+        }
+
+        while(*name >= '0' && *name <= '9' && spos < 3)
+            spec[spos++] = *name++;
+        spec[spos++] = *name++;
+        spec[spos] = '\0';
+
+        written = snprintf(buf + out, len - out, spec,
+                           next < 5 ? addr[next] : 0);
+        next++;
+        if(written < 0)
+            break;
+        out += written;
+        if(out > len - 1)
+            out = len - 1;
+    }
+
+    buf[out] = '\0';
+    return out;
+}
+
+static int addrmap_digit(char c, int base) {
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(base == 16 && c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(base == 16 && c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * The other way round: the address map would have given this name,
+ * if any.  Wildcard bytes are read back out of the name, and the
+ * address has to format back to exactly the same name.
+ */
+bool addrmap_parse_name(const addr_map_t *map, const char *name,
+                        uint8_t *addr) {
+    const char *fmt = map->sensor_name;
+    const char *pos = name;
+    char check[ADDRMAP_NAME_MAX];
+    int next = map->prefix_len;
+    int base, digits, digit, value;
+
+    memset(addr, 0, 5);
+    memcpy(addr, map->addr, map->prefix_len);
+
+    if(map->prefix_len == 5)
+        return !strcmp(fmt, name);
+
+    while(*fmt) {
+        if(*fmt != '%' || fmt[1] == '%') {
+            if(*pos++ != *fmt)
+                return false;
+            fmt += (*fmt == '%') ? 2 : 1;
+            continue;
+        }
+
+        fmt++;
+        while(*fmt >= '0' && *fmt <= '9')
+            fmt++;
+        base = (*fmt++ == 'd') ? 10 : 16;
+
+        /* a byte is at most 2 hex or 3 decimal digits */
+        value = 0;
+        for(digits = 0; digits < (base == 10 ? 3 : 2); digits++) {
+            digit = addrmap_digit(*pos, base);
+            if(digit < 0)
+                break;
+            value = value * base + digit;
+            pos++;
+        }
+
+        if(!digits || value > 255)
+            return false;
+        if(next < 5)
+            addr[next++] = (uint8_t)value;
+    }
+
+    if(*pos)
+        return false;
+
+    addrmap_format_name(map, addr, check, sizeof(check));
+    return !strcmp(check, name);
+}
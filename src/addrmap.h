@@ -0,0 +1,56 @@
+/*
+ * addrmap.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ADDRMAP_H_
+#define _ADDRMAP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "nrf24-mqtt.h"
+
+/* longest sensor name worth reading back */
+#define ADDRMAP_NAME_MAX 128
+
+/*
+ * Open-addressing hash of addr_map_t entries, keyed on the 5 byte
+ * address plus the number of significant (non-wildcard) leading
+ * bytes.  Built once at config load, read-only afterwards.
+ */
+typedef struct addrmap_slot_t {
+    uint64_t key;
+    addr_map_t *map;
+} addrmap_slot_t;
+
+typedef struct addrmap_t {
+    addrmap_slot_t *slots;
+    uint32_t mask;
+    uint32_t count;
+    uint8_t prefix_lens;   /* bitmask of wildcard prefix lengths in use */
+} addrmap_t;
+
+extern bool addrmap_build(addrmap_t *index, addr_map_t *list, int pipe);
+extern void addrmap_free(addrmap_t *index);
+extern addr_map_t *addrmap_find(const addrmap_t *index, const uint8_t *addr);
+extern int addrmap_name_conversions(const char *name);
+extern size_t addrmap_format_name(const addr_map_t *map, const uint8_t *addr,
+                                  char *buf, size_t len);
+extern bool addrmap_parse_name(const addr_map_t *map, const char *name,
+                               uint8_t *addr);
+
+#endif /* _ADDRMAP_H_ */
@@ -0,0 +1,74 @@
+/*
+ * aggregate.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "aggregate.h"
+
+/* a slot left over from AGG_SLOTS steps ago is reused */
+void agg_add(agg_t *agg, uint32_t step, int32_t value) {
+    agg_slot_t *slot = &agg->slots[step % AGG_SLOTS];
+
+    if(slot->step != step || !slot->count) {
+        slot->step = step;
+        slot->count = 1;
+        slot->min = slot->max = value;
+        slot->sum = value;
+        return;
+    }
+
+    slot->count++;
+    slot->sum += value;
+    if(value < slot->min)
+        slot->min = value;
+    if(value > slot->max)
+        slot->max = value;
+}
+
+/*
+ * Summary of the steps steps ending with last_step.  False if there
+ * were no readings in that time.
+ */
+bool agg_summary(const agg_t *agg, uint32_t last_step, uint32_t steps,
+                 agg_summary_t *summary) {
+    const agg_slot_t *slot;
+    int64_t sum = 0;
+    uint32_t step;
+
+    summary->count = 0;
+
+    for(step = last_step - steps + 1; step != last_step + 1; step++) {
+        slot = &agg->slots[step % AGG_SLOTS];
+        if(slot->step != step || !slot->count)
+            continue;
+
+        if(!summary->count || slot->min < summary->min)
+            summary->min = slot->min;
+        if(!summary->count || slot->max > summary->max)
+            summary->max = slot->max;
+        summary->count += slot->count;
+        sum += slot->sum;
+    }
+
+    if(!summary->count)
+        return false;
+
+    summary->mean = (int32_t)((sum < 0 ? sum - summary->count / 2 :
+                               sum + summary->count / 2) / summary->count);
+    return true;
+}
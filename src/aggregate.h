@@ -0,0 +1,57 @@
+/*
+ * aggregate.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _AGGREGATE_H_
+#define _AGGREGATE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define AGG_SLOTS       16  /* steps remembered, so the longest window */
+#define AGG_WINDOWS_MAX 4
+
+/*
+ * Rolling accumulators for one channel.  Time is cut into steps (the
+ * gcd of the configured windows), each with a slot in a small ring,
+ * so every window is summed from the same fixed block of memory.
+ * Values are thousandths, as published.
+ */
+typedef struct agg_slot_t {
+    uint32_t step;
+    uint32_t count;
+    int32_t min;
+    int32_t max;
+    int64_t sum;
+} agg_slot_t;
+
+typedef struct agg_t {
+    agg_slot_t slots[AGG_SLOTS];
+    uint8_t decimals;        /* of the readings, for publishing */
+} agg_t;
+
+typedef struct agg_summary_t {
+    uint32_t count;
+    int32_t min;
+    int32_t max;
+    int32_t mean;
+} agg_summary_t;
+
+extern void agg_add(agg_t *agg, uint32_t step, int32_t value);
+extern bool agg_summary(const agg_t *agg, uint32_t last_step, uint32_t steps,
+                        agg_summary_t *summary);
+
+#endif /* _AGGREGATE_H_ */
@@ -0,0 +1,730 @@
+/*
+ * bench.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks for each stage of the packet path, driven by a
+ * synthetic packet stream.  Build and run with "make bench".
+ *
+ * Results are printed one JSON object per line, one line per
+ * (stage, implementation, table size), so runs can be diffed or
+ * collected for regression tracking.  Publish stages also count the
+ * bytes each packet would have put on the wire to the broker.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include <mosquitto.h>
+
+#include "nrf24-mqtt.h"
+#include "debug.h"
+#include "cfg.h"
+#include "mqtt.h"
+#include "addrmap.h"
+#include "format.h"
+#include "decode.h"
+#include "sensor-cache.h"
+#include "dedup.h"
+#include "downlink.h"
+
+#define BENCH_PACKETS   4096
+#define BENCH_BATCH     64
+
+/* every tenth packet comes from an unmapped address */
+#define BENCH_KNOWN(i)  (((i) % 10) != 0)
+
+typedef struct bench_ctx_t {
+    uint32_t sensors;
+    addr_map_t *entries;
+    uint8_t *addrs;
+    addr_map_t *list;
+    sensor_struct_t *packets;
+    sensor_entry_t **cached;
+    sensor_cache_t cache;
+    cfg_snapshot_t snap;
+    dedup_t dedup;
+    uint64_t now_ns;
+    uint64_t missed;
+} bench_ctx_t;
+
+typedef void (*bench_fn_t)(bench_ctx_t *ctx, sensor_struct_t *pmsg,
+                           uint32_t idx);
+
+static const double bench_scale[] = { 1.0, 10.0, 100.0, 1000.0 };
+static uint64_t bench_min_ns = 200000000ULL;
+static const char *bench_only = NULL;
+
+static volatile uintptr_t bench_sink;
+
+/*
+ * Count heap allocations by interposing the allocator.  Everything
+ * (including libc internals like asprintf) goes through these.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static int bench_counting = 0;
+static uint64_t bench_allocs = 0;
+static uint64_t bench_bytes = 0;
+
+void *malloc(size_t size) {
+    if(bench_counting)
+        bench_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if(bench_counting)
+        bench_allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if(bench_counting)
+        bench_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if(bench_counting && ptr)
+        bench_allocs++;
+    __libc_free(ptr);
+}
+
+/* mosquitto stubs, so dispatch runs without a broker */
+int mosquitto_lib_init(void) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_lib_cleanup(void) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+static void *bench_obj;
+static void (*bench_on_connect)(struct mosquitto *, void *, int);
+static void (*bench_on_connect_v5)(struct mosquitto *, void *, int, int,
+                                   const mosquitto_property *);
+static void (*bench_on_publish)(struct mosquitto *, void *, int);
+static int bench_mid;
+
+struct mosquitto *mosquitto_new(const char *id, bool clean_session, void *obj) {
+    bench_obj = obj;
+    return (struct mosquitto *)&bench_sink;
+}
+
+void mosquitto_destroy(struct mosquitto *mosq) {
+}
+
+int mosquitto_int_option(struct mosquitto *mosq, enum mosq_opt_t option,
+                         int value) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+void mosquitto_connect_callback_set(struct mosquitto *mosq,
+                                    void (*on_connect)(struct mosquitto *,
+                                                       void *, int)) {
+    bench_on_connect = on_connect;
+    bench_on_connect_v5 = NULL;
+}
+
+void mosquitto_connect_v5_callback_set(
+    struct mosquitto *mosq,
+    void (*on_connect)(struct mosquitto *, void *, int, int,
+                       const mosquitto_property *)) {
+    bench_on_connect_v5 = on_connect;
+    bench_on_connect = NULL;
+}
+
+void mosquitto_disconnect_callback_set(struct mosquitto *mosq,
+                                       void (*on_disconnect)(
+                                           struct mosquitto *, void *,
+                                           int)) {
+}
+
+void mosquitto_publish_callback_set(struct mosquitto *mosq,
+                                    void (*on_publish)(struct mosquitto *,
+                                                       void *, int)) {
+    bench_on_publish = on_publish;
+}
+
+int mosquitto_reconnect_delay_set(struct mosquitto *mosq,
+                                  unsigned int reconnect_delay,
+                                  unsigned int reconnect_delay_max,
+                                  bool reconnect_exponential_backoff) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_connect(struct mosquitto *mosq, const char *host, int port,
+                      int keepalive) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+/* connected straight away, to a broker allowing every topic alias */
+int mosquitto_connect_async(struct mosquitto *mosq, const char *host,
+                            int port, int keepalive) {
+    if(bench_on_connect_v5)
+        bench_on_connect_v5(mosq, bench_obj, 0, 0,
+                            (const mosquitto_property *)&bench_sink);
+    else if(bench_on_connect)
+        bench_on_connect(mosq, bench_obj, 0);
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_loop_start(struct mosquitto *mosq) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_loop_stop(struct mosquitto *mosq, bool force) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * The rest of what a worker can call (shutdown, downlink, event loop
+ * mode), so nothing ever hands our fake handle to the real library.
+ */
+int mosquitto_disconnect(struct mosquitto *mosq) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_reconnect_async(struct mosquitto *mosq) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_subscribe(struct mosquitto *mosq, int *mid, const char *sub,
+                        int qos) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+void mosquitto_message_callback_set(struct mosquitto *mosq,
+                                    void (*on_message)(
+                                        struct mosquitto *, void *,
+                                        const struct mosquitto_message *)) {
+}
+
+int mosquitto_socket(struct mosquitto *mosq) {
+    return -1;
+}
+
+bool mosquitto_want_write(struct mosquitto *mosq) {
+    return false;
+}
+
+int mosquitto_loop_read(struct mosquitto *mosq, int max_packets) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_loop_write(struct mosquitto *mosq, int max_packets) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_loop_misc(struct mosquitto *mosq) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+/*
+ * What a QoS 0 PUBLISH comes to on the wire: fixed header, topic,
+ * (MQTT 5) properties, payload.  The only property we send is a
+ * topic alias.
+ */
+static void bench_wire(const char *topic, int payloadlen, bool v5,
+                       bool alias) {
+    size_t remaining = 2 + strlen(topic) + payloadlen;
+
+    if(v5)
+        remaining += 1 + (alias ? 3 : 0);
+    bench_bytes += 1 + (remaining < 128 ? 1 : remaining < 16384 ? 2 : 3) +
+        remaining;
+}
+
+/*
+ * Written out straight away, so on_publish comes before the mid is
+ * handed back, as it can with a real QoS 0 publish.
+ */
+static void bench_published(struct mosquitto *mosq, int *mid) {
+    bench_mid = (bench_mid + 1) & 0xffff;
+    if(mid)
+        *mid = bench_mid;
+    if(bench_on_publish)
+        bench_on_publish(mosq, bench_obj, bench_mid);
+}
+
+int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic,
+                      int payloadlen, const void *payload, int qos,
+                      bool retain) {
+    bench_sink = (uintptr_t)topic + payloadlen;
+    bench_wire(topic, payloadlen, false, false);
+    bench_published(mosq, mid);
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_publish_v5(struct mosquitto *mosq, int *mid, const char *topic,
+                         int payloadlen, const void *payload, int qos,
+                         bool retain, const mosquitto_property *properties) {
+    bench_sink = (uintptr_t)topic + payloadlen;
+    bench_wire(topic, payloadlen, true, properties != NULL);
+    bench_published(mosq, mid);
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_property_add_int16(mosquitto_property **proplist,
+                                 int identifier, uint16_t value) {
+    *proplist = (mosquitto_property *)&bench_sink;
+    return MOSQ_ERR_SUCCESS;
+}
+
+void mosquitto_property_free_all(mosquitto_property **properties) {
+    *properties = NULL;
+}
+
+const mosquitto_property *mosquitto_property_read_int16(
+    const mosquitto_property *proplist, int identifier, uint16_t *value,
+    bool skip_first) {
+    *value = 65535;
+    return proplist;
+}
+
+/* no radios here to send commands on */
+bool downlink_command(const char *name, size_t name_len, int instance,
+                      int value) {
+    return false;
+}
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_addr(uint8_t *addr, uint32_t n) {
+    addr[0] = 0xae;
+    addr[1] = (n >> 24) & 0xff;
+    addr[2] = (n >> 16) & 0xff;
+    addr[3] = (n >> 8) & 0xff;
+    addr[4] = n & 0xff;
+}
+
+static addr_map_t *bench_make_list(uint32_t count, addr_map_t *entries,
+                                   uint8_t *addrs) {
+    addr_map_t *head = NULL;
+    uint32_t i;
+
+    for(i = 0; i < count; i++) {
+        entries[i].addr = &addrs[i * 5];
+        entries[i].prefix_len = 5;
+        entries[i].pipe = -1;
+        entries[i].sensor_name = "bench";
+        decode_plan_init(&entries[i].plan, DECODE_UNIT_F);
+        bench_addr(entries[i].addr, i * 7);
+        entries[i].next = head;
+        head = &entries[i];
+    }
+
+    return head;
+}
+
+/* mixed stream over the mapped sensors, one in ten from unknown ones */
+static void bench_make_packets(bench_ctx_t *ctx) {
+    uint32_t i;
+
+    srand(ctx->sensors);
+    for(i = 0; i < BENCH_PACKETS; i++) {
+        sensor_struct_t *pmsg = &ctx->packets[i];
+        uint32_t n = ((uint32_t)rand() % ctx->sensors) * 7;
+
+        bench_addr(pmsg->addr, BENCH_KNOWN(i) ? n : n + 1);
+        pmsg->type_instance = 0;
+
+        switch(i % 4) {
+        case 0:
+            pmsg->type = SENSOR_TYPE_TEMP;
+            pmsg->model = TEMP_MODEL_DHT22;
+            pmsg->value.uint16_value = (uint16_t)(rand() % 400);
+            break;
+        case 1:
+            pmsg->type = SENSOR_TYPE_HUMIDITY;
+            pmsg->model = TEMP_MODEL_DHT22;
+            pmsg->value.uint16_value = (uint16_t)(rand() % 1000);
+            break;
+        case 2:
+            pmsg->type = SENSOR_TYPE_VOLTAGE;
+            pmsg->model = VOLT_MODEL_16B_2X33VREF;
+            pmsg->value.uint16_value = (uint16_t)rand();
+            break;
+        default:
+            pmsg->type = SENSOR_TYPE_MOTION;
+            pmsg->model = SENSOR_MODEL_NONE;
+            pmsg->value.uint8_value = (uint8_t)(rand() & 1);
+            break;
+        }
+    }
+}
+
+static void bench_setup(bench_ctx_t *ctx, uint32_t sensors) {
+    memset(ctx, 0, sizeof(bench_ctx_t));
+
+    ctx->sensors = sensors;
+    ctx->entries = (addr_map_t *)calloc(sensors, sizeof(addr_map_t));
+    ctx->addrs = (uint8_t *)calloc(sensors, 5);
+    ctx->packets = (sensor_struct_t *)calloc(BENCH_PACKETS,
+                                             sizeof(sensor_struct_t));
+    ctx->cached = (sensor_entry_t **)calloc(BENCH_PACKETS,
+                                            sizeof(sensor_entry_t *));
+    if(!ctx->entries || !ctx->addrs || !ctx->packets || !ctx->cached) {
+        ERROR("Malloc error");
+        exit(EXIT_FAILURE);
+    }
+
+    ctx->list = bench_make_list(sensors, ctx->entries, ctx->addrs);
+    bench_make_packets(ctx);
+
+    ctx->snap.publish_mode = PUBLISH_TOPIC;
+    ctx->snap.publish_raw = true;
+    ctx->snap.batch_window_ms = 500;
+    ctx->snap.batch_max = 32;
+    ctx->snap.map.next = ctx->list;
+    addrmap_build(&ctx->snap.index[0], ctx->snap.map.next, -1);
+    cfg_swap(&ctx->snap);
+    sensor_cache_init(&ctx->cache, &ctx->snap);
+
+    /* resolved up front, so the format stages don't depend on lookup */
+    for(uint32_t i = 0; i < BENCH_PACKETS; i++)
+        ctx->cached[i] = sensor_cache_lookup(&ctx->cache,
+                                             ctx->packets[i].addr, 0);
+}
+
+static void bench_teardown(bench_ctx_t *ctx) {
+    sensor_cache_deinit(&ctx->cache);
+    addrmap_free(&ctx->snap.index[0]);
+
+    free(ctx->cached);
+    free(ctx->packets);
+    free(ctx->addrs);
+    free(ctx->entries);
+}
+
+/*
+ * Run one stage over the packet stream for at least bench_min_ns,
+ * after one untimed warm up pass, and report it.
+ */
+static bool bench_run(bench_ctx_t *ctx, const char *stage, const char *impl,
+                      bench_fn_t fn, bool must_not_alloc) {
+    uint64_t start, elapsed, count = 0;
+    uint32_t i;
+
+    if(bench_only && strcmp(bench_only, stage))
+        return true;
+
+    /* dispatch stops before publishing anything, so it'd time nothing */
+    if(!strcmp(stage, "publish") && !ctx->snap.publish_raw) {
+        ERROR("%s/%s runs with publish_raw off", stage, impl);
+        return false;
+    }
+
+    for(i = 0; i < BENCH_PACKETS; i++)
+        fn(ctx, &ctx->packets[i], i);
+
+    ctx->missed = 0;
+    bench_allocs = 0;
+    bench_bytes = 0;
+    bench_counting = 1;
+    start = bench_now_ns();
+    do {
+        for(i = 0; i < BENCH_BATCH; i++, count++) {
+            uint32_t idx = (uint32_t)(count % BENCH_PACKETS);
+            fn(ctx, &ctx->packets[idx], idx);
+        }
+        elapsed = bench_now_ns() - start;
+    } while(elapsed < bench_min_ns);
+    bench_counting = 0;
+
+    printf("{\"stage\": \"%s\", \"impl\": \"%s\", \"sensors\": %u, "
+           "\"packets\": %llu, \"ns_per_packet\": %.2f, "
+           "\"packets_per_sec\": %.0f, \"allocs\": %llu, "
+           "\"allocs_per_packet\": %.4f, \"wire_bytes_per_packet\": %.1f}\n",
+           stage, impl, ctx->sensors, (unsigned long long)count,
+           (double)elapsed / count, count * 1e9 / elapsed,
+           (unsigned long long)bench_allocs,
+           (double)bench_allocs / count, (double)bench_bytes / count);
+    fflush(stdout);
+
+    if(ctx->missed) {
+        ERROR("%s/%s skipped %llu packets from known sensors", stage, impl,
+              (unsigned long long)ctx->missed);
+        return false;
+    }
+
+    if(must_not_alloc && bench_allocs) {
+        ERROR("%s/%s allocated %llu times in steady state", stage, impl,
+              (unsigned long long)bench_allocs);
+        return false;
+    }
+
+    return true;
+}
+
+/* address lookup: the old cfg_find_map() list walk */
+static void bench_lookup_linear(bench_ctx_t *ctx, sensor_struct_t *pmsg,
+                                uint32_t idx) {
+    addr_map_t *pmap = ctx->list;
+
+    while(pmap) {
+        if(memcmp(pmsg->addr, pmap->addr, 5) == 0)
+            break;
+        pmap = pmap->next;
+    }
+    bench_sink = (uintptr_t)pmap;
+}
+
+/* address lookup: the hashed index */
+static void bench_lookup_hashed(bench_ctx_t *ctx, sensor_struct_t *pmsg,
+                                uint32_t idx) {
+    bench_sink = (uintptr_t)cfg_find_map(&ctx->snap, pmsg->addr, 0);
+}
+
+/* address lookup: hashed index plus per-sensor cache, as dispatched */
+static void bench_lookup_cached(bench_ctx_t *ctx, sensor_struct_t *pmsg,
+                                uint32_t idx) {
+    bench_sink = (uintptr_t)sensor_cache_lookup(&ctx->cache, pmsg->addr, 0);
+}
+
+static void bench_decode(bench_ctx_t *ctx, sensor_struct_t *pmsg,
+                         uint32_t idx) {
+    int32_t value;
+    int decimals;
+
+    if(decode_reading(&ctx->entries[0].plan, pmsg, &value, &decimals))
+        bench_sink = (uintptr_t)value + decimals;
+}
+
+/* 10us apart, so the 200ms window overflows the ring and recycles */
+static void bench_dedup(bench_ctx_t *ctx, sensor_struct_t *pmsg,
+                        uint32_t idx) {
+    ctx->now_ns += 10000;
+    bench_sink = dedup_seen(&ctx->dedup, pmsg, ctx->now_ns);
+}
+
+static void bench_dump(bench_ctx_t *ctx, sensor_struct_t *pmsg,
+                       uint32_t idx) {
+    mqtt_dump_message(pmsg);
+}
+
+/* topic and value formatting, for packets from known sensors */
+static void bench_format(bench_ctx_t *ctx, sensor_struct_t *pmsg,
+                         uint32_t idx) {
+    sensor_entry_t *sensor = ctx->cached[idx];
+    sensor_topic_t *topic;
+    char value[FORMAT_FIXED_MAX];
+    int32_t fixed;
+    int decimals;
+
+    if(!sensor ||
+       !decode_reading(&sensor->map->plan, pmsg, &fixed, &decimals)) {
+        ctx->missed += BENCH_KNOWN(idx);
+        return;
+    }
+
+    topic = sensor_cache_topic(sensor, pmsg->type, pmsg->type_instance,
+                               mqtt_type_lookup[pmsg->type]);
+    bench_sink = (uintptr_t)topic + format_fixed(value, fixed, decimals);
+}
+
+/* the old asprintf topic/value formatting, for comparison */
+static void bench_format_asprintf(bench_ctx_t *ctx, sensor_struct_t *pmsg,
+                                  uint32_t idx) {
+    sensor_entry_t *sensor = ctx->cached[idx];
+    char *topic = NULL, *value = NULL;
+    int32_t fixed;
+    int decimals;
+
+    if(!sensor ||
+       !decode_reading(&sensor->map->plan, pmsg, &fixed, &decimals)) {
+        ctx->missed += BENCH_KNOWN(idx);
+        return;
+    }
+
+    if(asprintf(&topic, "%s/%s%d", sensor->name,
+                mqtt_type_lookup[pmsg->type], pmsg->type_instance) < 0)
+        return;
+    if(asprintf(&value, "%0.*f", decimals, fixed / bench_scale[decimals]) < 0)
+        value = NULL;
+
+    bench_sink = (uintptr_t)topic + (uintptr_t)value;
+    free(topic);
+    free(value);
+}
+
+/* everything, with mosquitto_publish stubbed out */
+static void bench_publish(bench_ctx_t *ctx, sensor_struct_t *pmsg,
+                          uint32_t idx) {
+    packet_t pkt;
+
+    pkt.rx_ns = ++ctx->now_ns;
+    pkt.pipe = 0;
+    memcpy(&pkt.msg, pmsg, sizeof(sensor_struct_t));
+    mqtt_dispatch(mqtt_worker_get(0), &pkt);
+}
+
+/* segments written by the history stage */
+static void bench_remove_dir(const char *dir) {
+    struct dirent *entry;
+    char path[PATH_MAX];
+    DIR *dp;
+
+    if(!(dp = opendir(dir)))
+        return;
+
+    while((entry = readdir(dp))) {
+        if(entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+
+    closedir(dp);
+    rmdir(dir);
+}
+
+static bool bench_sizes(uint32_t sensors) {
+    char history[] = "/tmp/nrf24-bench.XXXXXX";
+    bench_ctx_t ctx;
+    bool ok = true;
+
+    bench_setup(&ctx, sensors);
+
+    ok &= bench_run(&ctx, "lookup", "linear", bench_lookup_linear, false);
+    ok &= bench_run(&ctx, "lookup", "hashed", bench_lookup_hashed, true);
+    ok &= bench_run(&ctx, "lookup", "cached", bench_lookup_cached, true);
+    ok &= bench_run(&ctx, "decode", "table", bench_decode, true);
+
+    if(dedup_init(&ctx.dedup, 4096, 200)) {
+        ok &= bench_run(&ctx, "dedup", "hashed", bench_dedup, true);
+        dedup_deinit(&ctx.dedup);
+    }
+
+    ok &= bench_run(&ctx, "dump", "disabled", bench_dump, true);
+    ok &= bench_run(&ctx, "format", "asprintf", bench_format_asprintf, false);
+    ok &= bench_run(&ctx, "format", "fixed", bench_format, true);
+
+    mqtt_init(1);
+    ok &= bench_run(&ctx, "publish", "stub", bench_publish, true);
+
+    /* single threaded, so the snapshot can be changed under mqtt */
+    ctx.snap.publish_on_change = true;
+    ctx.snap.max_silence = 300;
+    ctx.snap.deadband[SENSOR_TYPE_TEMP] = 200;
+    ctx.snap.deadband[SENSOR_TYPE_HUMIDITY] = 500;
+    ctx.snap.deadband[SENSOR_TYPE_VOLTAGE] = 10;
+    ok &= bench_run(&ctx, "publish", "on-change", bench_publish, true);
+    ctx.snap.publish_on_change = false;
+
+    ctx.snap.publish_mode = PUBLISH_JSON;
+    ok &= bench_run(&ctx, "publish", "json", bench_publish, true);
+    ctx.snap.publish_mode = PUBLISH_TOPIC;
+
+    /* every reading pushes its sensor's liveness timer out */
+    for(uint32_t i = 0; i < sensors; i++)
+        ctx.entries[i].offline_after = 300;
+    ok &= bench_run(&ctx, "publish", "liveness", bench_publish, true);
+    for(uint32_t i = 0; i < sensors; i++)
+        ctx.entries[i].offline_after = 0;
+    mqtt_deinit();
+
+    /* every reading also goes into a history block on disk */
+    if(mkdtemp(history)) {
+        config.tsdb_dir = history;
+        config.tsdb_segment_hours = 24;
+        config.tsdb_flush_interval = 300;
+        mqtt_init(1);
+        ok &= bench_run(&ctx, "publish", "history", bench_publish, true);
+        mqtt_deinit();
+        config.tsdb_dir = NULL;
+        bench_remove_dir(history);
+    }
+
+    /* bytes on the wire against "stub": topic aliases, then payloads */
+    config.mqtt_v5 = true;
+    config.mqtt_topic_aliases = 1024;
+    mqtt_init(1);
+    ok &= bench_run(&ctx, "publish", "v5-alias", bench_publish, true);
+    ctx.snap.payload_format = PAYLOAD_BINARY;
+    ok &= bench_run(&ctx, "publish", "v5-alias-binary", bench_publish, true);
+    ctx.snap.payload_format = PAYLOAD_CBOR;
+    ok &= bench_run(&ctx, "publish", "v5-alias-cbor", bench_publish, true);
+    ctx.snap.payload_raw = true;
+    ok &= bench_run(&ctx, "publish", "v5-alias-cbor-raw", bench_publish,
+                    true);
+    ctx.snap.payload_raw = false;
+    ctx.snap.payload_format = PAYLOAD_TEXT;
+    mqtt_deinit();
+    config.mqtt_v5 = false;
+
+    bench_teardown(&ctx);
+    return ok;
+}
+
+static void bench_usage(char *a0) {
+    fprintf(stderr, "Usage: %s [args]\n\n", a0);
+    fprintf(stderr, "Valid args:\n\n");
+    fprintf(stderr, " -s <stage>          only run one stage (lookup, decode, dedup,\n");
+    fprintf(stderr, "                     dump, format, publish)\n");
+    fprintf(stderr, " -t <ms>             minimum run time per measurement\n");
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    bool ok = true;
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:t:")) != -1) {
+        switch(opt) {
+        case 's':
+            bench_only = optarg;
+            break;
+        case 't':
+            bench_min_ns = (uint64_t)atoi(optarg) * 1000000ULL;
+            break;
+        default:
+            bench_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    debug_level(DBG_ERROR);
+
+    ok &= bench_sizes(10);
+    ok &= bench_sizes(1000);
+    ok &= bench_sizes(100000);
+
+    if(!ok) {
+        ERROR("Steady state path allocated memory, or a stage was "
+              "misconfigured");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,149 @@
+/*
+ * capture.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "nrf24-mqtt.h"
+#include "debug.h"
+#include "capture.h"
+
+static FILE *capture_fp = NULL;
+
+/*
+ * Every receive thread writes its bursts here, before they're split
+ * across the publisher workers, so each radio's records are in rx
+ * order.  With several radios the streams interleave and can be a
+ * little out of order with each other; replay copes with that.
+ */
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* append to an existing capture of this version, or start a new one */
+bool capture_open(const char *file) {
+    capture_header_t header;
+    long size;
+
+    capture_fp = fopen(file, "a+b");
+    if(!capture_fp) {
+        ERROR("Cannot open capture file %s: %s", file, strerror(errno));
+        return false;
+    }
+
+    fseek(capture_fp, 0, SEEK_END);
+    size = ftell(capture_fp);
+
+    if(size > 0) {
+        rewind(capture_fp);
+        if(fread(&header, sizeof(header), 1, capture_fp) != 1 ||
+           memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) ||
+           header.version != CAPTURE_VERSION) {
+            ERROR("Cannot append to %s: not a version %d capture file",
+                  file, CAPTURE_VERSION);
+            fclose(capture_fp);
+            capture_fp = NULL;
+            return false;
+        }
+    } else {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+        header.version = CAPTURE_VERSION;
+        header.record_size = sizeof(capture_record_t);
+
+        if(fwrite(&header, sizeof(header), 1, capture_fp) != 1) {
+            ERROR("Cannot write capture header: %s", strerror(errno));
+            fclose(capture_fp);
+            capture_fp = NULL;
+            return false;
+        }
+    }
+
+    INFO("Capturing packets to %s", file);
+    return true;
+}
+
+void capture_write(const sensor_struct_t *msgs, const uint8_t *pipes,
+                   int count, uint64_t rx_ns) {
+    capture_record_t record;
+
+    if(!capture_fp)
+        return;
+
+    record.rx_ns = rx_ns;
+
+    pthread_mutex_lock(&capture_lock);
+    for(int pos = 0; capture_fp && pos < count; pos++) {
+        memcpy(&record.msg, &msgs[pos], sizeof(sensor_struct_t));
+        record.pipe = pipes ? pipes[pos] : 0;
+
+        if(fwrite(&record, sizeof(record), 1, capture_fp) != 1) {
+            ERROR("Error writing capture file: %s.  Capture stopped",
+                  strerror(errno));
+            fclose(capture_fp);
+            capture_fp = NULL;
+        }
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+void capture_flush(void) {
+    pthread_mutex_lock(&capture_lock);
+    if(capture_fp)
+        fflush(capture_fp);
+    pthread_mutex_unlock(&capture_lock);
+}
+
+void capture_close(void) {
+    pthread_mutex_lock(&capture_lock);
+    if(capture_fp)
+        fclose(capture_fp);
+    capture_fp = NULL;
+    pthread_mutex_unlock(&capture_lock);
+}
+
+FILE *capture_open_read(const char *file, uint16_t *record_size) {
+    capture_header_t header;
+    FILE *fp;
+
+    fp = fopen(file, "rb");
+    if(!fp) {
+        ERROR("Cannot open capture file %s: %s", file, strerror(errno));
+        return NULL;
+    }
+
+    if(fread(&header, sizeof(header), 1, fp) != 1 ||
+       memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) ||
+       !((header.version == CAPTURE_VERSION &&
+          header.record_size == sizeof(capture_record_t)) ||
+         (header.version == 1 &&
+          header.record_size == CAPTURE_V1_RECORD_SIZE))) {
+        ERROR("%s is not a valid capture file", file);
+        fclose(fp);
+        return NULL;
+    }
+
+    *record_size = header.record_size;
+    return fp;
+}
+
+/* older records are a prefix of the current one; the rest reads as 0 */
+bool capture_read(FILE *fp, uint16_t record_size, capture_record_t *record) {
+    memset(record, 0, sizeof(capture_record_t));
+    return fread(record, record_size, 1, fp) == 1;
+}
@@ -0,0 +1,68 @@
+/*
+ * capture.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "nrf24-mqtt.h"
+#include "sensor.h"
+
+/*
+ * Capture file layout: a capture_header_t followed by back-to-back
+ * capture_record_t.  Host byte order; these are meant to be replayed
+ * on the same kind of box they were captured on.
+ *
+ * Version 2 added the pipe; version 1 files still replay, as pipe 0.
+ */
+#define CAPTURE_MAGIC   "NRF24CAP"
+#define CAPTURE_VERSION 2
+#define CAPTURE_V1_RECORD_SIZE 20
+
+#ifndef __AVR__
+#pragma pack(push, 1)
+#endif
+typedef struct {
+    char magic[8];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t reserved;
+} capture_header_t;
+
+typedef struct {
+    uint64_t rx_ns;
+    sensor_struct_t msg;
+    uint8_t pipe;
+} capture_record_t;
+#ifndef __AVR__
+#pragma pack(pop)
+#endif
+
+extern bool capture_open(const char *file);
+extern void capture_write(const sensor_struct_t *msgs, const uint8_t *pipes,
+                          int count, uint64_t rx_ns);
+extern void capture_flush(void);
+extern void capture_close(void);
+
+extern FILE *capture_open_read(const char *file, uint16_t *record_size);
+extern bool capture_read(FILE *fp, uint16_t record_size,
+                         capture_record_t *record);
+
+#endif /* _CAPTURE_H_ */
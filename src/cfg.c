@@ -20,15 +20,24 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <libconfig.h>
 
 #include "nrf24-mqtt.h"
 #include "debug.h"
 #include "cfg.h"
+#include "addrmap.h"
 
 cfg_t config;
 
+static cfg_snapshot_t *cfg_current = NULL;
+static cfg_snapshot_t *cfg_retired = NULL;   /* replaced, not yet freed */
+static uint64_t cfg_generation = 0;
+static cfg_reader_t *cfg_readers = NULL;
+static pthread_mutex_t cfg_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int cfg_hex_digit(const char digit) {
     if(digit >= 'a' && digit <= 'f')
         return digit - 'a' + 10;
@@ -68,9 +77,525 @@ static uint8_t *cfg_addr_from_string(const char *hex) {
     return retval;
 }
 
+/*
+ * Like cfg_addr_from_string, but trailing bytes may be given as "**"
+ * to match any value.  prefix_len gets the number of fixed bytes.
+ */
+static uint8_t *cfg_addr_pattern_from_string(const char *hex, uint8_t *prefix_len) {
+    char fixed[11];
+    uint8_t *retval;
+    int pos;
+
+    if(strlen(hex) != 10)
+        return NULL;
+
+    for(pos = 0; pos < 5; pos++) {
+        if(hex[pos * 2] == '*' || hex[pos * 2 + 1] == '*')
+            break;
+    }
+    *prefix_len = (uint8_t)pos;
+
+    for(; pos < 5; pos++) {
+        if(hex[pos * 2] != '*' || hex[pos * 2 + 1] != '*')
+            return NULL;
+    }
+
+    memset(fixed, '0', 10);
+    memcpy(fixed, hex, *prefix_len * 2);
+    fixed[10] = '\0';
+
+    retval = cfg_addr_from_string(fixed);
+    return retval;
+}
+
+static bool cfg_radio_parse(config_setting_t *setting, radio_cfg_t *radio,
+                            int index) {
+    config_setting_t *list;
+    const char *svalue;
+    char name[32];
+    int ivalue;
+    int pipe;
+
+    radio->ce_pin = RADIO_CE_PIN_DEFAULT;
+    radio->irq_pin = RADIO_IRQ_PIN_DEFAULT;
+    radio->channel = RADIO_CHANNEL_DEFAULT;
+    radio->burst_drain = true;
+    radio->cpu = -1;
+
+    if(config_setting_lookup_string(setting, "backend", &svalue) ||
+       config_setting_lookup_string(setting, "radio_backend", &svalue))
+        radio->backend = strdup(svalue);
+
+    if(config_setting_lookup_string(setting, "name", &svalue)) {
+        radio->name = strdup(svalue);
+    } else {
+        snprintf(name, sizeof(name), "radio%d", index);
+        radio->name = strdup(name);
+    }
+
+    if(config_setting_lookup_int(setting, "device", &ivalue))
+        radio->device = ivalue;
+
+    if(config_setting_lookup_int(setting, "ce_pin", &ivalue))
+        radio->ce_pin = ivalue;
+
+    if(config_setting_lookup_int(setting, "irq_pin", &ivalue))
+        radio->irq_pin = ivalue;
+
+    if(config_setting_lookup_int(setting, "channel", &ivalue)) {
+        if(ivalue < 0 || ivalue > 125) {
+            ERROR("Invalid channel for %s: %d (0-125)", radio->name, ivalue);
+            return false;
+        }
+        radio->channel = ivalue;
+    }
+
+    if(config_setting_lookup_bool(setting, "burst_drain", &ivalue))
+        radio->burst_drain = ivalue;
+
+    if(config_setting_lookup_int(setting, "cpu", &ivalue) ||
+       config_setting_lookup_int(setting, "radio_cpu", &ivalue)) {
+        if(ivalue < -1 || ivalue >= CPU_SETSIZE) {
+            ERROR("Invalid cpu for %s: %d", radio->name, ivalue);
+            return false;
+        }
+        radio->cpu = ivalue;
+    }
+
+    if(config_setting_lookup_int(setting, "priority", &ivalue) ||
+       config_setting_lookup_int(setting, "radio_priority", &ivalue)) {
+        if(ivalue < 0 || ivalue > 99) {
+            ERROR("Invalid priority for %s: %d (0-99)", radio->name, ivalue);
+            return false;
+        }
+        radio->priority = ivalue;
+    }
+
+    /* listen_addresses go on pipes 0 on up; listen_address is just pipe 0 */
+    list = config_setting_get_member(setting, "listen_addresses");
+    if(list) {
+        radio->pipe_count = config_setting_length(list);
+        if(radio->pipe_count > NRF24_PIPES) {
+            ERROR("Too many listen addresses for %s: %d (max %d)",
+                  radio->name, radio->pipe_count, NRF24_PIPES);
+            return false;
+        }
+
+        for(pipe = 0; pipe < radio->pipe_count; pipe++) {
+            svalue = config_setting_get_string(config_setting_get_elem(list,
+                                                                       pipe));
+            if(!svalue || !(radio->listen_addresses[pipe] =
+                            cfg_addr_from_string(svalue))) {
+                ERROR("Invalid listen address for %s pipe %d: %s",
+                      radio->name, pipe, svalue ? svalue : "(not a string)");
+                return false;
+            }
+        }
+    } else if(config_setting_lookup_string(setting, "listen_address", &svalue)) {
+        radio->listen_addresses[0] = cfg_addr_from_string(svalue);
+        if(!radio->listen_addresses[0]) {
+            ERROR("Invalid listen address: %s", svalue);
+            return false;
+        }
+        radio->pipe_count = 1;
+    }
+
+    /* the chip only lets pipes 2-5 differ from pipe 1 in the last byte */
+    for(pipe = 2; pipe < radio->pipe_count; pipe++) {
+        if(memcmp(radio->listen_addresses[pipe],
+                  radio->listen_addresses[1], 4)) {
+            ERROR("Listen address for %s pipe %d must match pipe 1 "
+                  "in all but the last byte", radio->name, pipe);
+            return false;
+        }
+    }
+
+    if(config_setting_lookup_string(setting, "ingest_socket", &svalue))
+        radio->ingest_socket = strdup(svalue);
+
+    if(config_setting_lookup_string(setting, "replay_file", &svalue))
+        radio->replay_file = strdup(svalue);
+
+    if(config_setting_lookup_string(setting, "replay_speed", &svalue)) {
+        if(!strcmp(svalue, "fast")) {
+            radio->replay_fast = true;
+        } else if(strcmp(svalue, "realtime")) {
+            ERROR("Invalid replay speed: %s", svalue);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void cfg_snapshot_free(cfg_snapshot_t *snap) {
+    addr_map_t *map;
+
+    for(int pipe = 0; pipe < NRF24_PIPES; pipe++)
+        addrmap_free(&snap->index[pipe]);
+
+    while((map = snap->map.next)) {
+        snap->map.next = map->next;
+        free(map->sensor_name);
+        free(map->addr);
+        free(map);
+    }
+
+    free(snap->aggregate_topic);
+    free(snap);
+}
+
+/*
+ * config_setting_lookup_float() without auto convert only finds
+ * floats, so "temp = 1;" would be silently ignored.  Take any number,
+ * and complain about anything else.
+ */
+static bool cfg_lookup_number(config_setting_t *setting, const char *name,
+                              double *value) {
+    config_setting_t *member = config_setting_get_member(setting, name);
+
+    if(!member)
+        return false;
+
+    switch(config_setting_type(member)) {
+    case CONFIG_TYPE_INT:
+        *value = config_setting_get_int(member);
+        return true;
+    case CONFIG_TYPE_INT64:
+        *value = (double)config_setting_get_int64(member);
+        return true;
+    case CONFIG_TYPE_FLOAT:
+        *value = config_setting_get_float(member);
+        return true;
+    default:
+        WARN("Ignoring %s: not a number", name);
+        return false;
+    }
+}
+
+/*
+ * Work the entry's temp_unit and calibrate settings into its decode
+ * plan, so nothing about them is looked at per reading.
+ *
+ *   calibrate = { temp = { offset = -0.5; }; humidity = { scale = 1.02; }; };
+ */
+static bool cfg_plan_parse(config_setting_t *entry, addr_map_t *map,
+                           int temp_unit) {
+    config_setting_t *calibrate, *setting;
+    const char *svalue;
+    double offset, scale;
+    bool found;
+
+    if(config_setting_lookup_string(entry, "temp_unit", &svalue)) {
+        temp_unit = decode_unit_parse(svalue);
+        if(temp_unit < 0) {
+            ERROR("Invalid temp_unit for %s: %s", map->sensor_name, svalue);
+            return false;
+        }
+    }
+
+    decode_plan_init(&map->plan, temp_unit);
+
+    calibrate = config_setting_get_member(entry, "calibrate");
+    if(!calibrate)
+        return true;
+
+    for(int type = 0; type < MQTT_TYPE_COUNT; type++) {
+        setting = config_setting_get_member(calibrate, mqtt_type_lookup[type]);
+        if(!setting)
+            continue;
+
+        offset = 0;
+        scale = 1;
+        found = cfg_lookup_number(setting, "offset", &offset);
+        found |= cfg_lookup_number(setting, "scale", &scale);
+        if(!found) {
+            ERROR("Calibration for %s %s needs offset or scale",
+                  map->sensor_name, mqtt_type_lookup[type]);
+            return false;
+        }
+
+        decode_plan_calibrate(&map->plan, type, offset, scale);
+    }
+
+    return true;
+}
+
+static bool cfg_map_parse(config_setting_t *entry, cfg_snapshot_t *snap) {
+    addr_map_t *map;
+    const char *c_addr, *c_name;
+    int ivalue;
+
+    if(!config_setting_lookup_string(entry, "address", &c_addr)) {
+        ERROR("Missing address entry in mqtt_map");
+        return false;
+    }
+
+    if(!config_setting_lookup_string(entry, "name", &c_name)) {
+        ERROR("Missing name entry in mqtt_map");
+        return false;
+    }
+
+    map = (addr_map_t *)calloc(1, sizeof(addr_map_t));
+    if(!map) {
+        ERROR("Malloc error");
+        return false;
+    }
+
+    /* on the list straight away, so a bad entry is freed with the rest */
+    map->next = snap->map.next;
+    snap->map.next = map;
+
+    map->sensor_name = strdup(c_name);
+    map->addr = cfg_addr_pattern_from_string(c_addr, &map->prefix_len);
+    map->pipe = -1;
+
+    if(config_setting_lookup_int(entry, "pipe", &ivalue)) {
+        if(ivalue < 0 || ivalue >= NRF24_PIPES) {
+            ERROR("Invalid pipe for %s: %d (0-%d)", c_name, ivalue,
+                  NRF24_PIPES - 1);
+            return false;
+        }
+        map->pipe = (int8_t)ivalue;
+        snap->pipe_maps = true;
+    }
+
+    if(!map->sensor_name) {
+        ERROR("Malloc error");
+        return false;
+    }
+
+    if(!map->addr) {
+        ERROR("Badly formatted address: %s", c_addr);
+        return false;
+    }
+
+    if(map->prefix_len < 5) {
+        int conversions = addrmap_name_conversions(map->sensor_name);
+        if(conversions < 0 || conversions > 5 - map->prefix_len) {
+            ERROR("Bad name format for wildcard address %s: %s",
+                  c_addr, c_name);
+            return false;
+        }
+    }
+
+    /* how often it should be heard from, for the liveness tracking */
+    ivalue = (int)snap->report_interval;
+    config_setting_lookup_int(entry, "report_interval", &ivalue);
+    if(ivalue < 0) {
+        ERROR("Invalid report_interval for %s: %d", c_name, ivalue);
+        return false;
+    }
+    map->offline_after = (uint32_t)ivalue * snap->offline_after_missed;
+
+    return cfg_plan_parse(entry, map, snap->temp_unit);
+}
+
+static uint32_t cfg_gcd(uint32_t a, uint32_t b) {
+    while(b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/*
+ * aggregate_windows = [ 60, 300 ];  in seconds.  The accumulators
+ * step at the gcd of the windows and hold AGG_SLOTS steps, which
+ * limits how far apart the windows can be.
+ */
+static bool cfg_aggregate_parse(config_t *cfg, cfg_snapshot_t *snap) {
+    config_setting_t *setting;
+    const char *svalue;
+    uint32_t windows[AGG_WINDOWS_MAX];
+    uint32_t step = 0, longest = 0;
+    int count, ivalue;
+
+    setting = config_lookup(cfg, "aggregate_windows");
+    if(!setting)
+        return true;
+
+    count = config_setting_length(setting);
+    if(count > AGG_WINDOWS_MAX) {
+        ERROR("Too many aggregate windows: %d (max %d)", count,
+              AGG_WINDOWS_MAX);
+        return false;
+    }
+
+    for(int i = 0; i < count; i++) {
+        ivalue = config_setting_get_int(config_setting_get_elem(setting, i));
+        if(ivalue < 1) {
+            ERROR("Invalid aggregate window: %d", ivalue);
+            return false;
+        }
+        windows[i] = (uint32_t)ivalue;
+        step = cfg_gcd(step, windows[i]);
+        if(windows[i] > longest)
+            longest = windows[i];
+    }
+
+    if(count && longest / step >= AGG_SLOTS) {
+        ERROR("Aggregate windows too far apart (longest can be at most "
+              "%d times their common step of %ds)", AGG_SLOTS - 1, step);
+        return false;
+    }
+
+    snap->aggregate_topic = strdup(
+        config_lookup_string(cfg, "aggregate_topic", &svalue) ?
+        svalue : "nrf24-mqtt/aggregate");
+    if(!snap->aggregate_topic) {
+        ERROR("Malloc error");
+        return false;
+    }
+
+    for(int i = 0; i < count; i++)
+        snap->aggregate_windows[i] = windows[i] / step;
+    snap->aggregate_count = count;
+    snap->aggregate_step = step;
+    return true;
+}
+
+/* the reloadable settings, as a fresh snapshot.  NULL on error. */
+static cfg_snapshot_t *cfg_snapshot_parse(config_t *cfg) {
+    cfg_snapshot_t *snap;
+    config_setting_t *setting;
+    const char *svalue;
+    int ivalue;
+
+    snap = (cfg_snapshot_t *)calloc(1, sizeof(cfg_snapshot_t));
+    if(!snap) {
+        ERROR("Malloc error");
+        return NULL;
+    }
+
+    snap->max_silence = 300;
+    snap->publish_mode = PUBLISH_TOPIC;
+    snap->batch_window_ms = 500;
+    snap->batch_max = 32;
+    snap->temp_unit = DECODE_UNIT_F;
+    snap->publish_raw = true;
+    snap->offline_after_missed = 3;
+
+    if(config_lookup_string(cfg, "publish_mode", &svalue)) {
+        if(!strcmp(svalue, "topic")) {
+            snap->publish_mode = PUBLISH_TOPIC;
+        } else if(!strcmp(svalue, "json")) {
+            snap->publish_mode = PUBLISH_JSON;
+        } else if(!strcmp(svalue, "both")) {
+            snap->publish_mode = PUBLISH_TOPIC | PUBLISH_JSON;
+        } else {
+            ERROR("Invalid publish mode: %s", svalue);
+            goto fail;
+        }
+    }
+
+    if(config_lookup_string(cfg, "payload_format", &svalue)) {
+        if(!strcmp(svalue, "text")) {
+            snap->payload_format = PAYLOAD_TEXT;
+        } else if(!strcmp(svalue, "binary")) {
+            snap->payload_format = PAYLOAD_BINARY;
+        } else if(!strcmp(svalue, "cbor")) {
+            snap->payload_format = PAYLOAD_CBOR;
+        } else {
+            ERROR("Invalid payload_format: %s (text, binary or cbor)",
+                  svalue);
+            goto fail;
+        }
+    }
+
+    if(config_lookup_bool(cfg, "payload_raw", &ivalue))
+        snap->payload_raw = ivalue;
+
+    if(config_lookup_int(cfg, "batch_window_ms", &ivalue))
+        snap->batch_window_ms = (uint32_t)ivalue;
+
+    if(config_lookup_int(cfg, "batch_max", &ivalue)) {
+        if(ivalue < 1 || ivalue > 256) {
+            ERROR("Invalid batch_max: %d (1-256)", ivalue);
+            goto fail;
+        }
+        snap->batch_max = (uint32_t)ivalue;
+    }
+
+    if(config_lookup_bool(cfg, "publish_on_change", &ivalue))
+        snap->publish_on_change = ivalue;
+
+    if(config_lookup_int(cfg, "max_silence", &ivalue))
+        snap->max_silence = (uint32_t)ivalue;
+
+    if(config_lookup_bool(cfg, "publish_raw", &ivalue))
+        snap->publish_raw = ivalue;
+
+    if(!cfg_aggregate_parse(cfg, snap))
+        goto fail;
+
+    if(config_lookup_string(cfg, "temp_unit", &svalue)) {
+        snap->temp_unit = decode_unit_parse(svalue);
+        if(snap->temp_unit < 0) {
+            ERROR("Invalid temp_unit: %s (F, C or K)", svalue);
+            goto fail;
+        }
+    }
+
+    if(config_lookup_int(cfg, "report_interval", &ivalue)) {
+        if(ivalue < 0) {
+            ERROR("Invalid report_interval: %d", ivalue);
+            goto fail;
+        }
+        snap->report_interval = (uint32_t)ivalue;
+    }
+
+    if(config_lookup_int(cfg, "offline_after_missed", &ivalue)) {
+        if(ivalue < 1) {
+            ERROR("Invalid offline_after_missed: %d", ivalue);
+            goto fail;
+        }
+        snap->offline_after_missed = (uint32_t)ivalue;
+    }
+
+    setting = config_lookup(cfg, "deadband");
+    if(setting) {
+        for(int type = 0; type < MQTT_TYPE_COUNT; type++) {
+            double dvalue;
+
+            if(cfg_lookup_number(setting, mqtt_type_lookup[type], &dvalue))
+                snap->deadband[type] = (int32_t)(dvalue * 1000 + 0.5);
+        }
+    }
+
+    /* build the map */
+    setting = config_lookup(cfg, "mqtt_map");
+    if(setting) {
+        int count = config_setting_length(setting);
+        for(int i = 0; i < count; i++) {
+            if(!cfg_map_parse(config_setting_get_elem(setting, i), snap))
+                goto fail;
+        }
+    }
+
+    /* one index per pipe, but only if any entry cares which pipe */
+    if(!snap->pipe_maps) {
+        if(!addrmap_build(&snap->index[0], snap->map.next, -1))
+            goto fail;
+    } else {
+        for(int pipe = 0; pipe < NRF24_PIPES; pipe++) {
+            if(!addrmap_build(&snap->index[pipe], snap->map.next, pipe))
+                goto fail;
+        }
+    }
+
+    return snap;
+
+fail:
+    cfg_snapshot_free(snap);
+    return NULL;
+}
+
 int cfg_load(char *file) {
     config_t cfg;
     config_setting_t *setting;
+    cfg_snapshot_t *snap;
     const char *svalue;
     int ivalue;
 
@@ -78,6 +603,22 @@ int cfg_load(char *file) {
     config.mqtt_port = 1883;
     config.mqtt_host = strdup("127.0.0.1");
     config.mqtt_keepalive = 60;
+    config.mqtt_topic_aliases = 1024;
+    config.ring_depth = 1024;
+    config.ring_stats_interval = 60;
+    config.dedup_window_ms = 200;
+    config.dedup_entries = 4096;
+    config.publisher_workers = 1;
+    config.stats_topic = strdup("nrf24-mqtt/stats");
+    config.stats_interval = 60;
+    config.log_rate_limit = 10;
+    config.spool_size = 4 * 1024 * 1024;
+    config.spool_replay_rate = 100;
+    config.downlink_topic = strdup("+/+/set");
+    config.downlink_window_ms = 20;
+    config.downlink_retries = 5;
+    config.tsdb_segment_hours = 24;
+    config.tsdb_flush_interval = 300;
 
     config_init(&cfg);
     if(!config_read_file(&cfg, file)) {
@@ -96,94 +637,416 @@ int cfg_load(char *file) {
     if(config_lookup_int(&cfg, "mqtt_keepalive", &ivalue))
         config.mqtt_keepalive = (uint16_t)ivalue;
 
-    if(config_lookup_string(&cfg, "listen_address", &svalue)) {
-        config.listen_address = cfg_addr_from_string(svalue);
-        if(!config.listen_address) {
-            ERROR("Invalid listen address: %s", svalue);
+    if(config_lookup_bool(&cfg, "mqtt_v5", &ivalue))
+        config.mqtt_v5 = ivalue;
+
+    if(config_lookup_int(&cfg, "mqtt_topic_aliases", &ivalue)) {
+        if(ivalue < 0 || ivalue > 65535) {
+            ERROR("Invalid mqtt_topic_aliases: %d (0-65535)", ivalue);
             config_destroy(&cfg);
             return -1;
         }
+        config.mqtt_topic_aliases = (uint16_t)ivalue;
     }
 
-    /* build the map */
-    setting = config_lookup(&cfg, "mqtt_map");
-    if(setting) {
-        addr_map_t *map;
+    if(config_lookup_int(&cfg, "mqtt_qos", &ivalue)) {
+        if(ivalue < 0 || ivalue > 2) {
+            ERROR("Invalid mqtt_qos: %d (0-2)", ivalue);
+            config_destroy(&cfg);
+            return -1;
+        }
+        config.mqtt_qos = ivalue;
+    }
 
-        int count = config_setting_length(setting);
-        for(int i = 0; i < count; i++) {
-            config_setting_t *entry = config_setting_get_elem(setting, i);
-            const char *c_addr, *c_name;
+    /*
+     * libmosquitto resends unacknowledged QoS 1/2 messages as they
+     * were after a reconnect, and an alias-only resend refers to an
+     * alias the new connection never saw.
+     */
+    if(config.mqtt_qos && config.mqtt_topic_aliases) {
+        if(config.mqtt_v5)
+            WARN("Topic aliases are only used with mqtt_qos 0");
+        config.mqtt_topic_aliases = 0;
+    }
 
-            if(!config_setting_lookup_string(entry, "address", &c_addr)) {
-                ERROR("Missing address entry in mqtt_map");
-                exit(EXIT_FAILURE);
-            }
+    if(config_lookup_int(&cfg, "ring_depth", &ivalue)) {
+        if(ivalue < 2) {
+            ERROR("Invalid ring depth: %d", ivalue);
+            config_destroy(&cfg);
+            return -1;
+        }
+        config.ring_depth = (uint32_t)ivalue;
+    }
 
-            if(!config_setting_lookup_string(entry, "name", &c_name)) {
-                ERROR("Missing name entry in mqtt_map");
-                exit(EXIT_FAILURE);
-            }
+    if(config_lookup_int(&cfg, "ring_stats_interval", &ivalue))
+        config.ring_stats_interval = (uint32_t)ivalue;
 
-            map = (addr_map_t *)malloc(sizeof(addr_map_t));
-            if(!map) {
-                ERROR("Malloc error");
-                exit(EXIT_FAILURE);
-            }
+    if(config_lookup_int(&cfg, "dedup_window_ms", &ivalue))
+        config.dedup_window_ms = (uint32_t)ivalue;
 
-            map->sensor_name = strdup(c_name);
-            map->addr = cfg_addr_from_string(c_addr);
+    if(config_lookup_int(&cfg, "dedup_entries", &ivalue)) {
+        if(ivalue < 16) {
+            ERROR("Invalid dedup_entries: %d (at least 16)", ivalue);
+            config_destroy(&cfg);
+            return -1;
+        }
+        config.dedup_entries = (uint32_t)ivalue;
+    }
 
-            if(!map->sensor_name) {
-                ERROR("Malloc error");
-                exit(EXIT_FAILURE);
-            }
+    if(config_lookup_string(&cfg, "stats_topic", &svalue))
+        config.stats_topic = strdup(svalue);
 
-            if(!map->addr) {
-                ERROR("Badly formatted address: %s", c_addr);
-                exit(EXIT_FAILURE);
-            }
-            map->next = config.map.next;
-            config.map.next = map;
+    if(config_lookup_int(&cfg, "stats_interval", &ivalue))
+        config.stats_interval = (uint32_t)ivalue;
+
+    if(config_lookup_int(&cfg, "log_rate_limit", &ivalue))
+        config.log_rate_limit = (uint32_t)ivalue;
+
+    if(config_lookup_bool(&cfg, "event_loop", &ivalue))
+        config.event_loop = ivalue;
+
+    if(config_lookup_int(&cfg, "publisher_workers", &ivalue)) {
+        if(ivalue < 1 || ivalue > CFG_MAX_WORKERS) {
+            ERROR("Invalid publisher_workers: %d (1-%d)", ivalue,
+                  CFG_MAX_WORKERS);
+            config_destroy(&cfg);
+            return -1;
+        }
+        config.publisher_workers = ivalue;
+    }
+
+    /* the loop is one thread, so it drives one connection */
+    if(config.event_loop && config.publisher_workers > 1) {
+        WARN("event_loop uses one publisher worker, not %d",
+             config.publisher_workers);
+        config.publisher_workers = 1;
+    }
+
+    if(config_lookup_bool(&cfg, "mlockall", &ivalue))
+        config.mlockall = ivalue;
+
+    if(config_lookup_string(&cfg, "capture_file", &svalue))
+        config.capture_file = strdup(svalue);
+
+    if(config_lookup_string(&cfg, "spool_file", &svalue))
+        config.spool_file = strdup(svalue);
+
+    if(config_lookup_int(&cfg, "spool_size", &ivalue)) {
+        if(ivalue < 65536) {
+            ERROR("Invalid spool size: %d (at least 65536)", ivalue);
+            config_destroy(&cfg);
+            return -1;
+        }
+        config.spool_size = (uint32_t)ivalue;
+    }
+
+    if(config_lookup_int(&cfg, "spool_replay_rate", &ivalue))
+        config.spool_replay_rate = (uint32_t)ivalue;
+
+    if(config_lookup_bool(&cfg, "downlink", &ivalue))
+        config.downlink = ivalue;
+
+    if(config_lookup_string(&cfg, "downlink_topic", &svalue))
+        config.downlink_topic = strdup(svalue);
+
+    if(config_lookup_string(&cfg, "downlink_radio", &svalue))
+        config.downlink_radio = strdup(svalue);
+
+    if(config_lookup_int(&cfg, "downlink_window_ms", &ivalue))
+        config.downlink_window_ms = (uint32_t)ivalue;
+
+    if(config_lookup_int(&cfg, "downlink_retries", &ivalue)) {
+        if(ivalue < 0 || ivalue > 15) {
+            ERROR("Invalid downlink_retries: %d (0-15)", ivalue);
+            config_destroy(&cfg);
+            return -1;
+        }
+        config.downlink_retries = ivalue;
+    }
+
+    if(config_lookup_string(&cfg, "tsdb_dir", &svalue))
+        config.tsdb_dir = strdup(svalue);
+
+    if(config_lookup_int(&cfg, "tsdb_segment_hours", &ivalue)) {
+        if(ivalue < 1) {
+            ERROR("Invalid tsdb_segment_hours: %d", ivalue);
+            config_destroy(&cfg);
+            return -1;
         }
+        config.tsdb_segment_hours = (uint32_t)ivalue;
     }
 
+    if(config_lookup_int(&cfg, "tsdb_retention_days", &ivalue))
+        config.tsdb_retention_days = (uint32_t)ivalue;
+
+    if(config_lookup_int(&cfg, "tsdb_flush_interval", &ivalue))
+        config.tsdb_flush_interval = (uint32_t)ivalue;
+
+    /* a list of radios, or just the one described at the top level */
+    setting = config_lookup(&cfg, "radios");
+    config.radio_count = setting ? config_setting_length(setting) : 1;
+    if(!config.radio_count) {
+        ERROR("No radios configured");
+        config_destroy(&cfg);
+        return -1;
+    }
+
+    config.radios = (radio_cfg_t *)calloc(config.radio_count,
+                                          sizeof(radio_cfg_t));
+    if(!config.radios) {
+        ERROR("Malloc error");
+        config_destroy(&cfg);
+        return -1;
+    }
+
+    for(int i = 0; i < config.radio_count; i++) {
+        if(!cfg_radio_parse(setting ? config_setting_get_elem(setting, i) :
+                            config_root_setting(&cfg),
+                            &config.radios[i], i)) {
+            config_destroy(&cfg);
+            return -1;
+        }
+    }
+
+    snap = cfg_snapshot_parse(&cfg);
     config_destroy(&cfg);
+    if(!snap)
+        return -1;
+
+    cfg_swap(snap);
     return 0;
 }
 
-void cfg_dump(void) {
-    addr_map_t *pmap;
+/*
+ * Called from the main thread on SIGHUP.  Only the snapshot settings
+ * are re-read; radios, the broker and the rings need a restart.  A
+ * bad file leaves the running config alone.
+ */
+int cfg_reload(char *file) {
+    config_t cfg;
+    cfg_snapshot_t *snap, *old;
+
+    config_init(&cfg);
+    if(!config_read_file(&cfg, file)) {
+        ERROR("%s:%d - %s", config_error_file(&cfg),
+              config_error_line(&cfg), config_error_text(&cfg));
+        config_destroy(&cfg);
+        return -1;
+    }
+
+    snap = cfg_snapshot_parse(&cfg);
+    config_destroy(&cfg);
+    if(!snap)
+        return -1;
+
+    old = cfg_swap(snap);
+    old->retired_next = cfg_retired;
+    cfg_retired = old;
+
+    INFO("Loaded configuration generation %llu from %s",
+         (unsigned long long)snap->generation, file);
+    cfg_snapshot_dump(snap);
+    return 0;
+}
+
+/*
+ * The running snapshot.  A plain atomic load, so safe on the
+ * receive and publish paths.
+ */
+cfg_snapshot_t *cfg_snapshot(void) {
+    return __atomic_load_n(&cfg_current, __ATOMIC_ACQUIRE);
+}
+
+/* make snap current, returning the one it replaced */
+cfg_snapshot_t *cfg_swap(cfg_snapshot_t *snap) {
+    snap->generation = ++cfg_generation;
+    return __atomic_exchange_n(&cfg_current, snap, __ATOMIC_ACQ_REL);
+}
 
-    DEBUG("Listen address: 0x%02x%02x%02x%02x%02x",
-          config.listen_address[0],
-          config.listen_address[1],
-          config.listen_address[2],
-          config.listen_address[3],
-          config.listen_address[4]);
+void cfg_reader_register(cfg_reader_t *reader, cfg_snapshot_t *snap) {
+    reader->generation = snap->generation;
+
+    pthread_mutex_lock(&cfg_readers_lock);
+    reader->next = cfg_readers;
+    cfg_readers = reader;
+    pthread_mutex_unlock(&cfg_readers_lock);
+}
+
+void cfg_reader_unregister(cfg_reader_t *reader) {
+    cfg_reader_t **prev;
+
+    pthread_mutex_lock(&cfg_readers_lock);
+    for(prev = &cfg_readers; *prev; prev = &(*prev)->next) {
+        if(*prev == reader) {
+            *prev = reader->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cfg_readers_lock);
+}
+
+/*
+ * The reader has let go of every snapshot older than snap.  Call
+ * only once nothing from the old snapshot is referenced any more.
+ */
+void cfg_reader_quiescent(cfg_reader_t *reader, cfg_snapshot_t *snap) {
+    __atomic_store_n(&reader->generation, snap->generation, __ATOMIC_RELEASE);
+}
+
+/*
+ * Free the retired snapshots no reader can still be using.  Called
+ * from the main thread, which is the only one that retires them.
+ */
+void cfg_reclaim(void) {
+    uint64_t oldest = UINT64_MAX;
+    uint64_t generation;
+    cfg_snapshot_t **prev, *snap;
+    cfg_reader_t *reader;
+
+    if(!cfg_retired)
+        return;
+
+    pthread_mutex_lock(&cfg_readers_lock);
+    for(reader = cfg_readers; reader; reader = reader->next) {
+        generation = __atomic_load_n(&reader->generation, __ATOMIC_ACQUIRE);
+        if(generation < oldest)
+            oldest = generation;
+    }
+    pthread_mutex_unlock(&cfg_readers_lock);
+
+    prev = &cfg_retired;
+    while((snap = *prev)) {
+        if(snap->generation < oldest) {
+            *prev = snap->retired_next;
+            DEBUG("Freeing configuration generation %llu",
+                  (unsigned long long)snap->generation);
+            cfg_snapshot_free(snap);
+        } else {
+            prev = &snap->retired_next;
+        }
+    }
+}
+
+void cfg_dump(void) {
     DEBUG("MQTT Address: %s:%d", config.mqtt_host,
           config.mqtt_port);
     DEBUG("MQTT Keepalive: %d", config.mqtt_keepalive);
-    pmap = config.map.next;
+    if(config.mqtt_v5)
+        DEBUG("MQTT 5, up to %d topic aliases", config.mqtt_topic_aliases);
+    DEBUG("MQTT QoS: %d", config.mqtt_qos);
+    DEBUG("Ring depth: %d", config.ring_depth);
+    DEBUG("Ring stats interval: %d", config.ring_stats_interval);
+    if(config.dedup_window_ms)
+        DEBUG("Dedup window: %d ms, %d entries", config.dedup_window_ms,
+              config.dedup_entries);
+    DEBUG("Stats topic: %s every %ds", config.stats_topic,
+          config.stats_interval);
+    DEBUG("Log rate limit: %d/s", config.log_rate_limit);
+    DEBUG("Event loop: %s", config.event_loop ? "epoll" : "threads");
+    DEBUG("Publisher workers: %d", config.publisher_workers);
+    DEBUG("Lock memory: %s", config.mlockall ? "yes" : "no");
+    for(int i = 0; i < config.radio_count; i++) {
+        radio_cfg_t *radio = &config.radios[i];
+
+        DEBUG("Radio %s: backend %s, device %d, pins %d/%d, channel %d",
+              radio->name, radio->backend ? radio->backend : "default",
+              radio->device, radio->ce_pin, radio->irq_pin, radio->channel);
+        if(radio->cpu != -1 || radio->priority)
+            DEBUG("Radio %s: cpu %d, priority %d", radio->name, radio->cpu,
+                  radio->priority);
+        for(int pipe = 0; pipe < radio->pipe_count; pipe++)
+            DEBUG("Radio %s: pipe %d listen address 0x%02x%02x%02x%02x%02x",
+                  radio->name, pipe,
+                  radio->listen_addresses[pipe][0],
+                  radio->listen_addresses[pipe][1],
+                  radio->listen_addresses[pipe][2],
+                  radio->listen_addresses[pipe][3],
+                  radio->listen_addresses[pipe][4]);
+        if(radio->ingest_socket)
+            DEBUG("Radio %s: ingest socket %s", radio->name,
+                  radio->ingest_socket);
+        if(radio->replay_file)
+            DEBUG("Radio %s: replay %s (%s)", radio->name, radio->replay_file,
+                  radio->replay_fast ? "fast" : "realtime");
+    }
+    if(config.capture_file)
+        DEBUG("Capture file: %s", config.capture_file);
+    if(config.spool_file)
+        DEBUG("Spool file: %s (%d bytes), replayed at %d/s",
+              config.spool_file, config.spool_size, config.spool_replay_rate);
+    if(config.downlink)
+        DEBUG("Downlink: %s on %s, %d ms windows, %d retries",
+              config.downlink_topic,
+              config.downlink_radio ? config.downlink_radio : "any radio",
+              config.downlink_window_ms, config.downlink_retries);
+    if(config.tsdb_dir)
+        DEBUG("History: %s, %dh segments, kept %d days, flushed every %ds",
+              config.tsdb_dir, config.tsdb_segment_hours,
+              config.tsdb_retention_days, config.tsdb_flush_interval);
+
+    cfg_snapshot_dump(cfg_snapshot());
+}
+
+void cfg_snapshot_dump(const cfg_snapshot_t *snap) {
+    addr_map_t *pmap;
+
+    DEBUG("Publish mode:%s%s",
+          (snap->publish_mode & PUBLISH_TOPIC) ? " topic" : "",
+          (snap->publish_mode & PUBLISH_JSON) ? " json" : "");
+    if(snap->publish_mode & PUBLISH_JSON)
+        DEBUG("Batch window: %d ms, max %d readings",
+              snap->batch_window_ms, snap->batch_max);
+    if(snap->publish_mode & PUBLISH_TOPIC)
+        DEBUG("Payload format: %s%s",
+              snap->payload_format == PAYLOAD_BINARY ? "binary" :
+              snap->payload_format == PAYLOAD_CBOR ? "cbor" : "text",
+              (snap->payload_raw && snap->payload_format != PAYLOAD_TEXT) ?
+              ", with raw struct" : "");
+    DEBUG("Publish on change: %s", snap->publish_on_change ? "yes" : "no");
+    if(snap->publish_on_change) {
+        DEBUG("Max silence: %d", snap->max_silence);
+        for(int type = 0; type < MQTT_TYPE_COUNT; type++) {
+            if(snap->deadband[type])
+                DEBUG("Deadband %s: %d.%03d", mqtt_type_lookup[type],
+                      snap->deadband[type] / 1000,
+                      snap->deadband[type] % 1000);
+        }
+    }
+    DEBUG("Temperature unit: %s", decode_unit_name(snap->temp_unit));
+    DEBUG("Publish raw readings: %s", snap->publish_raw ? "yes" : "no");
+    for(int i = 0; i < snap->aggregate_count; i++)
+        DEBUG("Aggregate every %ds to %s/%d/...",
+              snap->aggregate_windows[i] * snap->aggregate_step,
+              snap->aggregate_topic,
+              snap->aggregate_windows[i] * snap->aggregate_step);
+    pmap = snap->map.next;
     while(pmap) {
-        DEBUG("Map 0x%02x%02x%02x%02x%02x -> %s",
+        DEBUG("Map 0x%02x%02x%02x%02x%02x/%d pipe %c -> %s",
               pmap->addr[0],
               pmap->addr[1],
               pmap->addr[2],
               pmap->addr[3],
               pmap->addr[4],
+              pmap->prefix_len * 8,
+              pmap->pipe < 0 ? '*' : '0' + pmap->pipe,
               pmap->sensor_name);
+        if(pmap->offline_after)
+            DEBUG("Map %s: offline after %ds of silence", pmap->sensor_name,
+                  pmap->offline_after);
+        for(int type = 0; type < MQTT_TYPE_COUNT; type++) {
+            if(!decode_plan_is_identity(&pmap->plan, type))
+                DEBUG("Map %s: %s = raw * %.6f %+.3f", pmap->sensor_name,
+                      mqtt_type_lookup[type], pmap->plan.cal[type].mul / 1e6,
+                      pmap->plan.cal[type].add / 1e3);
+        }
         pmap = pmap->next;
     }
 }
 
-const char *cfg_find_map(uint8_t *addr) {
-    addr_map_t *pmap;
-    pmap = config.map.next;
-    while(pmap) {
-        if(memcmp(addr, pmap->addr, 5) == 0)
-            return pmap->sensor_name;
-        pmap = pmap->next;
-    }
-    return NULL;
+addr_map_t *cfg_find_map(const cfg_snapshot_t *snap, uint8_t *addr,
+                         uint8_t pipe) {
+    if(!snap->pipe_maps || pipe >= NRF24_PIPES)
+        pipe = 0;
+
+    return addrmap_find(&snap->index[pipe], addr);
 }
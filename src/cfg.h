@@ -19,23 +19,148 @@
 #define _CFG_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "nrf24-mqtt.h"
+#include "addrmap.h"
+#include "mqtt.h"
+#include "aggregate.h"
+
+#define PUBLISH_TOPIC 1     /* <name>/<type><instance> per reading */
+#define PUBLISH_JSON  2     /* one json batch per sensor on <name> */
+
+#define PAYLOAD_TEXT   0    /* the value as a decimal string */
+#define PAYLOAD_BINARY 1    /* int32 value, uint8 decimals, big endian */
+#define PAYLOAD_CBOR   2    /* a CBOR integer or decimal fraction */
+
+#define RADIO_CHANNEL_DEFAULT 0x4c
+#define RADIO_CE_PIN_DEFAULT  25
+#define RADIO_IRQ_PIN_DEFAULT 24
+
+#define CFG_MAX_WORKERS 16
+
+/* one receiver: an entry in "radios", or the top level settings */
+typedef struct radio_cfg_t {
+    char *name;
+    char *backend;              /* NULL for the default */
+    int device;                 /* crazyradio index, or SPI device */
+    int ce_pin;
+    int irq_pin;
+    int channel;
+    bool burst_drain;           /* empty the RX FIFO on each IRQ */
+    uint8_t *listen_addresses[NRF24_PIPES];
+    int pipe_count;
+    char *ingest_socket;
+    char *replay_file;
+    bool replay_fast;
+    int cpu;                    /* receive thread affinity, -1 for any */
+    int priority;               /* SCHED_FIFO priority, 0 for none */
+} radio_cfg_t;
 
 typedef struct cfg_t {
     char *mqtt_host;
     uint16_t mqtt_port;
     uint16_t mqtt_keepalive;
+    bool mqtt_v5;                 /* MQTT 5, for topic aliases */
+    uint16_t mqtt_topic_aliases;  /* most to use, 0 for none */
+    int mqtt_qos;                 /* for readings */
 
-    uint8_t *listen_address;
+    uint32_t ring_depth;
+    uint32_t ring_stats_interval;
 
-    addr_map_t map;
+    uint32_t dedup_window_ms;     /* 0 to pass duplicates through */
+    uint32_t dedup_entries;
+
+    char *stats_topic;
+    uint32_t stats_interval;
+
+    uint32_t log_rate_limit;
+
+    bool event_loop;              /* one epoll loop instead of threads */
+    int publisher_workers;        /* each with its own broker connection */
+
+    radio_cfg_t *radios;
+    int radio_count;
+    bool mlockall;                /* lock memory, for the radio threads */
+
+    char *capture_file;
+
+    char *spool_file;
+    uint32_t spool_size;
+    uint32_t spool_replay_rate;   /* readings per second, 0 for no limit */
+
+    bool downlink;                /* switch commands from mqtt */
+    char *downlink_topic;         /* what to subscribe to */
+    char *downlink_radio;         /* NULL for the first that can send */
+    uint32_t downlink_window_ms;  /* commands wait this long to batch */
+    int downlink_retries;         /* auto retransmits per command */
+
+    char *tsdb_dir;               /* NULL for no local history */
+    uint32_t tsdb_segment_hours;
+    uint32_t tsdb_retention_days; /* 0 to keep everything */
+    uint32_t tsdb_flush_interval; /* seconds a block stays in memory */
 } cfg_t;
 
+/*
+ * The part of the config that SIGHUP reloads: the address map and
+ * how readings get published.  A snapshot is never changed once it
+ * is swapped in.  A reload builds a new one, swaps the pointer, and
+ * frees the old one once every reader has moved past it.
+ */
+typedef struct cfg_snapshot_t {
+    uint64_t generation;
+
+    int publish_mode;
+    uint32_t batch_window_ms;
+    uint32_t batch_max;
+
+    int payload_format;            /* PAYLOAD_, for per-topic readings */
+    bool payload_raw;              /* append the sensor struct (not text) */
+
+    bool publish_on_change;
+    uint32_t max_silence;
+    int32_t deadband[MQTT_TYPE_COUNT];   /* thousandths */
+
+    int temp_unit;                 /* default for map entries */
+
+    uint32_t report_interval;      /* default for map entries, 0 untracked */
+    uint32_t offline_after_missed; /* reports missed before offline */
+
+    bool publish_raw;              /* false for just the aggregates */
+    char *aggregate_topic;
+    uint32_t aggregate_windows[AGG_WINDOWS_MAX];   /* in steps */
+    int aggregate_count;
+    uint32_t aggregate_step;       /* seconds */
+
+    addr_map_t map;
+    addrmap_t index[NRF24_PIPES];  /* just [0] unless pipe_maps */
+    bool pipe_maps;                /* some entries are pinned to a pipe */
+
+    struct cfg_snapshot_t *retired_next;
+} cfg_snapshot_t;
+
+/*
+ * A thread that holds on to a snapshot.  generation is the one it is
+ * using; anything older that has been replaced can be freed.
+ */
+typedef struct cfg_reader_t {
+    uint64_t generation;
+    struct cfg_reader_t *next;
+} cfg_reader_t;
+
 extern cfg_t config;
 
 extern int cfg_load(char *file);
+extern int cfg_reload(char *file);
 extern void cfg_dump(void);
-extern const char *cfg_find_map(uint8_t *addr);
+extern void cfg_snapshot_dump(const cfg_snapshot_t *snap);
+extern cfg_snapshot_t *cfg_snapshot(void);
+extern cfg_snapshot_t *cfg_swap(cfg_snapshot_t *snap);
+extern void cfg_reader_register(cfg_reader_t *reader, cfg_snapshot_t *snap);
+extern void cfg_reader_unregister(cfg_reader_t *reader);
+extern void cfg_reader_quiescent(cfg_reader_t *reader, cfg_snapshot_t *snap);
+extern void cfg_reclaim(void);
+extern addr_map_t *cfg_find_map(const cfg_snapshot_t *snap, uint8_t *addr,
+                                uint8_t pipe);
 
 #endif /* _CFG_H_ */
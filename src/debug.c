@@ -17,30 +17,570 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "debug.h"
 
-static int debug_threshold = 2;
+#define DEBUG_RING_DEPTH   256     /* records, per thread */
+#define DEBUG_MAX_ARGS     16
+#define DEBUG_STRINGS_MAX  256
+#define DEBUG_LINE_MAX     1024
+#define DEBUG_POLL_MS      10
+#define DEBUG_CACHELINE    64
+
+#define DEBUG_ARG_BAD      0
+#define DEBUG_ARG_PERCENT  1
+#define DEBUG_ARG_INT      2
+#define DEBUG_ARG_LONG     3
+#define DEBUG_ARG_LLONG    4
+#define DEBUG_ARG_SIZE     5
+#define DEBUG_ARG_PTRDIFF  6
+#define DEBUG_ARG_DOUBLE   7
+#define DEBUG_ARG_STRING   8
+#define DEBUG_ARG_PTR      9
+
+/* a string argument that was NULL, or didn't fit */
+#define DEBUG_STRING_NULL  -1
+#define DEBUG_STRING_LOST  -2
+
+typedef union debug_arg_t {
+    int64_t i;
+    double d;
+    const void *p;
+} debug_arg_t;
+
+/*
+ * A log call, not yet formatted.  The format, file and function are
+ * string literals, so only the pointers are kept.  Arguments are
+ * stored in the order the format string consumes them; %s arguments
+ * are copied into strings.  A record that can't be stored this way
+ * (too many arguments, conversions we don't know) is formatted on
+ * the spot into strings and format is left NULL.
+ */
+typedef struct debug_record_t {
+    const char *format;
+    const char *file;
+    const char *func;
+    int16_t level;
+    int16_t nargs;
+    int32_t line;
+    debug_arg_t args[DEBUG_MAX_ARGS];
+    char strings[DEBUG_STRINGS_MAX];
+} debug_record_t;
+
+/* one per logging thread: that thread produces, the writer consumes */
+typedef struct debug_ring_t {
+    uint32_t head __attribute__((aligned(DEBUG_CACHELINE)));
+    uint64_t dropped;
+
+    uint32_t tail __attribute__((aligned(DEBUG_CACHELINE)));
+    uint64_t reported;
+
+    struct debug_ring_t *next __attribute__((aligned(DEBUG_CACHELINE)));
+    debug_record_t slots[DEBUG_RING_DEPTH];
+} debug_ring_t;
+
+typedef struct debug_spec_t {
+    int kind;
+    int stars;
+    int precision;      /* -1 if none, -2 if given by a star */
+    size_t len;
+} debug_spec_t;
+
+int debug_threshold = 2;
+
+static uint32_t debug_limit_rate = 10;
+static bool debug_async = false;
+static bool debug_atexit = false;
+static bool debug_quit = false;
+static pthread_t debug_tid;
+static pthread_mutex_t debug_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static debug_ring_t *debug_rings = NULL;
+static __thread debug_ring_t *debug_local = NULL;
+
+static const char *debug_level_names[] = {
+    "FATAL", "ERROR", "WARN", "INFO", "DEBUG"
+};
 
 void debug_level(int newlevel) {
     debug_threshold = newlevel;
 }
 
+void debug_rate_limit(uint32_t per_second) {
+    debug_limit_rate = per_second;
+}
+
+/*
+ * Parse the conversion at p (which points at the '%').  Returns
+ * a pointer past it, with the argument it takes in spec.
+ */
+static const char *debug_parse_spec(const char *p, debug_spec_t *spec) {
+    const char *start = p++;
+    int longs = 0;
+    char size = 0;
+
+    spec->kind = DEBUG_ARG_BAD;
+    spec->stars = 0;
+    spec->precision = -1;
+
+    if(*p == '%') {
+        spec->kind = DEBUG_ARG_PERCENT;
+        spec->len = 2;
+        return p + 1;
+    }
+
+    while(*p && strchr("-+ #0'", *p))
+        p++;
+
+    if(*p == '*') {
+        spec->stars++;
+        p++;
+    } else {
+        while(isdigit((unsigned char)*p))
+            p++;
+    }
+
+    if(*p == '.') {
+        p++;
+        if(*p == '*') {
+            spec->stars++;
+            spec->precision = -2;
+            p++;
+        } else {
+            spec->precision = 0;
+            while(isdigit((unsigned char)*p))
+                spec->precision = spec->precision * 10 + (*p++ - '0');
+        }
+    }
+
+    while(*p == 'h')
+        p++;
+    while(*p == 'l') {
+        longs++;
+        p++;
+    }
+    if(*p == 'j' || *p == 'q' || *p == 'z' || *p == 't' || *p == 'L')
+        size = *p++;
+
+    switch(*p) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+        if(size == 'j' || size == 'q' || longs > 1)
+            spec->kind = DEBUG_ARG_LLONG;
+        else if(size == 'z')
+            spec->kind = DEBUG_ARG_SIZE;
+        else if(size == 't')
+            spec->kind = DEBUG_ARG_PTRDIFF;
+        else if(longs)
+            spec->kind = DEBUG_ARG_LONG;
+        else if(!size)
+            spec->kind = DEBUG_ARG_INT;
+        break;
+    case 'e': case 'E': case 'f': case 'F':
+    case 'g': case 'G': case 'a': case 'A':
+        if(!size)
+            spec->kind = DEBUG_ARG_DOUBLE;
+        break;
+    case 's':
+        if(!size && !longs)
+            spec->kind = DEBUG_ARG_STRING;
+        break;
+    case 'p':
+        spec->kind = DEBUG_ARG_PTR;
+        break;
+    }
+
+    if(*p)
+        p++;
+
+    spec->len = (size_t)(p - start);
+    return p;
+}
+
+/* pull the arguments off ap into the record.  false if we can't */
+static bool debug_encode(debug_record_t *rec, const char *format, va_list ap) {
+    debug_spec_t spec;
+    const char *p = format;
+    const char *str;
+    size_t strings = 0;
+    size_t len;
+    int precision;
+    int star;
+
+    rec->nargs = 0;
+
+    while((p = strchr(p, '%'))) {
+        p = debug_parse_spec(p, &spec);
+
+        if(spec.kind == DEBUG_ARG_PERCENT)
+            continue;
+        if(spec.kind == DEBUG_ARG_BAD ||
+           rec->nargs + spec.stars + 1 > DEBUG_MAX_ARGS)
+            return false;
+
+        precision = spec.precision;
+        for(star = 0; star < spec.stars; star++) {
+            precision = va_arg(ap, int);
+            rec->args[rec->nargs++].i = precision;
+        }
+        if(spec.precision != -2)
+            precision = spec.precision;   /* any star was the width */
+        if(precision < 0)
+            precision = -1;
+
+        switch(spec.kind) {
+        case DEBUG_ARG_INT:
+            rec->args[rec->nargs].i = va_arg(ap, int);
+            break;
+        case DEBUG_ARG_LONG:
+            rec->args[rec->nargs].i = va_arg(ap, long);
+            break;
+        case DEBUG_ARG_LLONG:
+            rec->args[rec->nargs].i = va_arg(ap, long long);
+            break;
+        case DEBUG_ARG_SIZE:
+            rec->args[rec->nargs].i = (int64_t)va_arg(ap, size_t);
+            break;
+        case DEBUG_ARG_PTRDIFF:
+            rec->args[rec->nargs].i = va_arg(ap, ptrdiff_t);
+            break;
+        case DEBUG_ARG_DOUBLE:
+            rec->args[rec->nargs].d = va_arg(ap, double);
+            break;
+        case DEBUG_ARG_PTR:
+            rec->args[rec->nargs].p = va_arg(ap, void *);
+            break;
+        case DEBUG_ARG_STRING:
+            str = va_arg(ap, const char *);
+            if(!str) {
+                rec->args[rec->nargs].i = DEBUG_STRING_NULL;
+                break;
+            }
+
+            /* a precision means it needn't be terminated */
+            len = precision >= 0 ? strnlen(str, precision) : strlen(str);
+            if(strings >= DEBUG_STRINGS_MAX) {
+                rec->args[rec->nargs].i = DEBUG_STRING_LOST;
+                break;
+            }
+            if(len > DEBUG_STRINGS_MAX - strings - 1)
+                len = DEBUG_STRINGS_MAX - strings - 1;
+
+            memcpy(rec->strings + strings, str, len);
+            rec->strings[strings + len] = '\0';
+            rec->args[rec->nargs].i = (int64_t)strings;
+            strings += len + 1;
+            break;
+        }
+        rec->nargs++;
+    }
+
+    return true;
+}
+
+#define DEBUG_RENDER(value)                                             \
+    (spec.stars == 0 ? snprintf(out, room, conv, value) :               \
+     spec.stars == 1 ? snprintf(out, room, conv, star[0], value) :      \
+     snprintf(out, room, conv, star[0], star[1], value))
+
+/* format a record the way printf would have */
+static size_t debug_render(debug_record_t *rec, char *buf, size_t len) {
+    debug_spec_t spec;
+    const char *p, *next;
+    const char *str;
+    char conv[32];
+    size_t pos = 0;
+    size_t room;
+    char *out;
+    int arg = 0;
+    int star[2];
+    int idx;
+    int rc;
+
+    if(rec->file)
+        pos = snprintf(buf, len, "[%s] %s:%d (%s): ",
+                       debug_level_names[rec->level], rec->file,
+                       rec->line, rec->func);
+
+    if(!rec->format) {
+        pos += snprintf(buf + pos, len - pos, "%s", rec->strings);
+        return pos < len ? pos : len - 1;
+    }
+
+    for(p = rec->format; *p && pos < len - 1; p = next) {
+        if(*p != '%') {
+            next = strchrnul(p, '%');
+            if((size_t)(next - p) > len - 1 - pos)
+                next = p + (len - 1 - pos);
+            memcpy(buf + pos, p, next - p);
+            pos += next - p;
+            continue;
+        }
+
+        next = debug_parse_spec(p, &spec);
+        if(spec.kind == DEBUG_ARG_PERCENT) {
+            buf[pos++] = '%';
+            continue;
+        }
+        if(spec.len >= sizeof(conv))
+            break;
+
+        memcpy(conv, p, spec.len);
+        conv[spec.len] = '\0';
+
+        for(idx = 0; idx < spec.stars; idx++)
+            star[idx] = (int)rec->args[arg++].i;
+
+        out = buf + pos;
+        room = len - pos;
+
+        switch(spec.kind) {
+        case DEBUG_ARG_INT:
+            rc = DEBUG_RENDER((int)rec->args[arg].i);
+            break;
+        case DEBUG_ARG_LONG:
+            rc = DEBUG_RENDER((long)rec->args[arg].i);
+            break;
+        case DEBUG_ARG_LLONG:
+            rc = DEBUG_RENDER((long long)rec->args[arg].i);
+            break;
+        case DEBUG_ARG_SIZE:
+            rc = DEBUG_RENDER((size_t)rec->args[arg].i);
+            break;
+        case DEBUG_ARG_PTRDIFF:
+            rc = DEBUG_RENDER((ptrdiff_t)rec->args[arg].i);
+            break;
+        case DEBUG_ARG_DOUBLE:
+            rc = DEBUG_RENDER(rec->args[arg].d);
+            break;
+        case DEBUG_ARG_PTR:
+            rc = DEBUG_RENDER(rec->args[arg].p);
+            break;
+        case DEBUG_ARG_STRING:
+            if(rec->args[arg].i == DEBUG_STRING_NULL)
+                str = "(null)";
+            else if(rec->args[arg].i == DEBUG_STRING_LOST)
+                str = "...";
+            else
+                str = rec->strings + rec->args[arg].i;
+            rc = DEBUG_RENDER(str);
+            break;
+        default:
+            rc = 0;
+            break;
+        }
+        arg++;
+
+        if(rc > 0)
+            pos += (size_t)rc < room ? (size_t)rc : room - 1;
+    }
+
+    buf[pos] = '\0';
+    return pos;
+}
+
+static void debug_write(int level, const char *file, int line,
+                        const char *func, const char *format, va_list ap) {
+    if(file)
+        fprintf(stderr, "[%s] %s:%d (%s): ", debug_level_names[level],
+                file, line, func);
+    vfprintf(stderr, format, ap);
+}
+
+/* the calling thread's ring, registered on first use */
+static debug_ring_t *debug_ring(void) {
+    debug_ring_t *ring = debug_local;
+
+    if(ring)
+        return ring;
+
+    ring = (debug_ring_t *)calloc(1, sizeof(debug_ring_t));
+    if(!ring)
+        return NULL;
+
+    ring->next = __atomic_load_n(&debug_rings, __ATOMIC_ACQUIRE);
+    while(!__atomic_compare_exchange_n(&debug_rings, &ring->next, ring,
+                                       true, __ATOMIC_RELEASE,
+                                       __ATOMIC_ACQUIRE));
+
+    debug_local = ring;
+    return ring;
+}
+
+static void debug_vlog(int level, const char *file, int line,
+                       const char *func, const char *format, va_list ap) {
+    debug_ring_t *ring;
+    debug_record_t *rec;
+    uint32_t head, tail;
+    va_list copy;
 
-void debug_vprintf(int level, char *format, va_list ap) {
     if(level > debug_threshold)
         return;
 
-    vfprintf(stderr, format, ap);
+    if(!__atomic_load_n(&debug_async, __ATOMIC_ACQUIRE) ||
+       !(ring = debug_ring())) {
+        debug_write(level, file, line, func, format, ap);
+        return;
+    }
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if(head - tail >= DEBUG_RING_DEPTH) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec = &ring->slots[head & (DEBUG_RING_DEPTH - 1)];
+    rec->format = format;
+    rec->file = file;
+    rec->func = func;
+    rec->level = (int16_t)level;
+    rec->line = line;
+
+    va_copy(copy, ap);
+    if(!debug_encode(rec, format, copy)) {
+        rec->format = NULL;
+        vsnprintf(rec->strings, DEBUG_STRINGS_MAX, format, ap);
+    }
+    va_end(copy);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void debug_log(int level, const char *file, int line,
+               const char *func, char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    debug_vlog(level, file, line, func, format, args);
+    va_end(args);
+}
+
+void debug_vprintf(int level, char *format, va_list ap) {
+    debug_vlog(level, NULL, 0, NULL, format, ap);
 }
 
 void debug_printf(int level, char *format, ...) {
     va_list args;
-    if(level > debug_threshold)
-        return;
 
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    debug_vlog(level, NULL, 0, NULL, format, args);
     va_end(args);
 }
+
+/*
+ * Let the first log_rate_limit messages a second from a call site
+ * through, and count the rest.  Racy across threads, but only the
+ * counts suffer.
+ */
+bool debug_ratelimit(debug_limit_t *limit, int level,
+                     const char *file, int line) {
+    struct timespec ts;
+    uint64_t window;
+    uint32_t suppressed;
+
+    if(!debug_limit_rate)
+        return true;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    window = (uint64_t)ts.tv_sec;
+
+    if(__atomic_load_n(&limit->window, __ATOMIC_RELAXED) != window) {
+        __atomic_store_n(&limit->window, window, __ATOMIC_RELAXED);
+        __atomic_store_n(&limit->count, 0, __ATOMIC_RELAXED);
+        suppressed = __atomic_exchange_n(&limit->suppressed, 0,
+                                         __ATOMIC_RELAXED);
+        if(suppressed)
+            debug_log(level, file, line, "ratelimit",
+                      "%u similar messages suppressed\n", suppressed);
+    }
+
+    if(__atomic_add_fetch(&limit->count, 1, __ATOMIC_RELAXED) >
+       debug_limit_rate) {
+        __atomic_add_fetch(&limit->suppressed, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    return true;
+}
+
+/* write out everything queued so far */
+void debug_flush(void) {
+    debug_ring_t *ring;
+    debug_record_t *rec;
+    char line[DEBUG_LINE_MAX];
+    uint64_t dropped;
+    uint32_t head;
+    size_t len;
+
+    pthread_mutex_lock(&debug_drain_lock);
+
+    for(ring = __atomic_load_n(&debug_rings, __ATOMIC_ACQUIRE); ring;
+        ring = ring->next) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        while(ring->tail != head) {
+            rec = &ring->slots[ring->tail & (DEBUG_RING_DEPTH - 1)];
+            len = debug_render(rec, line, sizeof(line));
+            fwrite(line, 1, len, stderr);
+            __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+        }
+
+        dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if(dropped != ring->reported) {
+            fprintf(stderr, "[WARN] %llu log messages dropped\n",
+                    (unsigned long long)(dropped - ring->reported));
+            ring->reported = dropped;
+        }
+    }
+
+    fflush(stderr);
+    pthread_mutex_unlock(&debug_drain_lock);
+}
+
+static void *debug_proc(void *arg) {
+    struct timespec ts = { 0, DEBUG_POLL_MS * 1000000L };
+
+    while(!__atomic_load_n(&debug_quit, __ATOMIC_ACQUIRE)) {
+        nanosleep(&ts, NULL);
+        debug_flush();
+    }
+
+    return NULL;
+}
+
+/*
+ * Hand formatting and writing off to a background thread.  Until
+ * this is called (and after debug_stop) messages are written
+ * synchronously.
+ */
+bool debug_start(void) {
+    if(debug_async)
+        return true;
+
+    debug_quit = false;
+    if(pthread_create(&debug_tid, NULL, debug_proc, NULL))
+        return false;
+
+    /* so messages logged on the way out by exit() aren't lost */
+    if(!debug_atexit)
+        debug_atexit = !atexit(debug_flush);
+
+    __atomic_store_n(&debug_async, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+void debug_stop(void) {
+    if(!debug_async)
+        return;
+
+    __atomic_store_n(&debug_async, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&debug_quit, true, __ATOMIC_RELEASE);
+    pthread_join(debug_tid, NULL);
+    debug_flush();
+}
@@ -25,6 +25,36 @@
 #define DBG_INFO  3
 #define DBG_DEBUG 4
 
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* per call site state for the _LIMITED variants */
+typedef struct debug_limit_t {
+    uint64_t window;
+    uint32_t count;
+    uint32_t suppressed;
+} debug_limit_t;
+
+extern int debug_threshold;
+
+/* checked before any argument is evaluated or formatted */
+#define debug_enabled(level) __builtin_expect((level) <= debug_threshold, 0)
+
+#define DEBUG_LOG(level, format, args...) do {                          \
+        if(debug_enabled(level))                                        \
+            debug_log(level, __FILE__, __LINE__, __FUNCTION__,          \
+                      format "\n", ##args);                             \
+    } while(0)
+
+#define DEBUG_LIMITED(level, format, args...) do {                      \
+        static debug_limit_t _debug_limit;                              \
+        if(debug_enabled(level) &&                                      \
+           debug_ratelimit(&_debug_limit, level, __FILE__, __LINE__))   \
+            debug_log(level, __FILE__, __LINE__, __FUNCTION__,          \
+                      format "\n", ##args);                             \
+    } while(0)
+
 #if defined(NDEBUG)
 #define DEBUG(format, args...)
 #define INFO(format, args...)
@@ -32,6 +62,9 @@
 #define ERROR(format, args...) debug_printf(DBG_ERROR, "Error: " format "\n", ##args)
 #define FATAL(format, args...) debug_printf(DBG_FATAL, "Fatal: " format "\n", ##args)
 
+#define WARN_LIMITED(format, args...)
+#define ERROR_LIMITED(format, args...) DEBUG_LIMITED(DBG_ERROR, format, ##args)
+
 #define PDEBUG(format, args...)
 #define PINFO(format, args...)
 #define PWARN(format, args...)
@@ -41,11 +74,15 @@
 #define YERROR(format, args...) yyerror(format, ##args)
 # define DPRINTF(level, format, args...);
 #else
-#define DEBUG(format, args...) debug_printf(DBG_DEBUG, "[DEBUG] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
-#define INFO(format, args...) debug_printf(DBG_INFO, "[INFO] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
-#define WARN(format, args...) debug_printf(DBG_WARN, "[WARN] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
-#define ERROR(format, args...) debug_printf(DBG_ERROR, "[ERROR] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
-#define FATAL(format, args...) debug_printf(DBG_FATAL, "[FATAL] %s:%d (%s): " format "\n", __FILE__, __LINE__, __FUNCTION__, ##args)
+#define DEBUG(format, args...) DEBUG_LOG(DBG_DEBUG, format, ##args)
+#define INFO(format, args...) DEBUG_LOG(DBG_INFO, format, ##args)
+#define WARN(format, args...) DEBUG_LOG(DBG_WARN, format, ##args)
+#define ERROR(format, args...) DEBUG_LOG(DBG_ERROR, format, ##args)
+#define FATAL(format, args...) DEBUG_LOG(DBG_FATAL, format, ##args)
+
+/* at most log_rate_limit a second from any one call site */
+#define WARN_LIMITED(format, args...) DEBUG_LIMITED(DBG_WARN, format, ##args)
+#define ERROR_LIMITED(format, args...) DEBUG_LIMITED(DBG_ERROR, format, ##args)
 
 #define PDEBUG(format, args...) debug_printf(DBG_DEBUG, "%s:%d: debug: %s:%d (%s): " format "\n", parser_file, parser_line, __FILE__, __LINE__, __FUNCTION__, ##args)
 #define PINFO(format, args...) debug_printf(DBG_INFO, "%s:%d: info: %s:%d (%s): " format "\n", parser_file, parser_line, __FILE__, __LINE__, __FUNCTION__, ##args)
@@ -59,7 +96,17 @@
 #endif /* NDEBUG */
 
 extern void debug_level(int newlevel);
-extern void debug_printf(int level, char *format, ...);
+extern void debug_rate_limit(uint32_t per_second);
+extern bool debug_start(void);
+extern void debug_stop(void);
+extern void debug_flush(void);
+extern bool debug_ratelimit(debug_limit_t *limit, int level,
+                            const char *file, int line);
+extern void debug_log(int level, const char *file, int line,
+                      const char *func, char *format, ...)
+    __attribute__((format(printf, 5, 6)));
+extern void debug_printf(int level, char *format, ...)
+    __attribute__((format(printf, 2, 3)));
 extern void debug_vprintf(int level, char *format, va_list ap);
 
 #endif /* _DEBUG_H_ */
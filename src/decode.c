@@ -0,0 +1,205 @@
+/*
+ * decode.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reading decode.  Each (type, model) has an entry in decode_table
+ * that gets the raw value into a common base unit.  Everything
+ * sensor specific (temperature unit, calibration) is worked out at
+ * config load into a decode_plan_t, and applied here as one
+ * multiply and add.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "decode.h"
+#include "format.h"
+
+static int64_t decode_round(double value) {
+    return (int64_t)(value < 0 ? value - 0.5 : value + 0.5);
+}
+
+static int64_t decode_div_round(int64_t num, int64_t den) {
+    if(num < 0)
+        return -((-num + den / 2) / den);
+    return (num + den / 2) / den;
+}
+
+static bool decode_uint8(const sensor_struct_t *msg, int32_t *milli) {
+    *milli = msg->value.uint8_value * 1000;
+    return true;
+}
+
+/*
+ * 2 x 3.3v reference, full scale.  Rounded to the published
+ * hundredths here, so it isn't rounded twice.
+ */
+static bool decode_volt_8b(const sensor_struct_t *msg, int32_t *milli) {
+    *milli = format_div_round(msg->value.uint8_value * 660, 255) * 10;
+    return true;
+}
+
+static bool decode_volt_16b(const sensor_struct_t *msg, int32_t *milli) {
+    *milli = (int32_t)(((uint32_t)msg->value.uint16_value * 6600 + 32767) /
+                       65535);
+    return true;
+}
+
+/* integral degrees in the high byte */
+static bool decode_temp_dht11(const sensor_struct_t *msg, int32_t *milli) {
+    *milli = (msg->value.uint16_value >> 8) * 1000;
+    return true;
+}
+
+/* sign and magnitude, in tenths of a degree */
+static bool decode_temp_dht22(const sensor_struct_t *msg, int32_t *milli) {
+    int32_t raw = msg->value.uint16_value & 0x7fff;
+
+    if(msg->value.uint16_value & 0x8000)
+        raw = -raw;
+
+    *milli = raw * 100;
+    return true;
+}
+
+/* the scratchpad temperature register: signed, in 1/16 degree */
+static bool decode_temp_ds18b20(const sensor_struct_t *msg, int32_t *milli) {
+    *milli = format_div_round((int16_t)msg->value.uint16_value * 125, 2);
+    return true;
+}
+
+/* millivolts off the sensor: 500mV at 0C, 10mV a degree */
+static bool decode_temp_tmp36(const sensor_struct_t *msg, int32_t *milli) {
+    *milli = ((int32_t)msg->value.uint16_value - 500) * 100;
+    return true;
+}
+
+/* integral byte, decimal byte; a tenths byte over 9 is a bad read */
+static bool decode_humidity_dht11(const sensor_struct_t *msg, int32_t *milli) {
+    int tenths = msg->value.uint16_value & 0xff;
+
+    if(tenths > 9)
+        return false;
+
+    *milli = ((msg->value.uint16_value >> 8) * 10 + tenths) * 100;
+    return true;
+}
+
+/* tenths of a percent */
+static bool decode_humidity_dht22(const sensor_struct_t *msg, int32_t *milli) {
+    *milli = msg->value.uint16_value * 100;
+    return true;
+}
+
+#define DECODE_ANY_MODEL(fn, decimals) \
+    { { fn, decimals }, { fn, decimals }, { fn, decimals }, { fn, decimals }, \
+      { fn, decimals }, { fn, decimals }, { fn, decimals }, { fn, decimals } }
+
+static const decode_entry_t decode_table[DECODE_TYPES][DECODE_MODELS] = {
+    [SENSOR_TYPE_RO_SWITCH] = DECODE_ANY_MODEL(decode_uint8, 0),
+    [SENSOR_TYPE_RW_SWITCH] = DECODE_ANY_MODEL(decode_uint8, 0),
+    [SENSOR_TYPE_LIGHT] = DECODE_ANY_MODEL(decode_uint8, 0),
+    [SENSOR_TYPE_MOTION] = DECODE_ANY_MODEL(decode_uint8, 0),
+    [SENSOR_TYPE_TEMP] = {
+        [TEMP_MODEL_DHT11] = { decode_temp_dht11, 1 },
+        [TEMP_MODEL_DHT22] = { decode_temp_dht22, 1 },
+        [TEMP_MODEL_DS18B20] = { decode_temp_ds18b20, 1 },
+        [TEMP_MODEL_TMP36] = { decode_temp_tmp36, 1 },
+    },
+    [SENSOR_TYPE_HUMIDITY] = {
+        [TEMP_MODEL_DHT11] = { decode_humidity_dht11, 1 },
+        [TEMP_MODEL_DHT22] = { decode_humidity_dht22, 1 },
+    },
+    [SENSOR_TYPE_VOLTAGE] = {
+        [VOLT_MODEL_8B_2X33VREF] = { decode_volt_8b, 2 },
+        [VOLT_MODEL_16B_2X33VREF] = { decode_volt_16b, 3 },
+    },
+};
+
+static const char *decode_unit_names[] = { "F", "C", "K" };
+
+int decode_unit_parse(const char *unit) {
+    int pos;
+
+    for(pos = 0; pos < sizeof(decode_unit_names) / sizeof(char *); pos++) {
+        if(!strcasecmp(unit, decode_unit_names[pos]))
+            return pos;
+    }
+
+    return -1;
+}
+
+const char *decode_unit_name(int unit) {
+    return decode_unit_names[unit];
+}
+
+void decode_plan_init(decode_plan_t *plan, int temp_unit) {
+    int type;
+
+    for(type = 0; type < DECODE_TYPES; type++) {
+        plan->cal[type].mul = 1000000;
+        plan->cal[type].add = 0;
+    }
+
+    if(temp_unit == DECODE_UNIT_F) {
+        plan->cal[SENSOR_TYPE_TEMP].mul = 1800000;
+        plan->cal[SENSOR_TYPE_TEMP].add = 32000;
+    } else if(temp_unit == DECODE_UNIT_K) {
+        plan->cal[SENSOR_TYPE_TEMP].add = 273150;
+    }
+}
+
+/* corrected = published * scale + offset, offset in published units */
+void decode_plan_calibrate(decode_plan_t *plan, int type,
+                           double offset, double scale) {
+    decode_cal_t *cal = &plan->cal[type];
+
+    cal->mul = decode_round(cal->mul * scale);
+    cal->add = decode_round(cal->add * scale + offset * 1000);
+}
+
+bool decode_plan_is_identity(const decode_plan_t *plan, int type) {
+    return plan->cal[type].mul == 1000000 && plan->cal[type].add == 0;
+}
+
+/*
+ * Decode to fixed point: the reading is *value / 10^*decimals.
+ * Returns false for types/models we don't know how to decode.
+ */
+bool decode_reading(const decode_plan_t *plan, const sensor_struct_t *msg,
+                    int32_t *value, int *decimals) {
+    static const int64_t scale[] = { 1000, 100, 10, 1 };
+    const decode_entry_t *entry;
+    const decode_cal_t *cal;
+    int32_t milli;
+    int64_t out;
+
+    if(msg->type >= DECODE_TYPES || msg->model >= DECODE_MODELS)
+        return false;
+
+    entry = &decode_table[msg->type][msg->model];
+    if(!entry->fn || !entry->fn(msg, &milli))
+        return false;
+
+    cal = &plan->cal[msg->type];
+    out = decode_div_round(milli * cal->mul, 1000000) + cal->add;
+
+    *value = (int32_t)decode_div_round(out, scale[entry->decimals]);
+    *decimals = entry->decimals;
+    return true;
+}
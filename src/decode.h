@@ -0,0 +1,69 @@
+/*
+ * decode.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DECODE_H_
+#define _DECODE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sensor.h"
+
+#define DECODE_TYPES  7     /* matches MQTT_TYPE_COUNT */
+#define DECODE_MODELS 8     /* higher model numbers are unknown */
+
+#define DECODE_UNIT_F 0     /* the default, as before units were settable */
+#define DECODE_UNIT_C 1
+#define DECODE_UNIT_K 2
+
+/*
+ * Turns a raw reading into thousandths of the type's base unit
+ * (degrees C, %RH, volts, or the plain value).  False if the
+ * reading can't be decoded.
+ */
+typedef bool (*decode_fn_t)(const sensor_struct_t *msg, int32_t *milli);
+
+typedef struct decode_entry_t {
+    decode_fn_t fn;
+    uint8_t decimals;        /* published precision */
+} decode_entry_t;
+
+/*
+ * out = milli * mul / 10^6 + add, in thousandths of the published
+ * unit.  Unit conversion and calibration fold into the one step.
+ */
+typedef struct decode_cal_t {
+    int64_t mul;
+    int64_t add;
+} decode_cal_t;
+
+/* resolved per map entry at config load */
+typedef struct decode_plan_t {
+    decode_cal_t cal[DECODE_TYPES];
+} decode_plan_t;
+
+extern void decode_plan_init(decode_plan_t *plan, int temp_unit);
+extern void decode_plan_calibrate(decode_plan_t *plan, int type,
+                                  double offset, double scale);
+extern bool decode_plan_is_identity(const decode_plan_t *plan, int type);
+extern int decode_unit_parse(const char *unit);
+extern const char *decode_unit_name(int unit);
+extern bool decode_reading(const decode_plan_t *plan,
+                           const sensor_struct_t *msg,
+                           int32_t *value, int *decimals);
+
+#endif /* _DECODE_H_ */
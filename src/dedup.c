@@ -0,0 +1,145 @@
+/*
+ * dedup.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "dedup.h"
+
+/* FNV-1a over the raw packet */
+static uint64_t dedup_hash(const sensor_struct_t *msg) {
+    const uint8_t *bytes = (const uint8_t *)msg;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t pos;
+
+    for(pos = 0; pos < sizeof(sensor_struct_t); pos++) {
+        hash ^= bytes[pos];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static uint32_t dedup_home(dedup_t *dedup, uint64_t hash) {
+    return (uint32_t)(hash >> 32) & dedup->set_mask;
+}
+
+bool dedup_init(dedup_t *dedup, uint32_t entries, uint32_t window_ms) {
+    uint32_t size = 1;
+
+    while(size < entries)
+        size <<= 1;
+
+    memset(dedup, 0, sizeof(dedup_t));
+    dedup->window_ns = window_ms * 1000000ULL;
+
+    /* the set is kept at most half full */
+    dedup->ring = (dedup_entry_t *)calloc(size, sizeof(dedup_entry_t));
+    dedup->set = (uint32_t *)calloc(size * 2, sizeof(uint32_t));
+    if(!dedup->ring || !dedup->set) {
+        ERROR("Malloc error");
+        dedup_deinit(dedup);
+        return false;
+    }
+
+    dedup->ring_mask = size - 1;
+    dedup->set_mask = size * 2 - 1;
+    return true;
+}
+
+void dedup_deinit(dedup_t *dedup) {
+    free(dedup->ring);
+    free(dedup->set);
+    dedup->ring = NULL;
+    dedup->set = NULL;
+}
+
+/*
+ * Drop the oldest ring entry, and its set slot.  Later entries in
+ * its probe run are shifted back, so lookups never need tombstones.
+ */
+static void dedup_forget(dedup_t *dedup) {
+    uint32_t slot = (dedup->tail++ & dedup->ring_mask) + 1;
+    uint32_t hole, pos, home;
+
+    hole = dedup_home(dedup, dedup->ring[slot - 1].hash);
+    while(dedup->set[hole] != slot)
+        hole = (hole + 1) & dedup->set_mask;
+
+    pos = hole;
+    for(;;) {
+        pos = (pos + 1) & dedup->set_mask;
+        if(!dedup->set[pos])
+            break;
+
+        /* can it move back into the hole without passing its home? */
+        home = dedup_home(dedup, dedup->ring[dedup->set[pos] - 1].hash);
+        if(((pos - home) & dedup->set_mask) >= ((pos - hole) & dedup->set_mask)) {
+            dedup->set[hole] = dedup->set[pos];
+            hole = pos;
+        }
+    }
+
+    dedup->set[hole] = 0;
+}
+
+/*
+ * Has this exact packet been seen in the last window?  If not, it is
+ * remembered.  Packets from different radios come in slightly out of
+ * order, so the window is measured against the latest receive time,
+ * and a copy stamped earlier than the original still counts.  A copy
+ * doesn't extend the window, so a value legitimately repeated later
+ * still gets through.
+ */
+bool dedup_seen(dedup_t *dedup, const sensor_struct_t *msg, uint64_t rx_ns) {
+    uint64_t hash = dedup_hash(msg);
+    dedup_entry_t *entry;
+    uint32_t pos;
+
+    if(rx_ns > dedup->now_ns)
+        dedup->now_ns = rx_ns;
+
+    while(dedup->head != dedup->tail &&
+          dedup->now_ns - dedup->ring[dedup->tail & dedup->ring_mask].seen_ns >=
+          dedup->window_ns)
+        dedup_forget(dedup);
+
+    for(pos = dedup_home(dedup, hash); dedup->set[pos];
+        pos = (pos + 1) & dedup->set_mask) {
+        entry = &dedup->ring[dedup->set[pos] - 1];
+        if(entry->hash == hash)
+            return true;
+    }
+
+    /* too busy for the window: forget early rather than grow */
+    if(dedup->head - dedup->tail > dedup->ring_mask) {
+        dedup_forget(dedup);
+
+        /* the shift may have moved things around our empty slot */
+        for(pos = dedup_home(dedup, hash); dedup->set[pos];
+            pos = (pos + 1) & dedup->set_mask);
+    }
+
+    entry = &dedup->ring[dedup->head & dedup->ring_mask];
+    entry->hash = hash;
+    entry->seen_ns = rx_ns;
+    dedup->set[pos] = (dedup->head & dedup->ring_mask) + 1;
+    dedup->head++;
+    return false;
+}
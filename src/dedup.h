@@ -0,0 +1,56 @@
+/*
+ * dedup.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sensor.h"
+
+/*
+ * Recently seen packets, for dropping the copies when two radios
+ * hear the same transmission, or a sensor repeats itself.  A ring of
+ * hashes in arrival order says what to forget next, and an open
+ * addressing set over the ring finds a hash in one or two probes.
+ * Everything is allocated up front.
+ */
+typedef struct dedup_entry_t {
+    uint64_t hash;
+    uint64_t seen_ns;
+} dedup_entry_t;
+
+typedef struct dedup_t {
+    uint64_t window_ns;
+    uint64_t now_ns;         /* latest receive time seen */
+
+    dedup_entry_t *ring;
+    uint32_t ring_mask;
+    uint32_t head;
+    uint32_t tail;
+
+    uint32_t *set;           /* ring slot + 1, or 0 for empty */
+    uint32_t set_mask;
+} dedup_t;
+
+extern bool dedup_init(dedup_t *dedup, uint32_t entries, uint32_t window_ms);
+extern void dedup_deinit(dedup_t *dedup);
+extern bool dedup_seen(dedup_t *dedup, const sensor_struct_t *msg,
+                       uint64_t rx_ns);
+
+#endif /* _DEDUP_H_ */
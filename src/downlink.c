@@ -0,0 +1,297 @@
+/*
+ * downlink.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "nrf24-mqtt.h"
+#include "debug.h"
+#include "cfg.h"
+#include "addrmap.h"
+#include "metrics.h"
+#include "nrf24-recv.h"
+#include "downlink.h"
+
+#define DOWNLINK_IDLE_MS 1000      /* to keep up with config reloads */
+
+/* by name, so the mosquitto thread needn't look at the config */
+typedef struct downlink_cmd_t {
+    char name[ADDRMAP_NAME_MAX];
+    uint8_t instance;
+    uint8_t value;
+    uint64_t queued_ns;
+} downlink_cmd_t;
+
+static pthread_mutex_t downlink_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t downlink_cond;
+static downlink_cmd_t downlink_queue[DOWNLINK_QUEUE_MAX];
+static int downlink_count = 0;
+static bool downlink_running = false;
+static int downlink_quit = 0;
+
+/* the TX thread's own */
+static pthread_t downlink_tid;
+static cfg_reader_t downlink_reader;
+static cfg_snapshot_t *downlink_cfg;
+static downlink_cmd_t downlink_batch[DOWNLINK_QUEUE_MAX];
+
+static uint64_t downlink_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void downlink_wait_until(uint64_t when_ns) {
+    struct timespec ts;
+
+    ts.tv_sec = when_ns / 1000000000ULL;
+    ts.tv_nsec = when_ns % 1000000000ULL;
+    pthread_cond_timedwait(&downlink_cond, &downlink_lock, &ts);
+}
+
+/*
+ * Queue a command, or update the one already waiting for that
+ * switch.  Called from whichever thread runs the mosquitto
+ * callbacks.
+ */
+bool downlink_command(const char *name, size_t name_len, int instance,
+                      int value) {
+    downlink_cmd_t *cmd = NULL;
+    int idx;
+
+    if(name_len >= ADDRMAP_NAME_MAX || instance < 0 || instance > 255) {
+        metrics_inc(METRIC_TX_REJECTED);
+        WARN_LIMITED("Ignoring command for %.*s/switch%d", (int)name_len,
+                     name, instance);
+        return false;
+    }
+
+    pthread_mutex_lock(&downlink_lock);
+    if(!downlink_running) {
+        pthread_mutex_unlock(&downlink_lock);
+        return false;
+    }
+
+    metrics_inc(METRIC_TX_COMMANDS);
+
+    for(idx = 0; idx < downlink_count; idx++) {
+        if(downlink_queue[idx].instance == instance &&
+           !strncmp(downlink_queue[idx].name, name, name_len) &&
+           !downlink_queue[idx].name[name_len]) {
+            cmd = &downlink_queue[idx];
+            metrics_inc(METRIC_TX_COALESCED);
+            break;
+        }
+    }
+
+    if(!cmd) {
+        if(downlink_count == DOWNLINK_QUEUE_MAX) {
+            pthread_mutex_unlock(&downlink_lock);
+            metrics_inc(METRIC_TX_REJECTED);
+            WARN_LIMITED("Downlink queue full, dropping command for "
+                         "%.*s/switch%d", (int)name_len, name, instance);
+            return false;
+        }
+
+        cmd = &downlink_queue[downlink_count++];
+        memcpy(cmd->name, name, name_len);
+        cmd->name[name_len] = '\0';
+        cmd->instance = (uint8_t)instance;
+        cmd->queued_ns = downlink_now_ns();
+        if(downlink_count == 1)
+            pthread_cond_signal(&downlink_cond);
+    }
+
+    cmd->value = (uint8_t)value;
+    pthread_mutex_unlock(&downlink_lock);
+    return true;
+}
+
+/* exact entries first, then wildcards that could have made the name */
+static bool downlink_resolve(const char *name, uint8_t *addr) {
+    addr_map_t *map;
+    int pass;
+
+    for(pass = 0; pass < 2; pass++) {
+        for(map = downlink_cfg->map.next; map; map = map->next) {
+            if((map->prefix_len == 5) == !pass &&
+               addrmap_parse_name(map, name, addr))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+/* one burst: the radio leaves RX once for all of it */
+static void downlink_send(int count) {
+    sensor_struct_t msgs[DOWNLINK_QUEUE_MAX];
+    uint64_t ack_ns[DOWNLINK_QUEUE_MAX];
+    downlink_cmd_t *cmds[DOWNLINK_QUEUE_MAX];
+    uint64_t start_ns, off_ns;
+    int sends = 0;
+    int acked;
+    int idx;
+
+    for(idx = 0; idx < count; idx++) {
+        downlink_cmd_t *cmd = &downlink_batch[idx];
+        sensor_struct_t *msg = &msgs[sends];
+
+        memset(msg, 0, sizeof(sensor_struct_t));
+        if(!downlink_resolve(cmd->name, msg->addr)) {
+            metrics_inc(METRIC_TX_REJECTED);
+            WARN_LIMITED("Command for unknown sensor %s", cmd->name);
+            continue;
+        }
+
+        msg->type = SENSOR_TYPE_RW_SWITCH;
+        msg->model = SENSOR_MODEL_NONE;
+        msg->type_instance = cmd->instance;
+        msg->value.uint8_value = cmd->value;
+        cmds[sends++] = cmd;
+    }
+
+    if(!sends)
+        return;
+
+    start_ns = downlink_now_ns();
+    acked = nrf24_recv_send_burst(msgs, sends, ack_ns);
+    off_ns = downlink_now_ns() - start_ns;
+
+    if(acked < 0) {
+        metrics_add(METRIC_TX_REJECTED, sends);
+        WARN_LIMITED("No radio to send %d commands on", sends);
+        return;
+    }
+
+    metrics_record(HIST_RX_OFF, off_ns);
+    metrics_add(METRIC_TX_ACKED, acked);
+    metrics_add(METRIC_TX_FAILED, sends - acked);
+
+    for(idx = 0; idx < sends; idx++) {
+        if(ack_ns[idx]) {
+            metrics_record(HIST_TX_ACK, ack_ns[idx]);
+            DEBUG("%s/switch%d -> %d, acked in %llu us", cmds[idx]->name,
+                  cmds[idx]->instance, cmds[idx]->value,
+                  (unsigned long long)(ack_ns[idx] / 1000));
+        } else {
+            WARN_LIMITED("No ack from %s for switch%d", cmds[idx]->name,
+                         cmds[idx]->instance);
+        }
+    }
+
+    DEBUG("Downlink burst of %d, %d acked, %llu us out of RX", sends,
+          acked, (unsigned long long)(off_ns / 1000));
+}
+
+/*
+ * The first command opens a window of downlink_window_ms.  Whatever
+ * has come in by the time it closes goes out as one burst, so there
+ * is at most one burst a window however busy mqtt gets.
+ */
+static void *downlink_thread(void *arg) {
+    uint64_t window_ns = config.downlink_window_ms * 1000000ULL;
+    cfg_snapshot_t *snap;
+    int count;
+    int quit;
+
+    DEBUG("Downlink thread started");
+
+    do {
+        pthread_mutex_lock(&downlink_lock);
+
+        if(!downlink_count && !downlink_quit)
+            downlink_wait_until(downlink_now_ns() +
+                                DOWNLINK_IDLE_MS * 1000000ULL);
+
+        while(downlink_count && !downlink_quit &&
+              downlink_now_ns() < downlink_queue[0].queued_ns + window_ns)
+            downlink_wait_until(downlink_queue[0].queued_ns + window_ns);
+
+        count = downlink_count;
+        memcpy(downlink_batch, downlink_queue,
+               count * sizeof(downlink_cmd_t));
+        downlink_count = 0;
+        quit = downlink_quit;
+
+        pthread_mutex_unlock(&downlink_lock);
+
+        snap = cfg_snapshot();
+        if(snap != downlink_cfg) {
+            downlink_cfg = snap;
+            cfg_reader_quiescent(&downlink_reader, snap);
+        }
+
+        if(count)
+            downlink_send(count);
+    } while(!quit);
+
+    return NULL;
+}
+
+bool downlink_init(void) {
+    pthread_condattr_t attr;
+
+    if(!nrf24_recv_can_send())
+        return true;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&downlink_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    downlink_cfg = cfg_snapshot();
+    cfg_reader_register(&downlink_reader, downlink_cfg);
+
+    downlink_quit = 0;
+    if(pthread_create(&downlink_tid, NULL, downlink_thread, NULL)) {
+        ERROR("Cannot start downlink thread");
+        cfg_reader_unregister(&downlink_reader);
+        pthread_cond_destroy(&downlink_cond);
+        return false;
+    }
+
+    pthread_mutex_lock(&downlink_lock);
+    downlink_running = true;
+    pthread_mutex_unlock(&downlink_lock);
+    return true;
+}
+
+/* anything still queued goes out first */
+void downlink_deinit(void) {
+    pthread_mutex_lock(&downlink_lock);
+    if(!downlink_running) {
+        pthread_mutex_unlock(&downlink_lock);
+        return;
+    }
+    downlink_running = false;
+    downlink_quit = 1;
+    pthread_cond_signal(&downlink_cond);
+    pthread_mutex_unlock(&downlink_lock);
+
+    pthread_join(downlink_tid, NULL);
+    cfg_reader_unregister(&downlink_reader);
+    pthread_cond_destroy(&downlink_cond);
+}
@@ -0,0 +1,38 @@
+/*
+ * downlink.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _DOWNLINK_H_
+#define _DOWNLINK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Switch commands from mqtt (<name>/switch<N>/set) to RW switch
+ * sensors.  Commands wait in a queue for a short window, so a burst
+ * of them goes out with the radio leaving RX only once, and a newer
+ * command for the same switch replaces one still waiting.
+ */
+#define DOWNLINK_QUEUE_MAX 64
+
+extern bool downlink_init(void);
+extern void downlink_deinit(void);
+extern bool downlink_command(const char *name, size_t name_len,
+                             int instance, int value);
+
+#endif /* _DOWNLINK_H_ */
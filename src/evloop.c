@@ -0,0 +1,243 @@
+/*
+ * evloop.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Single threaded event loop, for small gateways where every
+ * context switch shows.  The main thread does the publishing and
+ * drives the broker socket itself, instead of handing off to a
+ * publisher thread and a mosquitto thread.  It sleeps in epoll_wait
+ * on:
+ *
+ *   - the publisher eventfd, poked by the receive threads
+ *   - the mosquitto socket
+ *   - a timerfd, for batch windows, keepalives and housekeeping
+ *   - a signalfd, for SIGHUP and a clean shutdown on SIGTERM/SIGINT
+ *
+ * The receive threads stay, as the backends block in their reads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "debug.h"
+#include "mqtt.h"
+#include "publisher.h"
+#include "evloop.h"
+
+#define EVLOOP_TICK_MS 100
+#define EVLOOP_TICKS_PER_SECOND (1000 / EVLOOP_TICK_MS)
+#define EVLOOP_EVENTS 8
+
+#define EVLOOP_PUBLISHER 0
+#define EVLOOP_TIMER     1
+#define EVLOOP_SIGNAL    2
+#define EVLOOP_MQTT      3
+
+static int evloop_epfd = -1;
+static int evloop_timer_fd = -1;
+static int evloop_signal_fd = -1;
+
+/* what we've told epoll about the broker socket */
+static mqtt_worker_t *evloop_mqtt;   /* the one worker there is */
+static int evloop_mqtt_fd = -1;
+static uint32_t evloop_mqtt_events = 0;
+
+static bool evloop_add(int fd, uint32_t events, uint32_t tag) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u32 = tag;
+    if(epoll_ctl(evloop_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        ERROR("Cannot watch fd %d: %s", fd, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/* the signals must already be blocked in every thread */
+bool evloop_init(const sigset_t *signals) {
+    struct itimerspec its;
+
+    evloop_epfd = epoll_create1(EPOLL_CLOEXEC);
+    evloop_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                     TFD_NONBLOCK | TFD_CLOEXEC);
+    evloop_signal_fd = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if(evloop_epfd == -1 || evloop_timer_fd == -1 || evloop_signal_fd == -1) {
+        ERROR("Cannot set up event loop: %s", strerror(errno));
+        evloop_deinit();
+        return false;
+    }
+
+    evloop_mqtt = mqtt_worker_get(0);
+
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_nsec = EVLOOP_TICK_MS * 1000000L;
+    its.it_value = its.it_interval;
+    timerfd_settime(evloop_timer_fd, 0, &its, NULL);
+
+    if(!evloop_add(publisher_fd(), EPOLLIN, EVLOOP_PUBLISHER) ||
+       !evloop_add(evloop_timer_fd, EPOLLIN, EVLOOP_TIMER) ||
+       !evloop_add(evloop_signal_fd, EPOLLIN, EVLOOP_SIGNAL)) {
+        evloop_deinit();
+        return false;
+    }
+
+    return true;
+}
+
+void evloop_deinit(void) {
+    if(evloop_signal_fd != -1)
+        close(evloop_signal_fd);
+    if(evloop_timer_fd != -1)
+        close(evloop_timer_fd);
+    if(evloop_epfd != -1)
+        close(evloop_epfd);
+
+    evloop_signal_fd = evloop_timer_fd = evloop_epfd = -1;
+    evloop_mqtt_fd = -1;
+    evloop_mqtt_events = 0;
+}
+
+/*
+ * Keep epoll in step with the broker socket, which comes and goes
+ * with the connection, and only wants EPOLLOUT while output is
+ * queued.  Called after anything that might have changed it.  A
+ * closed socket has already dropped out of the epoll set.
+ */
+static void evloop_watch_mqtt(void) {
+    struct epoll_event ev;
+    int fd = mqtt_socket(evloop_mqtt);
+    uint32_t events;
+
+    if(fd == -1) {
+        evloop_mqtt_fd = -1;
+        return;
+    }
+
+    events = EPOLLIN | (mqtt_want_write(evloop_mqtt) ? EPOLLOUT : 0);
+    if(fd == evloop_mqtt_fd && events == evloop_mqtt_events)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u32 = EVLOOP_MQTT;
+
+    if(fd != evloop_mqtt_fd) {
+        if(evloop_mqtt_fd != -1)
+            epoll_ctl(evloop_epfd, EPOLL_CTL_DEL, evloop_mqtt_fd, NULL);
+        if(epoll_ctl(evloop_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            ERROR_LIMITED("Cannot watch broker socket: %s", strerror(errno));
+            return;
+        }
+    } else if(epoll_ctl(evloop_epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        ERROR_LIMITED("Cannot watch broker socket: %s", strerror(errno));
+        return;
+    }
+
+    evloop_mqtt_fd = fd;
+    evloop_mqtt_events = events;
+}
+
+/* false to stop */
+static bool evloop_signal(evloop_fn_t on_hup) {
+    struct signalfd_siginfo info;
+
+    while(read(evloop_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if(info.ssi_signo == SIGHUP) {
+            on_hup();
+        } else {
+            INFO("Got signal %d, shutting down", info.ssi_signo);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* returns on SIGTERM or SIGINT, with everything still set up */
+void evloop_run(evloop_fn_t on_hup, evloop_fn_t on_second) {
+    struct epoll_event events[EVLOOP_EVENTS];
+    uint64_t expirations;
+    uint32_t ticks = 0;
+    bool busy = false;
+    bool running = true;
+    int count, idx;
+
+    DEBUG("Event loop started");
+
+    evloop_watch_mqtt();
+
+    while(running) {
+        /* don't block while packets are waiting */
+        if(!busy && !publisher_sleep_begin())
+            busy = true;
+        count = epoll_wait(evloop_epfd, events, EVLOOP_EVENTS, busy ? 0 : -1);
+        publisher_sleep_end();
+
+        if(count == -1) {
+            if(errno == EINTR)
+                continue;
+            ERROR("epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        for(idx = 0; idx < count; idx++) {
+            switch(events[idx].data.u32) {
+            case EVLOOP_TIMER:
+                if(read(evloop_timer_fd, &expirations,
+                        sizeof(expirations)) != sizeof(expirations))
+                    break;
+                mqtt_loop_misc(evloop_mqtt, publisher_now_ns());
+                evloop_watch_mqtt();
+                ticks += (uint32_t)expirations;
+                if(ticks >= EVLOOP_TICKS_PER_SECOND) {
+                    ticks = 0;
+                    on_second();
+                }
+                break;
+            case EVLOOP_SIGNAL:
+                running = evloop_signal(on_hup);
+                break;
+            case EVLOOP_MQTT:
+                if(events[idx].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    mqtt_loop_read(evloop_mqtt);
+                if((events[idx].events & EPOLLOUT) && mqtt_socket(evloop_mqtt) != -1)
+                    mqtt_loop_write(evloop_mqtt);
+                evloop_watch_mqtt();
+                break;
+            default:
+                /* the publisher eventfd: polled below regardless */
+                break;
+            }
+        }
+
+        busy = publisher_poll();
+        evloop_watch_mqtt();
+    }
+
+    DEBUG("Event loop stopped");
+}
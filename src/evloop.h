@@ -0,0 +1,30 @@
+/*
+ * evloop.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EVLOOP_H_
+#define _EVLOOP_H_
+
+#include <stdbool.h>
+#include <signal.h>
+
+typedef void (*evloop_fn_t)(void);
+
+extern bool evloop_init(const sigset_t *signals);
+extern void evloop_run(evloop_fn_t on_hup, evloop_fn_t on_second);
+extern void evloop_deinit(void);
+
+#endif /* _EVLOOP_H_ */
@@ -0,0 +1,166 @@
+/*
+ * format.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * printf-free number formatting for the publish path.  Values are
+ * fixed point: "value" is the reading scaled by 10^decimals.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "format.h"
+
+size_t format_uint(char *buf, uint32_t value) {
+    char tmp[10];
+    size_t len = 0;
+    size_t pos = 0;
+
+    do {
+        tmp[len++] = (char)('0' + value % 10);
+        value /= 10;
+    } while(value);
+
+    while(len)
+        buf[pos++] = tmp[--len];
+
+    buf[pos] = '\0';
+    return pos;
+}
+
+size_t format_uint64(char *buf, uint64_t value) {
+    char tmp[20];
+    size_t len = 0;
+    size_t pos = 0;
+
+    do {
+        tmp[len++] = (char)('0' + value % 10);
+        value /= 10;
+    } while(value);
+
+    while(len)
+        buf[pos++] = tmp[--len];
+
+    buf[pos] = '\0';
+    return pos;
+}
+
+/* write value / 10^decimals, with exactly "decimals" places */
+size_t format_fixed(char *buf, int32_t value, int decimals) {
+    char tmp[12];
+    uint32_t mag;
+    size_t len = 0;
+    size_t pos = 0;
+
+    if(value < 0) {
+        buf[pos++] = '-';
+        mag = (uint32_t)0 - (uint32_t)value;
+    } else {
+        mag = (uint32_t)value;
+    }
+
+    do {
+        tmp[len++] = (char)('0' + mag % 10);
+        mag /= 10;
+    } while(mag);
+
+    /* pad so there is always at least one digit before the point */
+    while(len <= (size_t)decimals)
+        tmp[len++] = '0';
+
+    while(len) {
+        if(len == (size_t)decimals)
+            buf[pos++] = '.';
+        buf[pos++] = tmp[--len];
+    }
+
+    buf[pos] = '\0';
+    return pos;
+}
+
+/* value big endian, then decimals: always FORMAT_BINARY_MAX bytes */
+size_t format_binary(uint8_t *buf, int32_t value, int decimals) {
+    uint32_t bits = (uint32_t)value;
+
+    buf[0] = (uint8_t)(bits >> 24);
+    buf[1] = (uint8_t)(bits >> 16);
+    buf[2] = (uint8_t)(bits >> 8);
+    buf[3] = (uint8_t)bits;
+    buf[4] = (uint8_t)decimals;
+    return FORMAT_BINARY_MAX;
+}
+
+/* a CBOR item head (RFC 8949), with the argument in its shortest form */
+size_t format_cbor_head(uint8_t *buf, int major, uint32_t arg) {
+    uint8_t type = (uint8_t)(major << 5);
+
+    if(arg < 24) {
+        buf[0] = type | (uint8_t)arg;
+        return 1;
+    }
+
+    if(arg <= 0xff) {
+        buf[0] = type | 24;
+        buf[1] = (uint8_t)arg;
+        return 2;
+    }
+
+    if(arg <= 0xffff) {
+        buf[0] = type | 25;
+        buf[1] = (uint8_t)(arg >> 8);
+        buf[2] = (uint8_t)arg;
+        return 3;
+    }
+
+    buf[0] = type | 26;
+    buf[1] = (uint8_t)(arg >> 24);
+    buf[2] = (uint8_t)(arg >> 16);
+    buf[3] = (uint8_t)(arg >> 8);
+    buf[4] = (uint8_t)arg;
+    return 5;
+}
+
+static size_t format_cbor_int(uint8_t *buf, int32_t value) {
+    if(value < 0)
+        return format_cbor_head(buf, FORMAT_CBOR_NEGATIVE,
+                                (uint32_t)(-1 - value));
+    return format_cbor_head(buf, FORMAT_CBOR_UNSIGNED, (uint32_t)value);
+}
+
+/*
+ * An integer, or with decimals, a decimal fraction (tag 4):
+ * [-decimals, value], so 72.5 is c4 82 20 19 02 d5.
+ */
+size_t format_cbor(uint8_t *buf, int32_t value, int decimals) {
+    size_t pos = 0;
+
+    if(!decimals)
+        return format_cbor_int(buf, value);
+
+    pos += format_cbor_head(buf + pos, FORMAT_CBOR_TAG, 4);
+    pos += format_cbor_head(buf + pos, FORMAT_CBOR_ARRAY, 2);
+    pos += format_cbor_int(buf + pos, -decimals);
+    pos += format_cbor_int(buf + pos, value);
+    return pos;
+}
+
+/* integer division, rounding half away from zero */
+int32_t format_div_round(int32_t num, int32_t den) {
+    if(num < 0)
+        return -((-num + den / 2) / den);
+    return (num + den / 2) / den;
+}
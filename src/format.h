@@ -0,0 +1,48 @@
+/*
+ * format.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FORMAT_H_
+#define _FORMAT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* big enough for any int32 with sign, decimal point and NUL */
+#define FORMAT_FIXED_MAX 16
+
+/* int32 and a decimals byte */
+#define FORMAT_BINARY_MAX 5
+
+/* tag, array head, exponent and a 4 byte mantissa */
+#define FORMAT_CBOR_MAX 8
+
+/* CBOR major types */
+#define FORMAT_CBOR_UNSIGNED 0
+#define FORMAT_CBOR_NEGATIVE 1
+#define FORMAT_CBOR_BYTES    2
+#define FORMAT_CBOR_ARRAY    4
+#define FORMAT_CBOR_TAG      6
+
+extern size_t format_fixed(char *buf, int32_t value, int decimals);
+extern size_t format_uint(char *buf, uint32_t value);
+extern size_t format_uint64(char *buf, uint64_t value);
+extern size_t format_binary(uint8_t *buf, int32_t value, int decimals);
+extern size_t format_cbor_head(uint8_t *buf, int major, uint32_t arg);
+extern size_t format_cbor(uint8_t *buf, int32_t value, int decimals);
+extern int32_t format_div_round(int32_t num, int32_t den);
+
+#endif /* _FORMAT_H_ */
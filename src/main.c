@@ -18,7 +18,10 @@
 #include <stdio.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <libconfig.h>
 
@@ -27,9 +30,43 @@
 #include "debug.h"
 #include "cfg.h"
 #include "mqtt.h"
+#include "publisher.h"
+#include "evloop.h"
+#include "downlink.h"
 
 #define DEFAULT_CONFIG_FILE "/etc/nrf24-mqtt.conf"
 
+static volatile sig_atomic_t reload_pending = 0;
+static volatile sig_atomic_t quit_signal = 0;
+static char *configfile = DEFAULT_CONFIG_FILE;
+static uint32_t elapsed = 0;
+
+static void sighup_handler(int sig) {
+    reload_pending = 1;
+}
+
+static void quit_handler(int sig) {
+    quit_signal = sig;
+}
+
+static void reload(void) {
+    INFO("Reloading config from %s", configfile);
+    if(cfg_reload(configfile) == -1)
+        ERROR("Error reloading config.  Keeping the old one");
+}
+
+/* once a second */
+static void housekeeping(void) {
+    cfg_reclaim();
+
+    if(config.ring_stats_interval &&
+       ++elapsed >= config.ring_stats_interval) {
+        nrf24_recv_dump_stats();
+        publisher_dump_stats();
+        elapsed = 0;
+    }
+}
+
 void usage(char *a0) {
     fprintf(stderr, "Usage: %s [args]\n\n", a0);
     fprintf(stderr, "Valid args:\n\n");
@@ -43,8 +80,8 @@ int main(int argc, char *argv[]) {
     int opt;
     int daemonize = FALSE;
     int verbose_level = 2;
-
-    char *configfile = DEFAULT_CONFIG_FILE;
+    struct sigaction sa;
+    sigset_t hup;
 
     while((opt = getopt(argc, argv, "c:bd:")) != -1) {
         switch(opt) {
@@ -74,23 +111,97 @@ int main(int argc, char *argv[]) {
 
     cfg_dump();
 
+    /*
+     * SIGHUP, SIGTERM and SIGINT are only for the main thread; the
+     * others inherit the mask.  The event loop takes them through a
+     * signalfd, so they stay blocked everywhere.
+     */
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    sigaddset(&hup, SIGTERM);
+    sigaddset(&hup, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sighup_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+
+    sa.sa_handler = quit_handler;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    debug_rate_limit(config.log_rate_limit);
+    if(!debug_start()) {
+        ERROR("Error starting log writer.  Aborting");
+        return EXIT_FAILURE;
+    }
+
     DEBUG("Starting mqtt workers");
 
-    mqtt_init();
+    if(!mqtt_init(config.publisher_workers)) {
+        ERROR("Error starting mqtt.  Abort");
+        exit(EXIT_FAILURE);
+    }
+
+    DEBUG("Starting publisher workers");
 
-    DEBUG("Starting receive thread");
+    if(!publisher_init(config.radio_count)) {
+        ERROR("Error starting publisher.  Abort");
+        exit(EXIT_FAILURE);
+    }
+
+    DEBUG("Starting receive threads");
 
     if(!nrf24_recv_init()) {
         ERROR("Error starting radio receiver.  Abort");
         exit(EXIT_FAILURE);
     }
 
-    while(1) {
+    if(config.downlink && !downlink_init()) {
+        ERROR("Error starting downlink.  Abort");
+        exit(EXIT_FAILURE);
+    }
+
+    if(config.event_loop) {
+        if(!evloop_init(&hup)) {
+            ERROR("Error starting event loop.  Abort");
+            exit(EXIT_FAILURE);
+        }
+
+        /* radios first, so the publisher can drain what they sent */
+        evloop_run(reload, housekeeping);
+        evloop_deinit();
+        downlink_deinit();
+        nrf24_recv_deinit();
+        publisher_deinit();
+        mqtt_deinit();
+        debug_stop();
+        return EXIT_SUCCESS;
+    }
+
+    pthread_sigmask(SIG_UNBLOCK, &hup, NULL);
+
+    while(!quit_signal) {
         sleep(1);
+        if(quit_signal)
+            break;
+
+        if(reload_pending) {
+            reload_pending = 0;
+            reload();
+        }
+        housekeeping();
     }
 
+    INFO("Got signal %d, shutting down", (int)quit_signal);
+
+    /* same order as the event loop: radios first, then drain */
+    downlink_deinit();
     nrf24_recv_deinit();
+    publisher_deinit();
     mqtt_deinit();
+    debug_stop();
 
     return(EXIT_SUCCESS);
 }
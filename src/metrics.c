@@ -0,0 +1,216 @@
+/*
+ * metrics.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "metrics.h"
+
+static const char *metrics_counter_names[METRIC_COUNT] = {
+    "rx_packets",
+    "ring_drops",
+    "unknown_addresses",
+    "unknown_types",
+    "unknown_models",
+    "published",
+    "publish_errors",
+    "unchanged",
+    "deep_drains",
+    "spooled",
+    "spool_drops",
+    "duplicates",
+    "tx_commands",
+    "tx_coalesced",
+    "tx_rejected",
+    "tx_acked",
+    "tx_failed"
+};
+
+static const char *metrics_hist_names[HIST_COUNT] = {
+    "latency",
+    "publish",
+    "tx_ack",
+    "rx_off",
+    "end_to_end"
+};
+
+static metrics_block_t *metrics_blocks = NULL;
+static __thread metrics_block_t *metrics_local = NULL;
+
+/* the calling thread's block, registered on first use */
+static metrics_block_t *metrics_block(void) {
+    metrics_block_t *block = metrics_local;
+
+    if(block)
+        return block;
+
+    block = (metrics_block_t *)calloc(1, sizeof(metrics_block_t));
+    if(!block) {
+        ERROR("Malloc error");
+        abort();
+    }
+
+    block->next = __atomic_load_n(&metrics_blocks, __ATOMIC_ACQUIRE);
+    while(!__atomic_compare_exchange_n(&metrics_blocks, &block->next, block,
+                                       true, __ATOMIC_RELEASE,
+                                       __ATOMIC_ACQUIRE));
+
+    metrics_local = block;
+    return block;
+}
+
+void metrics_add(int counter, uint64_t value) {
+    metrics_block_t *block = metrics_block();
+
+    __atomic_store_n(&block->counters[counter],
+                     block->counters[counter] + value, __ATOMIC_RELAXED);
+}
+
+void metrics_inc(int counter) {
+    metrics_add(counter, 1);
+}
+
+void metrics_record(int hist, uint64_t ns) {
+    metrics_block_t *block = metrics_block();
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+    if(bucket >= METRICS_BUCKETS)
+        bucket = METRICS_BUCKETS - 1;
+
+    __atomic_store_n(&block->buckets[hist][bucket],
+                     block->buckets[hist][bucket] + 1, __ATOMIC_RELAXED);
+    if(ns > block->max[hist])
+        __atomic_store_n(&block->max[hist], ns, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_get(int counter) {
+    metrics_block_t *block = __atomic_load_n(&metrics_blocks, __ATOMIC_ACQUIRE);
+    uint64_t total = 0;
+
+    for(; block; block = block->next)
+        total += __atomic_load_n(&block->counters[counter], __ATOMIC_RELAXED);
+
+    return total;
+}
+
+void metrics_get_hist(int hist, metrics_hist_t *out) {
+    metrics_block_t *block = __atomic_load_n(&metrics_blocks, __ATOMIC_ACQUIRE);
+    uint64_t value;
+    int bucket;
+
+    memset(out, 0, sizeof(metrics_hist_t));
+
+    for(; block; block = block->next) {
+        for(bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+            value = __atomic_load_n(&block->buckets[hist][bucket],
+                                    __ATOMIC_RELAXED);
+            out->buckets[bucket] += value;
+            out->count += value;
+        }
+
+        value = __atomic_load_n(&block->max[hist], __ATOMIC_RELAXED);
+        if(value > out->max)
+            out->max = value;
+    }
+}
+
+/* upper bound of the bucket holding the pct'th percentile, in ns */
+uint64_t metrics_percentile(const metrics_hist_t *hist, int pct) {
+    uint64_t want, seen = 0;
+    int bucket;
+
+    if(!hist->count)
+        return 0;
+
+    want = (hist->count * pct + 99) / 100;
+    for(bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+        seen += hist->buckets[bucket];
+        if(seen >= want)
+            break;
+    }
+
+    if(bucket >= METRICS_BUCKETS - 1)
+        return hist->max;
+
+    /* never claim more than we actually saw */
+    if((1ULL << bucket) > hist->max)
+        return hist->max;
+    return 1ULL << bucket;
+}
+
+#define METRICS_APPEND(...) do {                                \
+        int written = snprintf(buf + pos, len - pos, __VA_ARGS__); \
+        if(written < 0 || (size_t)written >= len - pos)         \
+            return 0;                                           \
+        pos += written;                                         \
+    } while(0)
+
+/*
+ * {"uptime":123,"counters":{"rx_packets":1,...},
+ *  "latency":{"count":1,"p50_us":1,"p90_us":1,"p99_us":1,"max_us":1,
+ *             "buckets":[[le_ns,count],...]}, "publish":{...}}
+ *
+ * Returns the length, or 0 if it didn't fit.
+ */
+size_t metrics_format(char *buf, size_t len, uint64_t uptime_ns) {
+    metrics_hist_t hist;
+    size_t pos = 0;
+    int idx, bucket;
+    bool first;
+
+    METRICS_APPEND("{\"uptime\":%llu,\"counters\":{",
+                   (unsigned long long)(uptime_ns / 1000000000ULL));
+
+    for(idx = 0; idx < METRIC_COUNT; idx++)
+        METRICS_APPEND("%s\"%s\":%llu", idx ? "," : "",
+                       metrics_counter_names[idx],
+                       (unsigned long long)metrics_get(idx));
+
+    METRICS_APPEND("}");
+
+    for(idx = 0; idx < HIST_COUNT; idx++) {
+        metrics_get_hist(idx, &hist);
+
+        METRICS_APPEND(",\"%s\":{\"count\":%llu,\"p50_us\":%.1f,"
+                       "\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,"
+                       "\"buckets\":[",
+                       metrics_hist_names[idx],
+                       (unsigned long long)hist.count,
+                       metrics_percentile(&hist, 50) / 1000.0,
+                       metrics_percentile(&hist, 90) / 1000.0,
+                       metrics_percentile(&hist, 99) / 1000.0,
+                       hist.max / 1000.0);
+
+        first = true;
+        for(bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+            if(!hist.buckets[bucket])
+                continue;
+            METRICS_APPEND("%s[%llu,%llu]", first ? "" : ",",
+                           (unsigned long long)(1ULL << bucket),
+                           (unsigned long long)hist.buckets[bucket]);
+            first = false;
+        }
+
+        METRICS_APPEND("]}");
+    }
+
+    METRICS_APPEND("}");
+    return pos;
+}
@@ -0,0 +1,80 @@
+/*
+ * metrics.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define METRIC_RX_PACKETS       0
+#define METRIC_RING_DROPS       1
+#define METRIC_UNKNOWN_ADDR     2
+#define METRIC_UNKNOWN_TYPE     3
+#define METRIC_UNKNOWN_MODEL    4
+#define METRIC_PUBLISHED        5
+#define METRIC_PUBLISH_ERRORS   6
+#define METRIC_UNCHANGED        7
+#define METRIC_DEEP_DRAINS      8   /* bitbang IRQs draining 3+ payloads */
+#define METRIC_SPOOLED          9
+#define METRIC_SPOOL_DROPS      10
+#define METRIC_DUPLICATES       11
+#define METRIC_TX_COMMANDS      12  /* switch commands taken from mqtt */
+#define METRIC_TX_COALESCED     13  /* replaced a queued one */
+#define METRIC_TX_REJECTED      14  /* unknown sensor, or queue full */
+#define METRIC_TX_ACKED         15
+#define METRIC_TX_FAILED        16  /* retries ran out */
+#define METRIC_COUNT            17
+
+#define HIST_LATENCY            0   /* receive to publish */
+#define HIST_PUBLISH            1   /* time in mosquitto_publish */
+#define HIST_TX_ACK             2   /* downlink TX to ack */
+#define HIST_RX_OFF             3   /* out of RX for a downlink burst */
+#define HIST_END_TO_END         4   /* receive to mosquitto's on_publish */
+#define HIST_COUNT              5
+
+/* bucket n holds values in [2^(n-1), 2^n) ns; the last is open ended */
+#define METRICS_BUCKETS         40
+
+/*
+ * Each thread gets its own block of counters, which only it writes,
+ * so updates are plain relaxed stores with no locked instructions.
+ * Readers sum over all the blocks.
+ */
+typedef struct metrics_block_t {
+    uint64_t counters[METRIC_COUNT];
+    uint64_t buckets[HIST_COUNT][METRICS_BUCKETS];
+    uint64_t max[HIST_COUNT];
+    struct metrics_block_t *next;
+} metrics_block_t;
+
+typedef struct metrics_hist_t {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[METRICS_BUCKETS];
+} metrics_hist_t;
+
+extern void metrics_add(int counter, uint64_t value);
+extern void metrics_inc(int counter);
+extern void metrics_record(int hist, uint64_t ns);
+
+extern uint64_t metrics_get(int counter);
+extern void metrics_get_hist(int hist, metrics_hist_t *out);
+extern uint64_t metrics_percentile(const metrics_hist_t *hist, int pct);
+extern size_t metrics_format(char *buf, size_t len, uint64_t uptime_ns);
+
+#endif /* _METRICS_H_ */
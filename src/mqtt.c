@@ -18,15 +18,115 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <poll.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <mosquitto.h>
 
 #include "nrf24-mqtt.h"
 #include "debug.h"
 #include "cfg.h"
+#include "format.h"
+#include "decode.h"
+#include "sensor-cache.h"
+#include "metrics.h"
+#include "spool.h"
+#include "aggregate.h"
+#include "wheel.h"
+#include "tsdb.h"
+#include "downlink.h"
 
-struct mosquitto *mosq;
+#define MQTT_RECONNECT_MIN 1       /* seconds, doubling up to the max */
+#define MQTT_RECONNECT_MAX 30
+#define MQTT_FLUSH_MS 1000
+
+#define MQTT_JSON_MAX 32768
+
+#define MQTT_TRACE_SLOTS 4096      /* publishes in flight we can time */
+
+#define MQTT_TRACE_FREE 0
+#define MQTT_TRACE_SENT 1          /* ns is the receive time */
+#define MQTT_TRACE_DONE 2          /* ns is when on_publish came */
+
+/* a text value, or the largest encoding plus the raw struct */
+#define MQTT_PAYLOAD_MAX (FORMAT_FIXED_MAX + 2 + sizeof(sensor_struct_t))
+
+/* a reading's publish, by mid, from receive to on_publish */
+typedef struct mqtt_trace_t {
+    int mid;
+    int state;
+    uint64_t ns;
+} mqtt_trace_t;
+
+/*
+ * Everything one publisher worker needs, so workers share nothing
+ * but the config.  Only the worker's own thread touches it, apart
+ * from the mosquitto callbacks and the stats counters.
+ */
+struct mqtt_worker_t {
+    int index;
+    struct mosquitto *mosq;
+    int connected;                 /* set from the mosquitto thread */
+
+    /*
+     * MQTT 5 topic aliases.  The mosquitto thread counts connections
+     * and notes the broker's alias limit; alias_connects is the
+     * connection the aliases handed out in alias_gen are good for.
+     */
+    uint32_t connects;
+    uint16_t broker_aliases;
+    mosquitto_property **alias_props;   /* [alias], made on first use */
+    uint32_t alias_connects;
+    uint32_t alias_gen;
+    uint32_t alias_next;
+    uint32_t alias_max;
+
+    sensor_cache_t sensors;
+    cfg_snapshot_t *cfg;           /* the snapshot sensors uses */
+    cfg_reader_t reader;
+    spool_t spool;
+    tsdb_t tsdb;
+    uint64_t wall_offset_ns;       /* wall minus monotonic, last tick */
+
+    /* sensors with an open json batch, oldest first */
+    sensor_entry_t *batch_head;
+    sensor_entry_t *batch_tail;
+
+    wheel_t wheel;                 /* liveness, ticking once a second */
+    uint32_t agg_step;             /* step the accumulators are on */
+
+    uint64_t start_ns;
+    uint64_t stats_next_ns;
+    uint64_t replay_ns;
+
+    /* event loop mode: when to next try the broker, and how long after */
+    uint64_t reconnect_ns;
+    uint32_t reconnect_delay;
+
+    /* for the stats, read from other threads */
+    uint64_t published;
+    uint64_t errors;
+
+    /*
+     * End to end timing, shared with the mosquitto thread.  on_publish
+     * can come before mosquitto_publish has even handed back the mid,
+     * so whichever side gets to the slot second closes the trace.
+     */
+    pthread_mutex_t trace_lock;
+    mqtt_trace_t trace[MQTT_TRACE_SLOTS];
+
+    char json[MQTT_JSON_MAX];
+    char replay_topic[SPOOL_TOPIC_MAX];
+    char replay_payload[SPOOL_PAYLOAD_MAX];
+};
+
+static mqtt_worker_t *mqtt_workers = NULL;
+static int mqtt_worker_count = 0;
 
 char *mqtt_type_lookup[] = {
     "switch",
@@ -48,7 +148,7 @@ void mqtt_dump_message(sensor_struct_t *pmsg) {
           pmsg->addr[2],
           pmsg->addr[3],
           pmsg->addr[4]);
-    if(pmsg->type > (sizeof(mqtt_type_lookup) / sizeof(char*))) {
+    if(pmsg->type >= (sizeof(mqtt_type_lookup) / sizeof(char*))) {
         type = "unknown";
     } else {
         type = mqtt_type_lookup[pmsg->type];
@@ -82,123 +182,1221 @@ void mqtt_dump_message(sensor_struct_t *pmsg) {
 }
 
 
-bool mqtt_init(void) {
+static uint64_t mqtt_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* relaxed, for the stats: only the worker's own thread writes them */
+static void mqtt_count_add(uint64_t *counter, uint64_t value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static void mqtt_count(uint64_t *counter) {
+    mqtt_count_add(counter, 1);
+}
+
+static bool mqtt_spool(mqtt_worker_t *w, const char *topic, size_t len,
+                       const void *payload) {
+    if(!spool_push(&w->spool, topic, payload, len)) {
+        metrics_inc(METRIC_PUBLISH_ERRORS);
+        mqtt_count(&w->errors);
+        return false;
+    }
+
+    metrics_inc(METRIC_SPOOLED);
+    return true;
+}
+
+/* the cache is being rebuilt, so topics from the old one are unknown */
+static void mqtt_alias_reset(mqtt_worker_t *w) {
+    w->alias_gen++;
+    w->alias_next = 1;
+}
+
+/*
+ * MQTT 5 topic aliases: the first publish to a topic on a connection
+ * carries the topic and a new alias, and the rest just the alias,
+ * with an empty topic.  The broker forgets aliases when the
+ * connection drops, so a new connection starts a new generation and
+ * topics go out in full again.  Past the broker's Topic Alias
+ * Maximum (or ours), topics just go out in full.  Returns the alias
+ * property to send, if any; *bind is set if the alias is new.
+ */
+static const mosquitto_property *mqtt_alias(mqtt_worker_t *w,
+                                            sensor_topic_t *topic,
+                                            const char **name, bool *bind) {
+    uint32_t connects;
+
+    if(!w->alias_props)
+        return NULL;
+
+    connects = __atomic_load_n(&w->connects, __ATOMIC_ACQUIRE);
+    if(connects != w->alias_connects) {
+        w->alias_connects = connects;
+        w->alias_max = __atomic_load_n(&w->broker_aliases,
+                                       __ATOMIC_RELAXED);
+        if(w->alias_max > config.mqtt_topic_aliases)
+            w->alias_max = config.mqtt_topic_aliases;
+        mqtt_alias_reset(w);
+    }
+
+    if(topic->alias && topic->alias_gen == w->alias_gen) {
+        *name = "";
+        return w->alias_props[topic->alias];
+    }
+
+    if(w->alias_next > w->alias_max)
+        return NULL;
+
+    /* one property per alias, kept for good, so this allocates once */
+    if(!w->alias_props[w->alias_next] &&
+       mosquitto_property_add_int16(&w->alias_props[w->alias_next],
+                                    MQTT_PROP_TOPIC_ALIAS,
+                                    (uint16_t)w->alias_next) !=
+       MOSQ_ERR_SUCCESS)
+        return NULL;
+
+    *bind = true;
+    return w->alias_props[w->alias_next];
+}
+
+/*
+ * A reading's publish went out as mid.  If on_publish already came
+ * for it, that's the end of the trace; otherwise on_publish ends it.
+ * An on_publish older than the packet is a stale slot, not ours.
+ */
+static void mqtt_trace_sent(mqtt_worker_t *w, int mid, uint64_t rx_ns) {
+    mqtt_trace_t *trace = &w->trace[mid & (MQTT_TRACE_SLOTS - 1)];
+
+    pthread_mutex_lock(&w->trace_lock);
+    if(trace->state == MQTT_TRACE_DONE && trace->mid == mid &&
+       trace->ns >= rx_ns) {
+        metrics_record(HIST_END_TO_END, trace->ns - rx_ns);
+        trace->state = MQTT_TRACE_FREE;
+    } else {
+        trace->mid = mid;
+        trace->state = MQTT_TRACE_SENT;
+        trace->ns = rx_ns;
+    }
+    pthread_mutex_unlock(&w->trace_lock);
+}
+
+/*
+ * With QoS 0, mosquitto calls this once the publish is written to
+ * the socket; with QoS 1 or 2, once the broker has acknowledged it.
+ * Stats and spool replays aren't traced, so their mids are noted
+ * and never matched.
+ */
+static void mqtt_on_publish(struct mosquitto *m, void *obj, int mid) {
+    mqtt_worker_t *w = (mqtt_worker_t *)obj;
+    mqtt_trace_t *trace = &w->trace[mid & (MQTT_TRACE_SLOTS - 1)];
+    uint64_t now_ns = mqtt_now_ns();
+
+    pthread_mutex_lock(&w->trace_lock);
+    if(trace->state == MQTT_TRACE_SENT && trace->mid == mid) {
+        metrics_record(HIST_END_TO_END, now_ns - trace->ns);
+        trace->state = MQTT_TRACE_FREE;
+    } else {
+        trace->mid = mid;
+        trace->state = MQTT_TRACE_DONE;
+        trace->ns = now_ns;
+    }
+    pthread_mutex_unlock(&w->trace_lock);
+}
+
+/*
+ * Hand a payload to mosquitto, timing the call and, for readings,
+ * how long it has been since the packet came off the air.  Readings
+ * are spooled instead while we're disconnected, or while older ones
+ * are still waiting to go out, so they stay in order, if keep is
+ * set.  Stats aren't worth keeping.  With MQTT 5, a cached topic
+ * passed as alias goes out by its topic alias.  readings is how many
+ * sensor readings the payload carries, for the published counts.
+ */
+static bool mqtt_send(mqtt_worker_t *w, const char *topic,
+                      sensor_topic_t *alias, size_t len,
+                      const void *payload, uint64_t rx_ns,
+                      uint32_t readings, bool keep) {
+    const mosquitto_property *props = NULL;
+    const char *name = topic;
+    bool bind = false;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    int mid = 0;
+    int rc;
+
+    if(keep && spool_enabled(&w->spool) &&
+       (!__atomic_load_n(&w->connected, __ATOMIC_ACQUIRE) ||
+        !spool_empty(&w->spool)))
+        return mqtt_spool(w, topic, len, payload);
+
+    if(alias)
+        props = mqtt_alias(w, alias, &name, &bind);
+
+    start_ns = mqtt_now_ns();
+    if(config.mqtt_v5)
+        rc = mosquitto_publish_v5(w->mosq, &mid, name, (int)len, payload,
+                                  config.mqtt_qos, true, props);
+    else
+        rc = mosquitto_publish(w->mosq, &mid, topic, (int)len, payload,
+                               config.mqtt_qos, true);
+
+    end_ns = mqtt_now_ns();
+    metrics_record(HIST_PUBLISH, end_ns - start_ns);
+
+    if(rc == MOSQ_ERR_NO_CONN && keep && spool_enabled(&w->spool))
+        return mqtt_spool(w, topic, len, payload);
+
+    if(rc != MOSQ_ERR_SUCCESS) {
+        ERROR_LIMITED("Got mosquitto error on worker %d: %d", w->index, rc);
+        metrics_inc(METRIC_PUBLISH_ERRORS);
+        mqtt_count(&w->errors);
+        return false;
+    }
+
+    if(bind) {
+        alias->alias = (uint16_t)w->alias_next++;
+        alias->alias_gen = w->alias_gen;
+    }
+
+    if(readings) {
+        mqtt_trace_sent(w, mid, rx_ns);
+        metrics_record(HIST_LATENCY, end_ns - rx_ns);
+        metrics_add(METRIC_PUBLISHED, readings);
+        mqtt_count_add(&w->published, readings);
+    }
+    return true;
+}
+
+static bool mqtt_publish(mqtt_worker_t *w, const char *topic, size_t len,
+                         const void *payload, uint64_t rx_ns,
+                         uint32_t readings, bool keep) {
+    return mqtt_send(w, topic, NULL, len, payload, rx_ns, readings, keep);
+}
+
+static uint64_t mqtt_wall_offset_ns(void) {
+    struct timespec mono, wall;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &wall);
+
+    return ((uint64_t)wall.tv_sec * 1000000000ULL + wall.tv_nsec) -
+        ((uint64_t)mono.tv_sec * 1000000000ULL + mono.tv_nsec);
+}
+
+static size_t mqtt_json_append(mqtt_worker_t *w, size_t pos, const char *str,
+                               size_t len) {
+    if(pos + len >= MQTT_JSON_MAX)
+        return pos;
+
+    memcpy(w->json + pos, str, len);
+    return pos + len;
+}
+
+static size_t mqtt_json_string(mqtt_worker_t *w, size_t pos,
+                               const char *str) {
+    pos = mqtt_json_append(w, pos, "\"", 1);
+    while(*str && pos + 8 < MQTT_JSON_MAX) {
+        if((unsigned char)*str < 0x20) {
+            pos += (size_t)snprintf(w->json + pos, 7, "\\u%04x",
+                                    (unsigned char)*str++);
+            continue;
+        }
+        if(*str == '"' || *str == '\\')
+            w->json[pos++] = '\\';
+        w->json[pos++] = *str++;
+    }
+    return mqtt_json_append(w, pos, "\"", 1);
+}
+
+static void mqtt_batch_unlink(mqtt_worker_t *w, sensor_entry_t *sensor) {
+    if(sensor->batch_prev)
+        sensor->batch_prev->batch_next = sensor->batch_next;
+    else
+        w->batch_head = sensor->batch_next;
+
+    if(sensor->batch_next)
+        sensor->batch_next->batch_prev = sensor->batch_prev;
+    else
+        w->batch_tail = sensor->batch_prev;
+
+    sensor->batch_prev = sensor->batch_next = NULL;
+}
+
+/*
+ * {"sensor":"home.bedroom","readings":[
+ *   {"ch":"temp0","v":71.2,"ts":1444444444123}, ...]}
+ *
+ * ts is the receive time, in milliseconds since the epoch.
+ */
+static void mqtt_batch_flush(mqtt_worker_t *w, sensor_entry_t *sensor) {
+    uint64_t offset_ns = mqtt_wall_offset_ns();
+    char number[24];
+    size_t pos = 0;
+    int idx;
+
+    pos = mqtt_json_append(w, pos, "{\"sensor\":", 10);
+    pos = mqtt_json_string(w, pos, sensor->name);
+    pos = mqtt_json_append(w, pos, ",\"readings\":[", 13);
+
+    for(idx = 0; idx < sensor->batch_count; idx++) {
+        sensor_reading_t *reading = &sensor->batch[idx];
+
+        if(idx)
+            pos = mqtt_json_append(w, pos, ",", 1);
+        pos = mqtt_json_append(w, pos, "{\"ch\":", 6);
+        pos = mqtt_json_string(w, pos, reading->topic->topic +
+                               reading->topic->channel_offset);
+        pos = mqtt_json_append(w, pos, ",\"v\":", 5);
+        pos = mqtt_json_append(w, pos, number,
+                               format_fixed(number, reading->value,
+                                            reading->decimals));
+        pos = mqtt_json_append(w, pos, ",\"ts\":", 6);
+        pos = mqtt_json_append(w, pos, number,
+                               format_uint64(number, (reading->rx_ns +
+                                                      offset_ns) / 1000000));
+        pos = mqtt_json_append(w, pos, "}", 1);
+    }
+
+    pos = mqtt_json_append(w, pos, "]}", 2);
+
+    mqtt_batch_unlink(w, sensor);
+
+    DEBUG("Sending batch %s -> %.*s", sensor->name, (int)pos, w->json);
+
+    /* latency is measured from the oldest reading in the batch */
+    mqtt_publish(w, sensor->name, pos, w->json, sensor->batch_start_ns,
+                 (uint32_t)sensor->batch_count, true);
+    sensor->batch_count = 0;
+}
+
+static bool mqtt_batch_add(mqtt_worker_t *w, sensor_entry_t *sensor,
+                           sensor_topic_t *topic, int32_t fixed,
+                           int decimals, uint64_t rx_ns) {
+    sensor_reading_t *reading;
+
+    /* once per sensor, so the steady state doesn't allocate */
+    if(!sensor->batch) {
+        sensor->batch = (sensor_reading_t *)calloc(w->cfg->batch_max,
+                                                   sizeof(sensor_reading_t));
+        if(!sensor->batch) {
+            ERROR("Malloc error");
+            return false;
+        }
+    }
+
+    if(!sensor->batch_count) {
+        sensor->batch_start_ns = rx_ns;
+        sensor->batch_prev = w->batch_tail;
+        sensor->batch_next = NULL;
+        if(w->batch_tail)
+            w->batch_tail->batch_next = sensor;
+        else
+            w->batch_head = sensor;
+        w->batch_tail = sensor;
+    }
+
+    reading = &sensor->batch[sensor->batch_count++];
+    reading->topic = topic;
+    reading->value = fixed;
+    reading->decimals = decimals;
+    reading->rx_ns = rx_ns;
+
+    if(sensor->batch_count >= w->cfg->batch_max)
+        mqtt_batch_flush(w, sensor);
+
+    return true;
+}
+
+static void mqtt_status_send(mqtt_worker_t *w, sensor_entry_t *sensor,
+                             uint8_t status) {
+    char topic[SPOOL_TOPIC_MAX];
+    const char *payload = (status == SENSOR_STATUS_ONLINE) ?
+        "online" : "offline";
+    int len;
+
+    sensor->status = status;
+
+    len = snprintf(topic, sizeof(topic), "%s/status", sensor->name);
+    if(len < 0 || len >= sizeof(topic)) {
+        ERROR_LIMITED("Status topic too long for %s", sensor->name);
+        return;
+    }
+
+    if(status == SENSOR_STATUS_ONLINE)
+        INFO("Sensor %s is online", sensor->name);
+    else
+        WARN("Sensor %s is offline", sensor->name);
+
+    mqtt_publish(w, topic, strlen(payload), payload, 0, 0, true);
+}
+
+/* heard from the sensor: push its deadline out */
+static void mqtt_liveness_seen(mqtt_worker_t *w, sensor_entry_t *sensor,
+                               uint64_t rx_ns) {
+    if(!sensor->map->offline_after)
+        return;
+
+    wheel_add(&w->wheel, &sensor->liveness,
+              rx_ns / 1000000000ULL + sensor->map->offline_after);
+
+    if(sensor->status != SENSOR_STATUS_ONLINE)
+        mqtt_status_send(w, sensor, SENSOR_STATUS_ONLINE);
+}
+
+static void mqtt_liveness_expire(wheel_timer_t *timer, void *arg) {
+    mqtt_worker_t *w = (mqtt_worker_t *)arg;
+    sensor_entry_t *sensor = (sensor_entry_t *)
+        ((char *)timer - offsetof(sensor_entry_t, liveness));
+
+    if(sensor->status != SENSOR_STATUS_OFFLINE)
+        mqtt_status_send(w, sensor, SENSOR_STATUS_OFFLINE);
+}
+
+/*
+ * Start the clock on every tracked exact address, so a sensor that
+ * never reports at all still goes offline.  Wildcard sensors are
+ * only known once heard.  Each worker only tracks the addresses
+ * routed to it.
+ */
+static void mqtt_liveness_arm(mqtt_worker_t *w, sensor_cache_t *sensors,
+                              uint64_t now_ns) {
+    sensor_entry_t *sensor;
+    addr_map_t *map;
+
+    for(map = sensors->snap->map.next; map; map = map->next) {
+        if(map->prefix_len < 5 || !map->offline_after ||
+           mqtt_worker_route(map->addr) != w->index)
+            continue;
+
+        sensor = sensor_cache_lookup(sensors, map->addr,
+                                     map->pipe < 0 ? 0 : map->pipe);
+        if(sensor && sensor->map == map && !wheel_pending(&sensor->liveness))
+            wheel_add(&w->wheel, &sensor->liveness,
+                      now_ns / 1000000000ULL + map->offline_after);
+    }
+}
+
+/*
+ * Carry status and deadlines over to the rebuilt cache, so a reload
+ * doesn't announce every sensor again.  The deadline is cut short
+ * if the new map expects to hear from the sensor sooner.
+ */
+static void mqtt_liveness_move(mqtt_worker_t *w, sensor_cache_t *from,
+                               sensor_cache_t *to, uint64_t now_ns) {
+    sensor_entry_t *old, *sensor;
+    uint64_t expires;
+    uint32_t pos;
+
+    for(pos = 0; pos <= from->mask; pos++) {
+        old = from->slots[pos];
+        if(!old || old->status == SENSOR_STATUS_UNKNOWN)
+            continue;
+
+        sensor = sensor_cache_lookup(to, old->addr, old->pipe);
+        if(!sensor || !sensor->map->offline_after)
+            continue;
+
+        sensor->status = old->status;
+        if(old->status != SENSOR_STATUS_ONLINE)
+            continue;
+
+        expires = now_ns / 1000000000ULL + sensor->map->offline_after;
+        if(wheel_pending(&old->liveness) && old->liveness.expires < expires)
+            expires = old->liveness.expires;
+        wheel_add(&w->wheel, &sensor->liveness, expires);
+    }
+}
+
+/*
+ * Pick up a reloaded config.  Open batches go out under the old
+ * names, and the sensor cache is rebuilt against the new map.  Only
+ * then do we tell cfg we're done with the old snapshot.
+ */
+static void mqtt_sync_config(mqtt_worker_t *w, uint64_t now_ns) {
+    cfg_snapshot_t *snap = cfg_snapshot();
+    sensor_cache_t sensors;
+
+    if(snap == w->cfg)
+        return;
+
+    if(!sensor_cache_init(&sensors, snap))
+        return;
+
+    while(w->batch_head)
+        mqtt_batch_flush(w, w->batch_head);
+    tsdb_flush_all(&w->tsdb);
+
+    mqtt_liveness_move(w, &w->sensors, &sensors, now_ns);
+    mqtt_liveness_arm(w, &sensors, now_ns);
+
+    sensor_cache_deinit(&w->sensors);
+    w->sensors = sensors;
+    w->cfg = snap;
+    w->agg_step = 0;
+    mqtt_alias_reset(w);
+
+    cfg_reader_quiescent(&w->reader, snap);
+    INFO("Publishing with configuration generation %llu",
+         (unsigned long long)snap->generation);
+}
+
+/* fixed point value in thousandths, for comparing across precisions */
+static int32_t mqtt_milli(int32_t value, int decimals) {
+    static const int32_t scale[] = { 1000, 100, 10, 1 };
+
+    return value * scale[decimals];
+}
+
+/* steps count from the epoch, so windows line up with the wall clock */
+static uint32_t mqtt_agg_step_of(mqtt_worker_t *w, uint64_t ns) {
+    return (uint32_t)((ns + w->wall_offset_ns) /
+                      (w->cfg->aggregate_step * 1000000000ULL));
+}
+
+/* every reading counts, changed or not */
+static bool mqtt_aggregate_add(mqtt_worker_t *w, sensor_topic_t *topic,
+                               int32_t fixed, int decimals,
+                               uint64_t rx_ns) {
+    /* once per channel, so the steady state doesn't allocate */
+    if(!topic->agg) {
+        topic->agg = (agg_t *)calloc(1, sizeof(agg_t));
+        if(!topic->agg) {
+            ERROR("Malloc error");
+            return false;
+        }
+    }
+
+    topic->agg->decimals = (uint8_t)decimals;
+    agg_add(topic->agg, mqtt_agg_step_of(w, rx_ns),
+            mqtt_milli(fixed, decimals));
+    return true;
+}
+
+/* every reading, changed or not, as wall clock ms and thousandths */
+static bool mqtt_history_add(mqtt_worker_t *w, sensor_topic_t *topic,
+                             int32_t fixed, int decimals, uint64_t rx_ns) {
+    /* once per channel, so the steady state doesn't allocate */
+    if(!topic->series) {
+        topic->series = (tsdb_series_t *)calloc(1, sizeof(tsdb_series_t));
+        if(!topic->series) {
+            ERROR("Malloc error");
+            return false;
+        }
+        topic->series->name = topic->topic;
+    }
+
+    tsdb_add(&w->tsdb, topic->series,
+             (int64_t)((rx_ns + w->wall_offset_ns) / 1000000ULL),
+             mqtt_milli(fixed, decimals), rx_ns);
+    return true;
+}
+
+static size_t mqtt_agg_value(mqtt_worker_t *w, size_t pos, const char *key,
+                             int32_t milli, int decimals) {
+    static const int32_t scale[] = { 1000, 100, 10, 1 };
+    char number[FORMAT_FIXED_MAX];
+
+    pos = mqtt_json_append(w, pos, key, strlen(key));
+    return mqtt_json_append(w, pos, number, format_fixed(
+                                number, format_div_round(milli, scale[decimals]),
+                                decimals));
+}
+
+/*
+ * <aggregate_topic>/<seconds>/<name>/<type><instance>
+ *   {"min":70.1,"max":72.3,"mean":71.24,"count":58}
+ *
+ * The mean gets one more digit than the readings.
+ */
+static void mqtt_aggregate_send(mqtt_worker_t *w, sensor_topic_t *topic,
+                                uint32_t seconds,
+                                const agg_summary_t *summary) {
+    char name[SPOOL_TOPIC_MAX];
+    char number[24];
+    int decimals = topic->agg->decimals;
+    size_t pos = 0;
+    int len;
+
+    len = snprintf(name, sizeof(name), "%s/%u/%s", w->cfg->aggregate_topic,
+                   seconds, topic->topic);
+    if(len < 0 || len >= sizeof(name)) {
+        ERROR_LIMITED("Aggregate topic too long for %s", topic->topic);
+        return;
+    }
+
+    pos = mqtt_agg_value(w, pos, "{\"min\":", summary->min, decimals);
+    pos = mqtt_agg_value(w, pos, ",\"max\":", summary->max, decimals);
+    pos = mqtt_agg_value(w, pos, ",\"mean\":", summary->mean,
+                         decimals < 3 ? decimals + 1 : 3);
+    pos = mqtt_json_append(w, pos, ",\"count\":", 9);
+    pos = mqtt_json_append(w, pos, number,
+                           format_uint(number, summary->count));
+    pos = mqtt_json_append(w, pos, "}", 1);
+
+    DEBUG("Sending aggregate %s -> %.*s", name, (int)pos, w->json);
+    mqtt_publish(w, name, pos, w->json, 0, 0, true);
+}
+
+/* publish every window that ends on the boundary starting step */
+static void mqtt_aggregate_close(mqtt_worker_t *w, uint32_t step) {
+    sensor_entry_t *sensor;
+    sensor_topic_t *topic;
+    agg_summary_t summary;
+    uint32_t steps;
+    uint32_t pos;
+
+    for(int window = 0; window < w->cfg->aggregate_count; window++) {
+        steps = w->cfg->aggregate_windows[window];
+        if(step % steps)
+            continue;
+
+        for(pos = 0; pos <= w->sensors.mask; pos++) {
+            if(!(sensor = w->sensors.slots[pos]))
+                continue;
+
+            for(topic = sensor->topics; topic; topic = topic->next) {
+                if(topic->agg &&
+                   agg_summary(topic->agg, step - 1, steps, &summary))
+                    mqtt_aggregate_send(w, topic, steps *
+                                        w->cfg->aggregate_step, &summary);
+            }
+        }
+    }
+}
+
+/*
+ * On each step boundary, publish every window that ends there.
+ * Windows are aligned to their own length on the wall clock, so a
+ * 300s window goes out every five minutes on the five minute mark.
+ * A late tick closes every boundary it passed, back as far as the
+ * accumulators remember; a clock stepped backwards just starts over
+ * from the new step.
+ */
+static void mqtt_aggregate_tick(mqtt_worker_t *w, uint64_t now_ns) {
+    uint32_t step, next;
+
+    if(!w->cfg->aggregate_count)
+        return;
+
+    step = mqtt_agg_step_of(w, now_ns);
+    if(step == w->agg_step)
+        return;
+
+    if(!w->agg_step || step < w->agg_step) {
+        w->agg_step = step;
+        return;
+    }
+
+    next = w->agg_step + 1;
+    if(step - next >= AGG_SLOTS)
+        next = step - AGG_SLOTS + 1;
+    w->agg_step = step;
+
+    for(; next <= step; next++)
+        mqtt_aggregate_close(w, next);
+}
+
+/*
+ * Send spooled readings, oldest first, at no more than
+ * spool_replay_rate a second so a long outage doesn't hit the
+ * broker all at once.  Anything that fails stays spooled.
+ */
+static void mqtt_replay(mqtt_worker_t *w, uint64_t now_ns) {
+    uint64_t allowed = UINT64_MAX;
+    size_t len;
     int rc;
 
+    if(spool_empty(&w->spool) ||
+       !__atomic_load_n(&w->connected, __ATOMIC_ACQUIRE)) {
+        w->replay_ns = now_ns;
+        return;
+    }
+
+    if(config.spool_replay_rate) {
+        allowed = (now_ns - w->replay_ns) * config.spool_replay_rate /
+            1000000000ULL;
+        if(!allowed)
+            return;
+        if(allowed > config.spool_replay_rate)
+            allowed = config.spool_replay_rate;
+    }
+    w->replay_ns = now_ns;
+
+    while(allowed-- &&
+          spool_peek(&w->spool, w->replay_topic, w->replay_payload, &len)) {
+        rc = mosquitto_publish(w->mosq, NULL, w->replay_topic, (int)len,
+                               w->replay_payload, config.mqtt_qos, true);
+        if(rc != MOSQ_ERR_SUCCESS) {
+            ERROR_LIMITED("Got mosquitto error replaying spool: %d", rc);
+            return;
+        }
+
+        spool_pop(&w->spool);
+        metrics_inc(METRIC_PUBLISHED);
+        mqtt_count(&w->published);
+
+        if(spool_empty(&w->spool))
+            INFO("Spool replayed");
+    }
+}
+
+/*
+ * Periodic work, called from the publisher thread at least every
+ * few hundred milliseconds.  Batches are queued in the order they
+ * were opened, so only the expired ones at the head get looked at.
+ */
+void mqtt_tick(mqtt_worker_t *w, uint64_t now_ns) {
+    uint64_t window_ns;
+    size_t len;
+
+    mqtt_sync_config(w, now_ns);
+    window_ns = w->cfg->batch_window_ms * 1000000ULL;
+
+    while(w->batch_head &&
+          now_ns - w->batch_head->batch_start_ns >= window_ns)
+        mqtt_batch_flush(w, w->batch_head);
+
+    wheel_advance(&w->wheel, now_ns / 1000000000ULL, mqtt_liveness_expire, w);
+    w->wall_offset_ns = mqtt_wall_offset_ns();
+    mqtt_aggregate_tick(w, now_ns);
+    mqtt_replay(w, now_ns);
+    spool_sync(&w->spool);
+
+    if(tsdb_enabled(&w->tsdb))
+        tsdb_tick(&w->tsdb, now_ns);
+
+    /* the counters are process wide, so one worker sends them */
+    if(w->index || !config.stats_interval || !config.stats_topic)
+        return;
+
+    if(!w->stats_next_ns) {
+        w->start_ns = now_ns;
+        w->stats_next_ns = now_ns + config.stats_interval * 1000000000ULL;
+        return;
+    }
+
+    if(now_ns < w->stats_next_ns)
+        return;
+
+    w->stats_next_ns = now_ns + config.stats_interval * 1000000000ULL;
+
+    len = metrics_format(w->json, MQTT_JSON_MAX, now_ns - w->start_ns);
+    if(!len) {
+        ERROR("Stats too large to publish");
+        return;
+    }
+
+    DEBUG("Sending stats %s -> %.*s", config.stats_topic, (int)len,
+          w->json);
+    mqtt_publish(w, config.stats_topic, len, w->json, 0, 0, false);
+}
+
+static void mqtt_on_connect(struct mosquitto *m, void *obj, int rc) {
+    mqtt_worker_t *w = (mqtt_worker_t *)obj;
+
+    if(rc) {
+        WARN("Broker %s:%d refused connection from worker %d: %d",
+             config.mqtt_host, config.mqtt_port, w->index, rc);
+        return;
+    }
+
+    INFO("Worker %d connected to broker %s:%d", w->index, config.mqtt_host,
+         config.mqtt_port);
+    __atomic_store_n(&w->connected, 1, __ATOMIC_RELEASE);
+
+    /* a clean session, so subscriptions go with the connection */
+    if(config.downlink && !w->index) {
+        rc = mosquitto_subscribe(m, NULL, config.downlink_topic, 1);
+        if(rc != MOSQ_ERR_SUCCESS)
+            WARN("Cannot subscribe to %s: %d", config.downlink_topic, rc);
+    }
+}
+
+/* 1, on or true, 0, off or false, in any case; -1 for anything else */
+static int mqtt_switch_value(const char *payload, int len) {
+    static const char *words[] = { "0", "off", "false", "1", "on", "true" };
+    int idx;
+
+    for(idx = 0; idx < 6; idx++) {
+        if((int)strlen(words[idx]) == len &&
+           !strncasecmp(payload, words[idx], len))
+            return idx >= 3;
+    }
+
+    return -1;
+}
+
+/*
+ * Switch commands, on <name>/switch<N>/set.  Retained ones are left
+ * alone, so reconnecting doesn't send the last command again.
+ */
+static void mqtt_on_message(struct mosquitto *m, void *obj,
+                            const struct mosquitto_message *msg) {
+    const char *topic = msg->topic;
+    const char *end, *level, *pos;
+    size_t len = strlen(topic);
+    int instance = 0;
+    int value;
+
+    if(msg->retain || len < 4 || strcmp(topic + len - 4, "/set"))
+        return;
+
+    end = topic + len - 4;
+    for(level = end; level > topic && level[-1] != '/'; level--);
+
+    if(level == topic || end - level < 7 || strncmp(level, "switch", 6))
+        goto bad;
+
+    for(pos = level + 6; pos < end; pos++) {
+        if(*pos < '0' || *pos > '9' || instance > 255)
+            goto bad;
+        instance = instance * 10 + (*pos - '0');
+    }
+
+    value = mqtt_switch_value((const char *)msg->payload, msg->payloadlen);
+    if(value < 0)
+        goto bad;
+
+    DEBUG("Command %s -> %d", topic, value);
+    downlink_command(topic, level - 1 - topic, instance, value);
+    return;
+
+bad:
+    metrics_inc(METRIC_TX_REJECTED);
+    WARN_LIMITED("Ignoring command on %s", topic);
+}
+
+/* MQTT 5: the CONNACK says how many topic aliases we can use */
+static void mqtt_on_connect_v5(struct mosquitto *m, void *obj, int rc,
+                               int flags, const mosquitto_property *props) {
+    mqtt_worker_t *w = (mqtt_worker_t *)obj;
+    uint16_t aliases = 0;
+
+    if(!rc) {
+        mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM,
+                                      &aliases, false);
+        DEBUG("Worker %d: broker allows %d topic aliases", w->index,
+              aliases);
+        __atomic_store_n(&w->broker_aliases, aliases, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&w->connects, 1, __ATOMIC_RELEASE);
+    }
+
+    mqtt_on_connect(m, obj, rc);
+}
+
+static void mqtt_on_disconnect(struct mosquitto *m, void *obj, int rc) {
+    mqtt_worker_t *w = (mqtt_worker_t *)obj;
+
+    __atomic_store_n(&w->connected, 0, __ATOMIC_RELEASE);
+
+    /* rc 0 is our own mosquitto_disconnect */
+    if(rc)
+        WARN("Worker %d lost connection to broker %s:%d%s", w->index,
+             config.mqtt_host, config.mqtt_port,
+             spool_enabled(&w->spool) ? ", spooling" : "");
+}
+
+/*
+ * Which worker publishes for this address.  Only the address, not
+ * the pipe, so everything a sensor sends stays on one worker, in
+ * order.
+ */
+int mqtt_worker_route(const uint8_t *addr) {
+    uint32_t hash = 2166136261U;
+    int pos;
+
+    if(mqtt_worker_count < 2)
+        return 0;
+
+    for(pos = 0; pos < 5; pos++)
+        hash = (hash ^ addr[pos]) * 16777619U;
+
+    /* the low bits alone only see the low bits of the last byte */
+    hash ^= hash >> 15;
+    return (int)(hash % (uint32_t)mqtt_worker_count);
+}
+
+mqtt_worker_t *mqtt_worker_get(int index) {
+    return &mqtt_workers[index];
+}
+
+void mqtt_worker_get_stats(mqtt_worker_t *w, mqtt_worker_stats_t *stats) {
+    stats->connected = __atomic_load_n(&w->connected, __ATOMIC_ACQUIRE);
+    stats->published = __atomic_load_n(&w->published, __ATOMIC_RELAXED);
+    stats->errors = __atomic_load_n(&w->errors, __ATOMIC_RELAXED);
+    stats->spooled = spool_count(&w->spool);
+}
+
+/*
+ * Connecting happens in the background, and mosquitto keeps retrying
+ * if the broker isn't there, so we never hold up the radios.  In
+ * event loop mode there's no mosquitto thread: the loop drives the
+ * socket with the mqtt_loop_ functions, and we do the retrying.
+ */
+static bool mqtt_worker_init(mqtt_worker_t *w, int index) {
+    char file[PATH_MAX];
+    int rc;
+
+    w->index = index;
+    w->reconnect_delay = MQTT_RECONNECT_MIN;
+    w->wall_offset_ns = mqtt_wall_offset_ns();
+    pthread_mutex_init(&w->trace_lock, NULL);
+
+    w->cfg = cfg_snapshot();
+    if(!sensor_cache_init(&w->sensors, w->cfg))
+        return false;
+    cfg_reader_register(&w->reader, w->cfg);
+
+    wheel_init(&w->wheel, mqtt_now_ns() / 1000000000ULL);
+    mqtt_liveness_arm(w, &w->sensors, mqtt_now_ns());
+
+    w->mosq = mosquitto_new(NULL, true, w);
+    if(!w->mosq) {
+        ERROR("Cannot create mosquitto client");
+        return false;
+    }
+
+    /* worker 0 keeps the plain name, so existing spools carry on */
+    if(config.spool_file) {
+        if(index)
+            snprintf(file, sizeof(file), "%s.%d", config.spool_file, index);
+        else
+            snprintf(file, sizeof(file), "%s", config.spool_file);
+        if(!spool_open(&w->spool, file, config.spool_size))
+            return false;
+    }
+
+    if(config.tsdb_dir) {
+        if(!tsdb_open(&w->tsdb, config.tsdb_dir, index,
+                      config.tsdb_segment_hours, config.tsdb_retention_days,
+                      config.tsdb_flush_interval))
+            return false;
+    }
+
+    if(config.mqtt_v5) {
+        mosquitto_int_option(w->mosq, MOSQ_OPT_PROTOCOL_VERSION,
+                             MQTT_PROTOCOL_V5);
+        mosquitto_connect_v5_callback_set(w->mosq, mqtt_on_connect_v5);
+
+        if(config.mqtt_topic_aliases) {
+            w->alias_props = (mosquitto_property **)calloc(
+                config.mqtt_topic_aliases + 1, sizeof(mosquitto_property *));
+            if(!w->alias_props) {
+                ERROR("Malloc error");
+                return false;
+            }
+        }
+    } else {
+        mosquitto_connect_callback_set(w->mosq, mqtt_on_connect);
+    }
+    mosquitto_disconnect_callback_set(w->mosq, mqtt_on_disconnect);
+    mosquitto_publish_callback_set(w->mosq, mqtt_on_publish);
+    if(config.downlink && !index)
+        mosquitto_message_callback_set(w->mosq, mqtt_on_message);
+    mosquitto_reconnect_delay_set(w->mosq, 1, 30, true);
+
+    rc = mosquitto_connect_async(w->mosq, config.mqtt_host,
+                                 config.mqtt_port, config.mqtt_keepalive);
+    if(rc != MOSQ_ERR_SUCCESS)
+        WARN("Cannot connect to broker %s:%d yet (%d), will keep trying",
+             config.mqtt_host, config.mqtt_port, rc);
+
+    if(!config.event_loop)
+        mosquitto_loop_start(w->mosq);
+    return true;
+}
+
+/* one connection, cache and spool per worker */
+bool mqtt_init(int workers) {
     DEBUG("Initializing mosquitto lib");
     mosquitto_lib_init();
-    mosq = mosquitto_new(NULL, true, NULL);
-    rc = mosquitto_connect(mosq, config.mqtt_host,
-                           config.mqtt_port, config.mqtt_keepalive);
-    if(rc !=- MOSQ_ERR_SUCCESS) {
-        ERROR("Cannot connect to mosquito server");
-        exit(1);
+
+    mqtt_workers = (mqtt_worker_t *)calloc(workers, sizeof(mqtt_worker_t));
+    if(!mqtt_workers) {
+        ERROR("Malloc error");
+        return false;
+    }
+    mqtt_worker_count = workers;
+
+    for(int idx = 0; idx < workers; idx++) {
+        if(!mqtt_worker_init(&mqtt_workers[idx], idx))
+            return false;
     }
 
-    mosquitto_loop_start(mosq);
     return true;
 }
 
+/* -1 while disconnected */
+int mqtt_socket(mqtt_worker_t *w) {
+    return mosquitto_socket(w->mosq);
+}
+
+bool mqtt_want_write(mqtt_worker_t *w) {
+    return mosquitto_want_write(w->mosq);
+}
+
+/* errors close the socket and call on_disconnect, which is all we need */
+void mqtt_loop_read(mqtt_worker_t *w) {
+    mosquitto_loop_read(w->mosq, 1);
+}
+
+void mqtt_loop_write(mqtt_worker_t *w) {
+    mosquitto_loop_write(w->mosq, 1);
+}
+
+/*
+ * Keepalives, and reconnecting with backoff.  A socket that closes
+ * here is only replaced on a later call, so the loop always sees it
+ * go away before a new one turns up.
+ */
+void mqtt_loop_misc(mqtt_worker_t *w, uint64_t now_ns) {
+    int rc;
+
+    if(mosquitto_socket(w->mosq) != -1) {
+        if(__atomic_load_n(&w->connected, __ATOMIC_ACQUIRE))
+            w->reconnect_delay = MQTT_RECONNECT_MIN;
+        mosquitto_loop_misc(w->mosq);
+        return;
+    }
+
+    if(now_ns < w->reconnect_ns)
+        return;
+
+    rc = mosquitto_reconnect_async(w->mosq);
+    if(rc != MOSQ_ERR_SUCCESS)
+        WARN_LIMITED("Cannot reconnect to broker %s:%d (%d), retrying in %ds",
+                     config.mqtt_host, config.mqtt_port, rc,
+                     w->reconnect_delay);
+
+    w->reconnect_ns = now_ns + w->reconnect_delay * 1000000000ULL;
+    w->reconnect_delay *= 2;
+    if(w->reconnect_delay > MQTT_RECONNECT_MAX)
+        w->reconnect_delay = MQTT_RECONNECT_MAX;
+}
+
+/* give queued output a moment to get out before we hang up */
+static void mqtt_flush(mqtt_worker_t *w) {
+    struct pollfd pfd;
+    int waited;
+
+    for(waited = 0; waited < MQTT_FLUSH_MS && mosquitto_want_write(w->mosq);
+        waited += 100) {
+        pfd.fd = mosquitto_socket(w->mosq);
+        pfd.events = POLLOUT;
+        if(pfd.fd == -1)
+            return;
+        if(poll(&pfd, 1, 100) > 0)
+            mosquitto_loop_write(w->mosq, 1);
+    }
+}
+
+static void mqtt_worker_deinit(mqtt_worker_t *w) {
+    while(w->batch_head)
+        mqtt_batch_flush(w, w->batch_head);
+
+    if(w->mosq) {
+        if(!config.event_loop) {
+            /* a clean disconnect goes out after what's queued */
+            if(__atomic_load_n(&w->connected, __ATOMIC_ACQUIRE) &&
+               mosquitto_disconnect(w->mosq) == MOSQ_ERR_SUCCESS)
+                mosquitto_loop_stop(w->mosq, false);
+            else
+                mosquitto_loop_stop(w->mosq, true);
+        } else {
+            mqtt_flush(w);
+            mosquitto_disconnect(w->mosq);
+            mqtt_flush(w);
+        }
+        mosquitto_destroy(w->mosq);
+    }
+    if(w->alias_props) {
+        for(uint32_t alias = 1; alias <= config.mqtt_topic_aliases; alias++)
+            mosquitto_property_free_all(&w->alias_props[alias]);
+        free(w->alias_props);
+    }
+    spool_close(&w->spool);
+    tsdb_close(&w->tsdb);
+    sensor_cache_deinit(&w->sensors);
+    cfg_reader_unregister(&w->reader);
+    pthread_mutex_destroy(&w->trace_lock);
+}
+
+/* the publisher has stopped, so the workers are ours */
 bool mqtt_deinit(void) {
     DEBUG("Tearing down mosquitto");
-    mosquitto_loop_stop(mosq, true);
+
+    for(int idx = 0; idx < mqtt_worker_count; idx++)
+        mqtt_worker_deinit(&mqtt_workers[idx]);
+
+    free(mqtt_workers);
+    mqtt_workers = NULL;
+    mqtt_worker_count = 0;
+
     mosquitto_lib_cleanup();
     return true;
 }
 
-bool mqtt_dispatch(sensor_struct_t *pmsg) {
-    const char *sensor_name;
-    char *topic=NULL;
-    char *value=NULL;
-    int rc;
+/*
+ * Should this reading go out?  Not if it is the same as (or within
+ * the type's deadband of) the last value we published, unless the
+ * topic has been quiet for longer than max_silence.
+ */
+static bool mqtt_should_publish(mqtt_worker_t *w, sensor_topic_t *topic,
+                                uint64_t now_ns, int32_t fixed,
+                                int decimals) {
+    int32_t milli = mqtt_milli(fixed, decimals);
+    int32_t delta;
+
+    if(!w->cfg->publish_on_change || !topic->published)
+        return true;
+
+    if(w->cfg->max_silence &&
+       now_ns - topic->last_publish_ns >= w->cfg->max_silence * 1000000000ULL)
+        return true;
+
+    delta = milli - topic->last_value;
+    if(delta < 0)
+        delta = -delta;
+
+    if(delta == 0 || delta < w->cfg->deadband[topic->type])
+        return false;
+
+    return true;
+}
+
+static void mqtt_mark_published(sensor_topic_t *topic, int32_t fixed,
+                                int decimals, uint64_t now_ns) {
+    topic->published = true;
+    topic->last_value = mqtt_milli(fixed, decimals);
+    topic->last_publish_ns = now_ns;
+}
+
+/*
+ * A reading's payload, in the snapshot's payload_format.  The binary
+ * formats can carry the sensor struct as it came off the air, after
+ * the value, or in CBOR as [value, bytes].
+ */
+static size_t mqtt_payload(mqtt_worker_t *w, uint8_t *buf,
+                           const sensor_struct_t *pmsg, int32_t fixed,
+                           int decimals) {
+    bool raw = w->cfg->payload_raw;
+    size_t len = 0;
+
+    switch(w->cfg->payload_format) {
+    case PAYLOAD_BINARY:
+        len = format_binary(buf, fixed, decimals);
+        break;
+    case PAYLOAD_CBOR:
+        if(raw)
+            len = format_cbor_head(buf, FORMAT_CBOR_ARRAY, 2);
+        len += format_cbor(buf + len, fixed, decimals);
+        if(raw)
+            len += format_cbor_head(buf + len, FORMAT_CBOR_BYTES,
+                                    sizeof(sensor_struct_t));
+        break;
+    default:
+        return format_fixed((char *)buf, fixed, decimals);
+    }
+
+    if(raw) {
+        memcpy(buf + len, pmsg, sizeof(sensor_struct_t));
+        len += sizeof(sensor_struct_t);
+    }
+    return len;
+}
+
+bool mqtt_dispatch(mqtt_worker_t *w, packet_t *pkt) {
+    sensor_struct_t *pmsg = &pkt->msg;
+    sensor_entry_t *sensor;
+    sensor_topic_t *topic;
+    uint8_t payload[MQTT_PAYLOAD_MAX];
+    size_t len;
+    int32_t fixed;
+    int decimals;
+    bool batched;
 
     DEBUG("Got work item");
 
-    mqtt_dump_message(pmsg);
+    if(debug_enabled(DBG_DEBUG))
+        mqtt_dump_message(pmsg);
 
-    sensor_name = cfg_find_map(pmsg->addr);
+    sensor = sensor_cache_lookup(&w->sensors, pmsg->addr, pkt->pipe);
 
-    if(!sensor_name) {
-        WARN("Got message from unknown sensor: %s", sensor_name);
+    if(!sensor) {
+        metrics_inc(METRIC_UNKNOWN_ADDR);
+        WARN_LIMITED("Got message from unknown sensor: %02x%02x%02x%02x%02x "
+                     "(pipe %d)",
+                     pmsg->addr[0], pmsg->addr[1], pmsg->addr[2],
+                     pmsg->addr[3], pmsg->addr[4], pkt->pipe);
         return true;
     }
 
-    if(pmsg->type > (sizeof(mqtt_type_lookup) / sizeof(char*))) {
-        WARN("Unknown sensor type: %d from %s",
-             pmsg->type, sensor_name);
+    /* anything at all from it means it's still alive */
+    mqtt_liveness_seen(w, sensor, pkt->rx_ns);
+
+    if(pmsg->type >= (sizeof(mqtt_type_lookup) / sizeof(char*))) {
+        metrics_inc(METRIC_UNKNOWN_TYPE);
+        WARN_LIMITED("Unknown sensor type: %d from %s",
+             pmsg->type, sensor->name);
         return true;
     }
 
-    asprintf(&topic, "%s/%s%d", sensor_name,
-             mqtt_type_lookup[pmsg->type],
-             pmsg->type_instance);
+    if(!decode_reading(&sensor->map->plan, pmsg, &fixed, &decimals)) {
+        metrics_inc(METRIC_UNKNOWN_MODEL);
+        WARN_LIMITED("Unhandled %s model %d from %s",
+                     mqtt_type_lookup[pmsg->type], pmsg->model, sensor->name);
+        return true;
+    }
 
-    switch(pmsg->type) {
-    case SENSOR_TYPE_RO_SWITCH:
-    case SENSOR_TYPE_RW_SWITCH:
-    case SENSOR_TYPE_LIGHT:
-    case SENSOR_TYPE_MOTION:
-        asprintf(&value, "%d", pmsg->value.uint8_value);
-        break;
-    case SENSOR_TYPE_VOLTAGE:
-        if (pmsg->model == VOLT_MODEL_8B_2X33VREF)
-            asprintf(&value, "%1.2f", 6.6 * pmsg->value.uint8_value / 255);
-        if (pmsg->model == VOLT_MODEL_16B_2X33VREF)
-            asprintf(&value, "%1.3f", 6.6 * pmsg->value.uint16_value / 65535);
-        break;
-    case SENSOR_TYPE_TEMP:
-        if (pmsg->model == TEMP_MODEL_DHT11) {
-            float t_float = (pmsg->value.uint16_value >> 8) * 1.8 + 32.0;
+    topic = sensor_cache_topic(sensor, pmsg->type, pmsg->type_instance,
+                               mqtt_type_lookup[pmsg->type]);
+    if(!topic)
+        return false;
 
-            asprintf(&value, "%02.1f", t_float);
-        } else if (pmsg->model == TEMP_MODEL_DHT22) {
-            float t_float=0.0;
+    if(w->cfg->aggregate_count &&
+       !mqtt_aggregate_add(w, topic, fixed, decimals, pkt->rx_ns))
+        return false;
 
-            if(pmsg->value.uint16_value & 0x8000) {
-                t_float = -(pmsg->value.uint16_value & 0x7fff);
-            } else {
-                t_float = pmsg->value.uint16_value;
-            }
+    if(tsdb_enabled(&w->tsdb) &&
+       !mqtt_history_add(w, topic, fixed, decimals, pkt->rx_ns))
+        return false;
 
-            t_float = (t_float / 10.0) * 1.8 + 32.0;
+    if(!w->cfg->publish_raw)
+        return true;
 
-            asprintf(&value, "%02.1f", t_float);
-        } else {
-            ERROR("Unhandled temp model: %d", pmsg->model);
-        }
-        break;
-    case SENSOR_TYPE_HUMIDITY:
-        if (pmsg->model == TEMP_MODEL_DHT11) {
-            asprintf(&value, "%0d.%01d", (pmsg->value.uint16_value >> 8),
-                     pmsg->value.uint16_value & 0xFF00);
-        } else if (pmsg->model == TEMP_MODEL_DHT22) {
-            asprintf(&value, "%0.1f", pmsg->value.uint16_value / 10.0);
-        } else {
-            ERROR("Unhandled temp model: %d", pmsg->model);
-        }
-        break;
-    default:
-        ERROR("Unhandled sensor type: %d", pmsg->type);
-        free(topic);
+    if(!mqtt_should_publish(w, topic, pkt->rx_ns, fixed, decimals)) {
+        metrics_inc(METRIC_UNCHANGED);
         return true;
     }
 
-    /* send the message */
-    if(value) {
-        DEBUG("Sending message %s -> %s", topic, value);
+    if(w->cfg->publish_mode & PUBLISH_JSON) {
+        batched = mqtt_batch_add(w, sensor, topic, fixed, decimals,
+                                 pkt->rx_ns);
 
-        rc = mosquitto_publish(mosq, NULL, topic, strlen(value), value, 0, true);
-        if (rc != MOSQ_ERR_SUCCESS)
-            ERROR("Got mosquitto error: %d", rc);
-    } else {
-        WARN("Unhandled message");
+        /* a reading that never made the batch isn't published */
+        if(!(w->cfg->publish_mode & PUBLISH_TOPIC)) {
+            if(!batched)
+                return false;
+            mqtt_mark_published(topic, fixed, decimals, pkt->rx_ns);
+            return true;
+        }
     }
 
-    if(topic)
-        free(topic);
+    len = mqtt_payload(w, payload, pmsg, fixed, decimals);
 
-    if(value)
-        free(value);
+    /* send the message */
+    if(w->cfg->payload_format == PAYLOAD_TEXT)
+        DEBUG("Sending message %s -> %s", topic->topic, (char *)payload);
+    else
+        DEBUG("Sending message %s -> %d bytes", topic->topic, (int)len);
+
+    if(!mqtt_send(w, topic->topic, topic, len, payload, pkt->rx_ns, 1, true))
+        return true;
 
+    mqtt_mark_published(topic, fixed, decimals, pkt->rx_ns);
     return true;
 }
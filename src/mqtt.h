@@ -19,11 +19,43 @@
 #define _MQTT_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "nrf24-mqtt.h"
 #include "sensor.h"
 
-extern bool mqtt_init(void);
+#define MQTT_TYPE_COUNT 7
+
+extern char *mqtt_type_lookup[];
+
+/*
+ * A publisher worker: its own broker connection, sensor cache and
+ * spool.  Each is driven by one publisher thread.
+ */
+typedef struct mqtt_worker_t mqtt_worker_t;
+
+typedef struct mqtt_worker_stats_t {
+    bool connected;
+    uint64_t published;      /* readings accepted by mosquitto */
+    uint64_t errors;         /* publishes that failed, or couldn't spool */
+    uint64_t spooled;        /* waiting in the spool */
+} mqtt_worker_stats_t;
+
+extern bool mqtt_init(int workers);
 extern bool mqtt_deinit(void);
-extern bool mqtt_dispatch(sensor_struct_t *msg);
+extern bool mqtt_dispatch(mqtt_worker_t *w, packet_t *pkt);
+extern void mqtt_tick(mqtt_worker_t *w, uint64_t now_ns);
+extern void mqtt_dump_message(sensor_struct_t *msg);
+
+extern int mqtt_worker_route(const uint8_t *addr);
+extern mqtt_worker_t *mqtt_worker_get(int index);
+extern void mqtt_worker_get_stats(mqtt_worker_t *w,
+                                  mqtt_worker_stats_t *stats);
+
+/* event loop mode */
+extern int mqtt_socket(mqtt_worker_t *w);
+extern bool mqtt_want_write(mqtt_worker_t *w);
+extern void mqtt_loop_read(mqtt_worker_t *w);
+extern void mqtt_loop_write(mqtt_worker_t *w);
+extern void mqtt_loop_misc(mqtt_worker_t *w, uint64_t now_ns);
 
 #endif /* _MQTT_H_ */
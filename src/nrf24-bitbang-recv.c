@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <gpio.h>
 #include <rf24.h>
@@ -30,90 +31,303 @@
 #include "debug.h"
 #include "sensor.h"
 #include "cfg.h"
-#include "mqtt.h"
+#include "nrf24-recv.h"
+#include "metrics.h"
 
-static rf24_t radio;
-static pthread_t nrf24_recv_tid;
+#define BITBANG_FIFO_DEPTH 3    /* payloads the chip can hold */
+#define BITBANG_DRAIN_MAX  16   /* most payloads read per IRQ */
+#define BITBANG_TX_DELAY   1    /* auto retransmit delay, 500us */
+#define BITBANG_TX_WAIT_NS 20000000ULL  /* longest wait for ack or retries */
 
-static void nrf24_recv_dispatch(void *data) {
+typedef struct bitbang_radio_t {
+    rf24_t rf24;
+    pthread_t tid;
+    pthread_mutex_t lock;       /* the chip: IRQ thread against downlink */
+    uint64_t deep_drains;
+} bitbang_radio_t;
+
+/* rf24_irq_poll doesn't give us a context, so each IRQ thread keeps its own */
+static __thread nrf24_radio_t *bitbang_current;
+
+static uint64_t bitbang_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * The old way: one payload per IRQ, then bounce the radio out of and
+ * back into RX.  Anything arriving meanwhile is lost.
+ */
+static void nrf24_recv_single(nrf24_radio_t *nrf24, rf24_t *radio,
+                              uint64_t rx_ns) {
+    uint8_t pipe = radio->status.rx_data_pipe;
     uint8_t len;
     char buf[32];
 
-    rf24_sync_status(&radio);
+    len = radio->status.rx_data_len;
+    DEBUG("Got %d bytes of data", len);
 
-    DEBUG("IRQ on pin %d. TX ok: %d, TX fail: %d RX ready: %d RX_LEN: %d PIPE: %d\n",
-          radio.irq_pin,
-          radio.status.tx_ok,
-          radio.status.tx_fail_retries,
-          radio.status.rx_data_available,
-          radio.status.rx_data_len,
-          radio.status.rx_data_pipe);
-
-    if(radio.status.rx_data_available) {
-        len = radio.status.rx_data_len;
-        DEBUG("Got %d bytes of data", len);
-
-        rf24_receive(&radio, &buf, len);
-        usleep(20);
-        rf24_reset_status(&radio);
+    rf24_receive(radio, &buf, len);
+    usleep(20);
+    rf24_reset_status(radio);
 
-        /* push the packet to mqtt */
-        mqtt_dispatch((sensor_struct_t *)&buf);
+    /* hand the packet off to the publisher thread */
+    nrf24_recv_submit(nrf24, (sensor_struct_t *)&buf, &pipe, 1, rx_ns);
 
-        rf24_stop_listening(&radio);
-        usleep(20);
-        rf24_start_listening(&radio);
+    rf24_stop_listening(radio);
+    usleep(20);
+    rf24_start_listening(radio);
+}
+
+/*
+ * Read payloads until the RX FIFO is empty, staying in RX the whole
+ * time, and hand them over as one burst.  Three or more in one go
+ * is counted as a deep drain: the FIFO may have been full, with
+ * anything else sent meanwhile dropped by the chip, or packets may
+ * just have kept arriving while we read.  The library doesn't give
+ * us FIFO_STATUS, so we can't tell which.
+ */
+static void nrf24_recv_drain(nrf24_radio_t *nrf24, rf24_t *radio,
+                             uint64_t rx_ns) {
+    bitbang_radio_t *bitbang = (bitbang_radio_t *)nrf24->priv;
+    sensor_struct_t msgs[BITBANG_DRAIN_MAX];
+    uint8_t pipes[BITBANG_DRAIN_MAX];
+    char buf[32];
+    int count = 0;
+
+    do {
+        while(radio->status.rx_data_available && count < BITBANG_DRAIN_MAX) {
+            pipes[count] = radio->status.rx_data_pipe;
+            rf24_receive(radio, &buf, radio->status.rx_data_len);
+            memcpy(&msgs[count++], buf, sizeof(sensor_struct_t));
+            rf24_sync_status(radio);
+        }
+
+        /* clear RX_DR, then look again in case one raced the clear */
+        rf24_reset_status(radio);
+        rf24_sync_status(radio);
+    } while(radio->status.rx_data_available && count < BITBANG_DRAIN_MAX);
+
+    DEBUG("Drained %d payloads", count);
+
+    if(count >= BITBANG_FIFO_DEPTH) {
+        __atomic_store_n(&bitbang->deep_drains, bitbang->deep_drains + 1,
+                         __ATOMIC_RELAXED);
+        metrics_inc(METRIC_DEEP_DRAINS);
+    }
+
+    if(count)
+        nrf24_recv_submit(nrf24, msgs, pipes, count, rx_ns);
+}
+
+static void nrf24_recv_dispatch(void *data) {
+    nrf24_radio_t *nrf24 = bitbang_current;
+    bitbang_radio_t *bitbang = (bitbang_radio_t *)nrf24->priv;
+    rf24_t *radio = &bitbang->rf24;
+    uint64_t rx_ns;
+
+    /* the packets' receive time, so waiting out a downlink counts too */
+    rx_ns = bitbang_now_ns();
+
+    pthread_mutex_lock(&bitbang->lock);
+    rf24_sync_status(radio);
+
+    DEBUG("IRQ on pin %d. TX ok: %d, TX fail: %d RX ready: %d RX_LEN: %d PIPE: %d\n",
+          radio->irq_pin,
+          radio->status.tx_ok,
+          radio->status.tx_fail_retries,
+          radio->status.rx_data_available,
+          radio->status.rx_data_len,
+          radio->status.rx_data_pipe);
+
+    if(radio->status.rx_data_available) {
+        if(nrf24->cfg->burst_drain)
+            nrf24_recv_drain(nrf24, radio, rx_ns);
+        else
+            nrf24_recv_single(nrf24, radio, rx_ns);
     } else {
         DEBUG("IRQ with no data read.  Resetting");
-        rf24_stop_listening(&radio);
-        rf24_reset_status(&radio);
+        rf24_stop_listening(radio);
+        rf24_reset_status(radio);
         usleep(20);
-        rf24_start_listening(&radio);
+        rf24_start_listening(radio);
     }
 
+    pthread_mutex_unlock(&bitbang->lock);
     DEBUG("Dispatch complete");
 }
 
 static void *nrf24_recv_thread(void *data) {
+    nrf24_radio_t *nrf24 = (nrf24_radio_t *)data;
+    bitbang_radio_t *bitbang = (bitbang_radio_t *)nrf24->priv;
     int result;
 
     DEBUG("nrf24 recv thread started");
 
-    result = rf24_irq_poll(&radio, &nrf24_recv_dispatch);
+    nrf24_recv_thread_setup(nrf24);
+    bitbang_current = nrf24;
+
+    result = rf24_irq_poll(&bitbang->rf24, &nrf24_recv_dispatch);
+    if(__atomic_load_n(&nrf24->quit, __ATOMIC_ACQUIRE))
+        return NULL;
+
     if(result == -1) {
-        ERROR("nrf24 irq polling error: %s", strerror(errno));
+        ERROR_LIMITED("nrf24 irq polling error: %s", strerror(errno));
     }
     exit(EXIT_FAILURE);
 }
 
-bool nrf24_recv_init(void) {
-    uint64_t address;
+static uint64_t bitbang_address(const uint8_t *addr) {
+    uint64_t address = 0;
+    int pos;
 
-    address = config.listen_address[0];
-    address = (address << 8) | config.listen_address[1];
-    address = (address << 8) | config.listen_address[2];
-    address = (address << 8) | config.listen_address[3];
-    address = (address << 8) | config.listen_address[4];
+    for(pos = 0; pos < 5; pos++)
+        address = (address << 8) | addr[pos];
+    return address;
+}
 
-    DEBUG("Initializing nRF24 receiver");
+static bool nrf24_bitbang_init(nrf24_radio_t *nrf24) {
+    const radio_cfg_t *cfg = nrf24->cfg;
+    bitbang_radio_t *bitbang;
+    int pipe;
 
-    rf24_initialize(&radio, RF24_SPI_DEV_0, 25, 24);
-    rf24_set_retries(&radio, 0, 0);
-    rf24_set_autoack(&radio, 0);
-    rf24_set_data_rate(&radio, RF24_1MBPS);
-    rf24_set_payload_size(&radio, sizeof(sensor_struct_t));
-    rf24_open_reading_pipe(&radio, 0, address);
+    if(!cfg->pipe_count) {
+        ERROR("No listen_address configured for %s", cfg->name);
+        return false;
+    }
 
-    rf24_dump(&radio);
-    rf24_start_listening(&radio);
+    /* spidev0.0 or spidev0.1 */
+    if(cfg->device < 0 || cfg->device > 1) {
+        ERROR("Invalid SPI device for %s: %d (0-1)", cfg->name, cfg->device);
+        return false;
+    }
+
+    bitbang = (bitbang_radio_t *)calloc(1, sizeof(bitbang_radio_t));
+    if(!bitbang) {
+        ERROR("Malloc error");
+        return false;
+    }
+    nrf24->priv = bitbang;
+    pthread_mutex_init(&bitbang->lock, NULL);
+
+    DEBUG("Initializing nRF24 receiver %s on spidev0.%d, pins %d/%d",
+          cfg->name, cfg->device, cfg->ce_pin, cfg->irq_pin);
+
+    rf24_initialize(&bitbang->rf24,
+                    cfg->device ? RF24_SPI_DEV_1 : RF24_SPI_DEV_0,
+                    cfg->ce_pin, cfg->irq_pin);
+    rf24_set_channel(&bitbang->rf24, cfg->channel);
+    rf24_set_retries(&bitbang->rf24, 0, 0);
+    rf24_set_autoack(&bitbang->rf24, 0);
+    rf24_set_data_rate(&bitbang->rf24, RF24_1MBPS);
+    rf24_set_payload_size(&bitbang->rf24, sizeof(sensor_struct_t));
 
-    pthread_create(&nrf24_recv_tid, NULL, nrf24_recv_thread, NULL);
+    for(pipe = 0; pipe < cfg->pipe_count; pipe++)
+        rf24_open_reading_pipe(&bitbang->rf24, pipe,
+                               bitbang_address(cfg->listen_addresses[pipe]));
+
+    rf24_dump(&bitbang->rf24);
     return true;
 }
 
-bool nrf24_recv_deinit(void) {
-    DEBUG("Tearing down nRF receiver");
-    gpio_unexport(radio.irq_pin);
-    pthread_join(nrf24_recv_tid, NULL);
+static bool nrf24_bitbang_start(nrf24_radio_t *nrf24) {
+    bitbang_radio_t *bitbang = (bitbang_radio_t *)nrf24->priv;
+
+    rf24_start_listening(&bitbang->rf24);
+
+    if(pthread_create(&bitbang->tid, NULL, nrf24_recv_thread, nrf24)) {
+        ERROR("Cannot start nrf24 recv thread");
+        return false;
+    }
+
     return true;
 }
+
+static void nrf24_bitbang_stop(nrf24_radio_t *nrf24) {
+    bitbang_radio_t *bitbang = (bitbang_radio_t *)nrf24->priv;
+
+    if(!bitbang)
+        return;
+
+    DEBUG("Tearing down nRF receiver");
+    gpio_unexport(bitbang->rf24.irq_pin);
+    if(bitbang->tid)
+        pthread_join(bitbang->tid, NULL);
+
+    pthread_mutex_destroy(&bitbang->lock);
+    free(bitbang);
+    nrf24->priv = NULL;
+}
+
+static void nrf24_bitbang_stats(nrf24_radio_t *nrf24, nrf24_recv_stats_t *stats) {
+    bitbang_radio_t *bitbang = (bitbang_radio_t *)nrf24->priv;
+
+    if(bitbang)
+        stats->deep_drains = __atomic_load_n(&bitbang->deep_drains,
+                                             __ATOMIC_RELAXED);
+}
+
+/*
+ * Downlink: out of RX once for the whole burst.  Each payload goes
+ * to its sensor's address with auto-ack on, and we wait for the ack,
+ * or for the retries to run out, before sending the next.  The ack
+ * comes back on pipe 0, which has to listen on the TX address
+ * meanwhile, so it gets its own address back afterwards.  The IRQ
+ * thread waits on the lock, and finds nothing to read.
+ */
+static int nrf24_bitbang_send_burst(nrf24_radio_t *nrf24,
+                                    const sensor_struct_t *msgs, int count,
+                                    uint64_t *ack_ns) {
+    bitbang_radio_t *bitbang = (bitbang_radio_t *)nrf24->priv;
+    rf24_t *radio = &bitbang->rf24;
+    sensor_struct_t msg;
+    uint64_t start_ns;
+    int acked = 0;
+    int idx;
+
+    pthread_mutex_lock(&bitbang->lock);
+
+    rf24_stop_listening(radio);
+    rf24_set_autoack(radio, 1);
+    rf24_set_retries(radio, BITBANG_TX_DELAY, config.downlink_retries);
+
+    for(idx = 0; idx < count; idx++) {
+        memcpy(&msg, &msgs[idx], sizeof(msg));
+        rf24_open_writing_pipe(radio, bitbang_address(msg.addr));
+
+        start_ns = bitbang_now_ns();
+        rf24_send(radio, &msg, sizeof(msg));
+        do {
+            rf24_sync_status(radio);
+        } while(!radio->status.tx_ok && !radio->status.tx_fail_retries &&
+                bitbang_now_ns() - start_ns < BITBANG_TX_WAIT_NS);
+
+        ack_ns[idx] = 0;
+        if(radio->status.tx_ok) {
+            ack_ns[idx] = bitbang_now_ns() - start_ns;
+            acked++;
+        }
+        rf24_reset_status(radio);
+    }
+
+    rf24_set_autoack(radio, 0);
+    rf24_set_retries(radio, 0, 0);
+    rf24_open_reading_pipe(radio, 0,
+                           bitbang_address(nrf24->cfg->listen_addresses[0]));
+    rf24_start_listening(radio);
+
+    pthread_mutex_unlock(&bitbang->lock);
+    return acked;
+}
+
+const nrf24_backend_t nrf24_bitbang_backend = {
+    .name = "bitbang",
+    .init = nrf24_bitbang_init,
+    .start = nrf24_bitbang_start,
+    .read_burst = NULL,
+    .stop = nrf24_bitbang_stop,
+    .stats = nrf24_bitbang_stats,
+    .send_burst = nrf24_bitbang_send_burst
+};
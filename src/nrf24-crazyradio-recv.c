@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <crazyradio.h>
 
@@ -29,69 +30,171 @@
 #include "debug.h"
 #include "sensor.h"
 #include "cfg.h"
-#include "mqtt.h"
+#include "nrf24-recv.h"
 
-static cradio_device_t *radio;
-static pthread_t nrf24_recv_tid;
-static int radio_quit = 0;
+typedef struct crazyradio_t {
+    cradio_device_t *dev;
+    cradio_address address;     /* listen address, restored after TX */
+    pthread_mutex_t lock;       /* the dongle: receive thread and downlink */
+} crazyradio_t;
+
+static bool nrf24_crazyradio_ready = false;
 
 static void nrf24_crazy_log(int level, char *format, va_list args) {
     debug_vprintf(level, format, args);
     debug_printf(level, "\n");
 }
 
-static void *nrf24_recv_thread(void *data) {
-    int result;
+static int nrf24_crazyradio_read_burst(nrf24_radio_t *nrf24,
+                                       sensor_struct_t *msgs,
+                                       uint8_t *pipes, int max) {
+    crazyradio_t *radio = (crazyradio_t *)nrf24->priv;
     unsigned char buffer[64];
+    int result;
 
-    DEBUG("nrf24 recv thread started");
-
-    while(!radio_quit) {
-        memset(buffer, 0x0, sizeof(buffer));
-
-        result = cradio_read_packet(radio, buffer, sizeof(buffer)-1, 1);
-        if(result > 0) {
-            DEBUG("Got %d bytes of data", result);
-            mqtt_dispatch((sensor_struct_t *)&buffer);
-        } else if (result < 0) {
-            /* error... */
-            ERROR("Error: %s", cradio_get_errorstr());
-            exit(EXIT_FAILURE);
-        }
+    memset(buffer, 0x0, sizeof(buffer));
+
+    pthread_mutex_lock(&radio->lock);
+    result = cradio_read_packet(radio->dev, buffer, sizeof(buffer)-1, 1);
+    pthread_mutex_unlock(&radio->lock);
+    if(result > 0) {
+        memcpy(&msgs[0], buffer, sizeof(sensor_struct_t));
+        return 1;
+    } else if (result < 0) {
+        /* error... */
+        ERROR("Error: %s", cradio_get_errorstr());
+        return -1;
     }
-    return NULL;
+
+    return 0;
 }
 
-bool nrf24_recv_init(void) {
+static bool nrf24_crazyradio_init(nrf24_radio_t *nrf24) {
+    const radio_cfg_t *cfg = nrf24->cfg;
+    cradio_device_t *dev;
+    crazyradio_t *radio;
     cradio_address address;
 
-    memcpy(address, config.listen_address, sizeof(cradio_address));
+    if(!cfg->pipe_count) {
+        ERROR("No listen_address configured for %s", cfg->name);
+        return false;
+    }
 
-    DEBUG("Initializing nRF24 receiver");
+    /* the dongle only listens on one address */
+    if(cfg->pipe_count > 1)
+        WARN("%s: crazyradio only listens on pipe 0, ignoring %d "
+             "other addresses", cfg->name, cfg->pipe_count - 1);
 
-    cradio_set_log_method(nrf24_crazy_log);
-    cradio_init();
-    radio = cradio_get(0);
+    memcpy(address, cfg->listen_addresses[0], sizeof(cradio_address));
 
-    if(!radio) {
+    DEBUG("Initializing crazyradio %d as %s", cfg->device, cfg->name);
+
+    /* radios are initialized one at a time, from the main thread */
+    if(!nrf24_crazyradio_ready) {
+        cradio_set_log_method(nrf24_crazy_log);
+        cradio_init();
+        nrf24_crazyradio_ready = true;
+    }
+    dev = cradio_get(cfg->device);
+
+    if(!dev) {
         ERROR("could not open device: %s", cradio_get_errorstr());
         return false;
     }
 
-    if(cradio_set_address(radio, &address) ||
-       cradio_set_data_rate(radio, DATA_RATE_1MBPS) ||
-       cradio_set_channel(radio, 0x4c)) {
+    if(cradio_set_address(dev, &address) ||
+       cradio_set_data_rate(dev, DATA_RATE_1MBPS) ||
+       cradio_set_channel(dev, cfg->channel)) {
         ERROR("error setting up radio: %s", cradio_get_errorstr());
         return false;
     }
 
-    pthread_create(&nrf24_recv_tid, NULL, nrf24_recv_thread, NULL);
+    radio = (crazyradio_t *)calloc(1, sizeof(crazyradio_t));
+    if(!radio) {
+        ERROR("Malloc error");
+        return false;
+    }
+
+    radio->dev = dev;
+    memcpy(radio->address, address, sizeof(cradio_address));
+    pthread_mutex_init(&radio->lock, NULL);
+    nrf24->priv = radio;
     return true;
 }
 
-bool nrf24_recv_deinit(void) {
+static void nrf24_crazyradio_stop(nrf24_radio_t *nrf24) {
+    crazyradio_t *radio = (crazyradio_t *)nrf24->priv;
+
     DEBUG("Tearing down crazyradio receiver");
-    radio_quit = 1;
-    pthread_join(nrf24_recv_tid, NULL);
-    return true;
+
+    if(radio) {
+        pthread_mutex_destroy(&radio->lock);
+        free(radio);
+        nrf24->priv = NULL;
+    }
+}
+
+static uint64_t crazyradio_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Downlink: the dongle sends and waits out its own retries in one
+ * USB round trip, and the first byte back has the ack in bit 0.  It
+ * listens on the target address meanwhile, so it gets its own back
+ * after the burst.
+ */
+static int nrf24_crazyradio_send_burst(nrf24_radio_t *nrf24,
+                                       const sensor_struct_t *msgs,
+                                       int count, uint64_t *ack_ns) {
+    crazyradio_t *radio = (crazyradio_t *)nrf24->priv;
+    unsigned char buffer[sizeof(sensor_struct_t)];
+    unsigned char ack[33];
+    cradio_address address;
+    uint64_t start_ns;
+    int acked = 0;
+    int result;
+    int idx;
+
+    pthread_mutex_lock(&radio->lock);
+
+    for(idx = 0; idx < count; idx++) {
+        ack_ns[idx] = 0;
+
+        memcpy(address, msgs[idx].addr, sizeof(cradio_address));
+        if(cradio_set_address(radio->dev, &address)) {
+            ERROR_LIMITED("Cannot set crazyradio address: %s",
+                          cradio_get_errorstr());
+            continue;
+        }
+
+        memcpy(buffer, &msgs[idx], sizeof(buffer));
+        start_ns = crazyradio_now_ns();
+        result = cradio_write_packet(radio->dev, buffer, sizeof(buffer),
+                                     ack, sizeof(ack));
+        if(result > 0 && (ack[0] & 1)) {
+            ack_ns[idx] = crazyradio_now_ns() - start_ns;
+            acked++;
+        }
+    }
+
+    if(cradio_set_address(radio->dev, &radio->address))
+        ERROR("Cannot restore crazyradio address: %s",
+              cradio_get_errorstr());
+
+    pthread_mutex_unlock(&radio->lock);
+    return acked;
 }
+
+const nrf24_backend_t nrf24_crazyradio_backend = {
+    .name = "crazyradio",
+    .init = nrf24_crazyradio_init,
+    .start = NULL,
+    .read_burst = nrf24_crazyradio_read_burst,
+    .stop = nrf24_crazyradio_stop,
+    .stats = NULL,
+    .send_burst = nrf24_crazyradio_send_burst
+};
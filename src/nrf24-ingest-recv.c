@@ -0,0 +1,298 @@
+/*
+ * nrf24-ingest-recv.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Datagram ingest "radio".  Remote gateways (or load generators)
+ * send datagrams of back-to-back packed sensor_struct_t records to a
+ * UDP or unix datagram socket, and we feed them into the publisher
+ * like any other radio.  Datagrams are pulled in batches with
+ * recvmmsg, so one syscall can carry thousands of packets.
+ *
+ *   ingest_socket = "udp:0.0.0.0:7524";
+ *   ingest_socket = "unix:/run/nrf24-mqtt.sock";
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "nrf24-mqtt.h"
+#include "debug.h"
+#include "sensor.h"
+#include "cfg.h"
+#include "nrf24-recv.h"
+
+#define INGEST_BATCH     64
+#define INGEST_DGRAM_MAX 1500
+#define INGEST_RCVBUF    (4 * 1024 * 1024)
+
+typedef struct ingest_state_t {
+    int fd;
+    char *unix_path;
+
+    /* datagrams from the last recvmmsg not yet handed out */
+    int received;
+    int next_dgram;
+    int next_offset;
+
+    uint64_t bad_datagrams;
+    uint64_t errors;
+
+    struct mmsghdr msgs[INGEST_BATCH];
+    struct iovec iovecs[INGEST_BATCH];
+    uint8_t buffers[INGEST_BATCH][INGEST_DGRAM_MAX];
+} ingest_state_t;
+
+static int ingest_open_udp(const char *spec) {
+    struct addrinfo hints, *res, *ai;
+    char *host, *port;
+    int fd = -1;
+    int rc;
+
+    host = strdup(spec);
+    if(!host) {
+        ERROR("Malloc error");
+        return -1;
+    }
+
+    port = strrchr(host, ':');
+    if(!port) {
+        ERROR("Bad ingest address (want host:port): %s", spec);
+        free(host);
+        return -1;
+    }
+    *port++ = '\0';
+
+    if(host[0] == '[' && host[strlen(host) - 1] == ']') {
+        host[strlen(host) - 1] = '\0';
+        memmove(host, host + 1, strlen(host));
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    rc = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+    if(rc) {
+        ERROR("Cannot resolve ingest address %s: %s", spec, gai_strerror(rc));
+        free(host);
+        return -1;
+    }
+
+    for(ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd == -1)
+            continue;
+        if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+
+    if(fd == -1)
+        ERROR("Cannot bind ingest socket %s: %s", spec, strerror(errno));
+
+    freeaddrinfo(res);
+    free(host);
+    return fd;
+}
+
+static int ingest_open_unix(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        ERROR("Ingest socket path too long: %s", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if(fd == -1) {
+        ERROR("Cannot create ingest socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    unlink(path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        ERROR("Cannot bind ingest socket %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool nrf24_ingest_init(nrf24_radio_t *nrf24) {
+    ingest_state_t *state;
+    struct timeval tv;
+    int rcvbuf = INGEST_RCVBUF;
+    const char *spec = nrf24->cfg->ingest_socket;
+    int pos;
+
+    if(!spec) {
+        ERROR("No ingest_socket configured");
+        return false;
+    }
+
+    state = (ingest_state_t *)calloc(1, sizeof(ingest_state_t));
+    if(!state) {
+        ERROR("Malloc error");
+        return false;
+    }
+
+    if(!strncmp(spec, "udp:", 4)) {
+        state->fd = ingest_open_udp(spec + 4);
+    } else if(!strncmp(spec, "unix:", 5)) {
+        state->fd = ingest_open_unix(spec + 5);
+        state->unix_path = strdup(spec + 5);
+    } else {
+        ERROR("Bad ingest_socket (want udp: or unix:): %s", spec);
+        state->fd = -1;
+    }
+
+    if(state->fd == -1) {
+        free(state->unix_path);
+        free(state);
+        return false;
+    }
+
+    /* bursts from many gateways at once shouldn't overflow the socket */
+    setsockopt(state->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    /* wake up now and then so deinit can stop us */
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    setsockopt(state->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    for(pos = 0; pos < INGEST_BATCH; pos++) {
+        state->iovecs[pos].iov_base = state->buffers[pos];
+        state->iovecs[pos].iov_len = INGEST_DGRAM_MAX;
+        state->msgs[pos].msg_hdr.msg_iov = &state->iovecs[pos];
+        state->msgs[pos].msg_hdr.msg_iovlen = 1;
+    }
+
+    INFO("Listening for sensor datagrams on %s", spec);
+
+    nrf24->priv = state;
+    return true;
+}
+
+static int nrf24_ingest_read_burst(nrf24_radio_t *nrf24, sensor_struct_t *msgs,
+                                   uint8_t *pipes, int max) {
+    ingest_state_t *state = (ingest_state_t *)nrf24->priv;
+    int count = 0;
+    int pos;
+
+    if(state->next_dgram >= state->received) {
+        state->received = recvmmsg(state->fd, state->msgs, INGEST_BATCH,
+                                   MSG_WAITFORONE, NULL);
+        state->next_dgram = 0;
+        state->next_offset = 0;
+
+        if(state->received <= 0) {
+            state->received = 0;
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                ERROR_LIMITED("Ingest receive error: %s", strerror(errno));
+                __atomic_add_fetch(&state->errors, 1, __ATOMIC_RELAXED);
+            }
+            return 0;
+        }
+
+        /*
+         * A datagram that was cut short or isn't whole records is
+         * misframed, so none of it is trusted: skip all of it.
+         */
+        for(pos = 0; pos < state->received; pos++) {
+            if(state->msgs[pos].msg_len % sizeof(sensor_struct_t) ||
+               (state->msgs[pos].msg_hdr.msg_flags & MSG_TRUNC)) {
+                WARN_LIMITED("Ignoring a malformed %u byte datagram",
+                             state->msgs[pos].msg_len);
+                __atomic_add_fetch(&state->bad_datagrams, 1, __ATOMIC_RELAXED);
+                state->msgs[pos].msg_len = 0;
+            }
+        }
+    }
+
+    /* anything that didn't fit this time is picked up on the next call */
+    while(count < max && state->next_dgram < state->received) {
+        struct mmsghdr *msg = &state->msgs[state->next_dgram];
+        uint8_t *buf = state->buffers[state->next_dgram];
+
+        if(state->next_offset + sizeof(sensor_struct_t) > msg->msg_len) {
+            state->next_dgram++;
+            state->next_offset = 0;
+            continue;
+        }
+
+        memcpy(&msgs[count++], buf + state->next_offset,
+               sizeof(sensor_struct_t));
+        state->next_offset += sizeof(sensor_struct_t);
+    }
+
+    return count;
+}
+
+static void nrf24_ingest_stop(nrf24_radio_t *nrf24) {
+    ingest_state_t *state = (ingest_state_t *)nrf24->priv;
+
+    DEBUG("Tearing down ingest receiver");
+
+    if(!state)
+        return;
+
+    close(state->fd);
+    if(state->unix_path) {
+        unlink(state->unix_path);
+        free(state->unix_path);
+    }
+
+    free(state);
+    nrf24->priv = NULL;
+}
+
+static void nrf24_ingest_stats(nrf24_radio_t *nrf24, nrf24_recv_stats_t *stats) {
+    ingest_state_t *state = (ingest_state_t *)nrf24->priv;
+
+    if(!state)
+        return;
+
+    /* malformed datagrams count as errors */
+    stats->errors += __atomic_load_n(&state->errors, __ATOMIC_RELAXED) +
+        __atomic_load_n(&state->bad_datagrams, __ATOMIC_RELAXED);
+}
+
+const nrf24_backend_t nrf24_ingest_backend = {
+    .name = "ingest",
+    .init = nrf24_ingest_init,
+    .start = NULL,
+    .read_burst = nrf24_ingest_read_burst,
+    .stop = nrf24_ingest_stop,
+    .stats = nrf24_ingest_stats
+};
@@ -20,14 +20,28 @@
 
 #include <stdint.h>
 #include "sensor.h"
+#include "decode.h"
 
 #define TRUE 1
 #define FALSE 0
 
+#define NRF24_PIPES 6
+
 typedef struct addr_map_t {
     uint8_t *addr;
+    uint8_t prefix_len;      /* 5 for an exact address, less for wildcards */
+    int8_t pipe;             /* only heard on this pipe, or -1 for any */
     char *sensor_name;
+    decode_plan_t plan;      /* units and calibration for this sensor */
+    uint32_t offline_after;  /* seconds of silence till offline, 0 untracked */
     struct addr_map_t *next;
 } addr_map_t;
 
+/* a received sensor packet, stamped (CLOCK_MONOTONIC) on arrival */
+typedef struct packet_t {
+    uint64_t rx_ns;
+    uint8_t pipe;            /* nRF24 pipe it arrived on, 0 if n/a */
+    sensor_struct_t msg;
+} packet_t;
+
 #endif /* _NRF24_MQTT_H_ */
@@ -0,0 +1,325 @@
+/*
+ * nrf24-recv.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "nrf24-mqtt.h"
+#include "debug.h"
+#include "cfg.h"
+#include "publisher.h"
+#include "capture.h"
+#include "metrics.h"
+#include "nrf24-recv.h"
+
+#ifdef HAVE_BITBANG
+extern const nrf24_backend_t nrf24_bitbang_backend;
+#endif
+#ifdef HAVE_CRAZYRADIO
+extern const nrf24_backend_t nrf24_crazyradio_backend;
+#endif
+extern const nrf24_backend_t nrf24_replay_backend;
+extern const nrf24_backend_t nrf24_ingest_backend;
+
+/* first one is the default */
+static const nrf24_backend_t *nrf24_backends[] = {
+#ifdef HAVE_BITBANG
+    &nrf24_bitbang_backend,
+#endif
+#ifdef HAVE_CRAZYRADIO
+    &nrf24_crazyradio_backend,
+#endif
+    &nrf24_ingest_backend,
+    &nrf24_replay_backend,
+    NULL
+};
+
+static nrf24_radio_t *nrf24_radios = NULL;
+static int nrf24_radio_count = 0;
+static nrf24_radio_t *nrf24_tx_radio = NULL;
+
+static const nrf24_backend_t *nrf24_recv_find_backend(const char *name) {
+    int pos;
+
+    if(!name)
+        return nrf24_backends[0];
+
+    for(pos = 0; nrf24_backends[pos]; pos++) {
+        if(!strcmp(nrf24_backends[pos]->name, name))
+            return nrf24_backends[pos];
+    }
+
+    return NULL;
+}
+
+/*
+ * Pin the calling receive thread to the radio's cpu, and run it
+ * SCHED_FIFO at its priority, so it isn't kept waiting behind the
+ * publisher and mosquitto threads.  Either failing (no CAP_SYS_NICE,
+ * or a cpu we don't have) just leaves the thread as it was.
+ */
+void nrf24_recv_thread_setup(nrf24_radio_t *radio) {
+    struct sched_param param;
+    cpu_set_t cpus;
+    int rc;
+
+    if(radio->cfg->cpu != -1) {
+        CPU_ZERO(&cpus);
+        CPU_SET(radio->cfg->cpu, &cpus);
+        rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if(rc)
+            WARN("Cannot pin %s to cpu %d: %s", radio->cfg->name,
+                 radio->cfg->cpu, strerror(rc));
+    }
+
+    if(radio->cfg->priority) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = radio->cfg->priority;
+        rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if(rc)
+            WARN("Cannot run %s at SCHED_FIFO priority %d: %s",
+                 radio->cfg->name, radio->cfg->priority, strerror(rc));
+    }
+}
+
+void nrf24_recv_submit(nrf24_radio_t *radio, sensor_struct_t *msgs,
+                       const uint8_t *pipes, int count, uint64_t rx_ns) {
+    int submitted;
+
+    /* one writer per radio, before sharding, so records stay in order */
+    capture_write(msgs, pipes, count, rx_ns);
+
+    if(radio->wait_for_room)
+        submitted = publisher_submit_burst_wait(radio->index, msgs, pipes,
+                                                count, rx_ns);
+    else
+        submitted = publisher_submit_burst(radio->index, msgs, pipes, count,
+                                           rx_ns);
+
+    __atomic_store_n(&radio->stats.packets, radio->stats.packets + submitted,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&radio->stats.bursts, radio->stats.bursts + 1,
+                     __ATOMIC_RELAXED);
+    metrics_add(METRIC_RX_PACKETS, count);
+    if(submitted < count) {
+        __atomic_store_n(&radio->stats.dropped,
+                         radio->stats.dropped + (count - submitted),
+                         __ATOMIC_RELAXED);
+        metrics_add(METRIC_RING_DROPS, count - submitted);
+    }
+}
+
+static void *nrf24_recv_thread(void *data) {
+    nrf24_radio_t *radio = (nrf24_radio_t *)data;
+    sensor_struct_t msgs[NRF24_RECV_BURST];
+    uint8_t pipes[NRF24_RECV_BURST];
+    int count;
+
+    DEBUG("%s (%s) receive thread started", radio->cfg->name,
+          radio->backend->name);
+
+    nrf24_recv_thread_setup(radio);
+
+    while(!__atomic_load_n(&radio->quit, __ATOMIC_ACQUIRE)) {
+        /* backends without pipes leave these alone */
+        memset(pipes, 0, sizeof(pipes));
+        count = radio->backend->read_burst(radio, msgs, pipes,
+                                           NRF24_RECV_BURST);
+        if(count > 0) {
+            nrf24_recv_submit(radio, msgs, pipes, count, publisher_now_ns());
+        } else if(count < 0) {
+            ERROR("%s receive error.  Aborting", radio->cfg->name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return NULL;
+}
+
+static void nrf24_recv_dump_radio(nrf24_radio_t *radio) {
+    nrf24_recv_stats_t stats;
+
+    if(!radio->backend)
+        return;
+
+    stats.packets = __atomic_load_n(&radio->stats.packets, __ATOMIC_RELAXED);
+    stats.bursts = __atomic_load_n(&radio->stats.bursts, __ATOMIC_RELAXED);
+    stats.dropped = __atomic_load_n(&radio->stats.dropped, __ATOMIC_RELAXED);
+    stats.errors = 0;
+    stats.deep_drains = 0;
+
+    if(radio->backend->stats)
+        radio->backend->stats(radio, &stats);
+
+    INFO("Radio %s (%s): packets %llu, bursts %llu, dropped %llu, "
+         "errors %llu, deep drains %llu",
+         radio->cfg->name, radio->backend->name,
+         (unsigned long long)stats.packets,
+         (unsigned long long)stats.bursts,
+         (unsigned long long)stats.dropped,
+         (unsigned long long)stats.errors,
+         (unsigned long long)stats.deep_drains);
+}
+
+static bool nrf24_recv_start(nrf24_radio_t *radio) {
+    radio->backend = nrf24_recv_find_backend(radio->cfg->backend);
+    if(!radio->backend) {
+        ERROR("Unknown radio backend for %s: %s", radio->cfg->name,
+              radio->cfg->backend);
+        return false;
+    }
+
+    DEBUG("Initializing %s (%s receiver)", radio->cfg->name,
+          radio->backend->name);
+
+    if(!radio->backend->init(radio)) {
+        radio->backend = NULL;
+        return false;
+    }
+
+    if(radio->backend->start && !radio->backend->start(radio)) {
+        radio->backend->stop(radio);
+        radio->backend = NULL;
+        return false;
+    }
+
+    if(radio->backend->read_burst &&
+       pthread_create(&radio->tid, NULL, nrf24_recv_thread, radio)) {
+        ERROR("Cannot start receive thread for %s", radio->cfg->name);
+        radio->backend->stop(radio);
+        radio->backend = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+static void nrf24_recv_stop(nrf24_radio_t *radio) {
+    if(!radio->backend)
+        return;
+
+    DEBUG("Tearing down %s", radio->cfg->name);
+
+    __atomic_store_n(&radio->quit, 1, __ATOMIC_RELEASE);
+    if(radio->backend->read_burst)
+        pthread_join(radio->tid, NULL);
+
+    nrf24_recv_dump_radio(radio);
+    radio->backend->stop(radio);
+    radio->backend = NULL;
+}
+
+/* downlink_radio, or the first radio that can transmit */
+static void nrf24_recv_pick_tx(void) {
+    nrf24_radio_t *radio;
+    int idx;
+
+    for(idx = 0; idx < nrf24_radio_count; idx++) {
+        radio = &nrf24_radios[idx];
+        if(config.downlink_radio &&
+           strcmp(config.downlink_radio, radio->cfg->name))
+            continue;
+
+        if(radio->backend->send_burst) {
+            nrf24_tx_radio = radio;
+            INFO("Downlink commands go out on %s", radio->cfg->name);
+            return;
+        }
+
+        if(config.downlink_radio)
+            WARN("Radio %s (%s) cannot transmit", radio->cfg->name,
+                 radio->backend->name);
+    }
+
+    WARN("No radio for downlink commands");
+}
+
+/* one receiver (and receive thread) per configured radio */
+bool nrf24_recv_init(void) {
+    int idx;
+
+    /* before the threads start, so their stacks get locked too */
+    if(config.mlockall && mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+        WARN("Cannot lock memory: %s", strerror(errno));
+
+    nrf24_radios = (nrf24_radio_t *)calloc(config.radio_count,
+                                           sizeof(nrf24_radio_t));
+    if(!nrf24_radios) {
+        ERROR("Malloc error");
+        return false;
+    }
+    nrf24_radio_count = config.radio_count;
+
+    for(idx = 0; idx < nrf24_radio_count; idx++) {
+        nrf24_radios[idx].index = idx;
+        nrf24_radios[idx].cfg = &config.radios[idx];
+
+        if(!nrf24_recv_start(&nrf24_radios[idx])) {
+            nrf24_recv_deinit();
+            return false;
+        }
+    }
+
+    if(config.downlink)
+        nrf24_recv_pick_tx();
+
+    return true;
+}
+
+bool nrf24_recv_deinit(void) {
+    int idx;
+
+    for(idx = 0; idx < nrf24_radio_count; idx++)
+        nrf24_recv_stop(&nrf24_radios[idx]);
+
+    nrf24_tx_radio = NULL;
+    free(nrf24_radios);
+    nrf24_radios = NULL;
+    nrf24_radio_count = 0;
+    return true;
+}
+
+void nrf24_recv_dump_stats(void) {
+    int idx;
+
+    for(idx = 0; idx < nrf24_radio_count; idx++)
+        nrf24_recv_dump_radio(&nrf24_radios[idx]);
+}
+
+bool nrf24_recv_can_send(void) {
+    return nrf24_tx_radio != NULL;
+}
+
+/* downlink: -1 if no radio can send */
+int nrf24_recv_send_burst(const sensor_struct_t *msgs, int count,
+                          uint64_t *ack_ns) {
+    if(!nrf24_tx_radio)
+        return -1;
+
+    return nrf24_tx_radio->backend->send_burst(nrf24_tx_radio, msgs, count,
+                                               ack_ns);
+}
@@ -18,9 +18,72 @@
 #ifndef _NRF24_RECV_H_
 #define _NRF24_RECV_H_
 
+#include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
+
+#include "sensor.h"
+#include "cfg.h"
+
+#define NRF24_RECV_BURST 64
+
+typedef struct nrf24_recv_stats_t {
+    uint64_t packets;        /* handed to the publisher */
+    uint64_t bursts;         /* reads that returned packets */
+    uint64_t dropped;        /* publisher ring was full */
+    uint64_t errors;         /* backend specific */
+    uint64_t deep_drains;    /* IRQs that drained 3+ payloads (bitbang) */
+} nrf24_recv_stats_t;
+
+struct nrf24_backend_t;
+
+typedef struct nrf24_radio_t {
+    int index;                  /* which publisher ring we feed */
+    const radio_cfg_t *cfg;
+    const struct nrf24_backend_t *backend;
+    void *priv;                 /* backend state */
+    pthread_t tid;
+    int quit;
+    bool wait_for_room;         /* block on a full ring instead of dropping */
+    nrf24_recv_stats_t stats;
+} nrf24_radio_t;
+
+/*
+ * A receive backend.  init() sets up the device and start() begins
+ * reception.  Backends that can block for packets provide
+ * read_burst(), which returns up to max packets and, optionally, the
+ * pipe each came in on (0 on timeout, -1 on
+ * a fatal error), and get a receive thread from the core.  Interrupt
+ * driven backends leave read_burst NULL, run their own thread from
+ * start(), calling nrf24_recv_thread_setup() first, and hand packets
+ * over with nrf24_recv_submit(), stamped with when they came in.
+ *
+ * Backends that can transmit provide send_burst(), which sends each
+ * of msgs to the address in it, leaving RX once for the whole burst.
+ * It returns how many were acked, and fills in ack_ns with each one's
+ * TX-to-ack time (0 if never acked).
+ */
+typedef struct nrf24_backend_t {
+    const char *name;
+    bool (*init)(nrf24_radio_t *radio);
+    bool (*start)(nrf24_radio_t *radio);
+    int (*read_burst)(nrf24_radio_t *radio, sensor_struct_t *msgs,
+                      uint8_t *pipes, int max);
+    void (*stop)(nrf24_radio_t *radio);
+    void (*stats)(nrf24_radio_t *radio, nrf24_recv_stats_t *stats);
+    int (*send_burst)(nrf24_radio_t *radio, const sensor_struct_t *msgs,
+                      int count, uint64_t *ack_ns);
+} nrf24_backend_t;
 
 extern bool nrf24_recv_init(void);
 extern bool nrf24_recv_deinit(void);
+extern void nrf24_recv_thread_setup(nrf24_radio_t *radio);
+extern void nrf24_recv_submit(nrf24_radio_t *radio, sensor_struct_t *msgs,
+                              const uint8_t *pipes, int count,
+                              uint64_t rx_ns);
+extern void nrf24_recv_dump_stats(void);
+extern bool nrf24_recv_can_send(void);
+extern int nrf24_recv_send_burst(const sensor_struct_t *msgs, int count,
+                                 uint64_t *ack_ns);
 
 #endif /* _NRF24_RECV_H_ */
@@ -0,0 +1,206 @@
+/*
+ * nrf24-replay-recv.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * "Radio" that plays back a capture file instead of listening to
+ * the air.  At original speed for reproducing field problems, or
+ * as fast as the publisher will take them for throughput testing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "nrf24-mqtt.h"
+#include "debug.h"
+#include "sensor.h"
+#include "cfg.h"
+#include "capture.h"
+#include "publisher.h"
+#include "nrf24-recv.h"
+
+#define REPLAY_IDLE_NS 100000000ULL
+#define REPLAY_GAP_MAX_NS 60000000000ULL
+
+typedef struct replay_state_t {
+    FILE *fp;
+    uint16_t record_size;
+    capture_record_t pending;
+    bool have_pending;
+    bool done;
+    uint64_t first_ns;
+    uint64_t start_ns;
+    uint64_t base_ns;
+    uint64_t prev_ns;
+    uint64_t count;
+} replay_state_t;
+
+static void replay_sleep_until(uint64_t when_ns) {
+    struct timespec ts;
+
+    ts.tv_sec = when_ns / 1000000000ULL;
+    ts.tv_nsec = when_ns % 1000000000ULL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/*
+ * Captures aren't guaranteed monotonic: appended runs restart the
+ * clock, and several radios interleave their records.  A small step
+ * back just plays now; a step before the anchor or a jump either way
+ * longer than REPLAY_GAP_MAX_NS starts the timeline over from here.
+ */
+static void replay_rebase(replay_state_t *state) {
+    uint64_t rx_ns = state->pending.rx_ns;
+    uint64_t step_ns;
+
+    if(!state->count) {
+        state->first_ns = rx_ns;
+        state->base_ns = state->start_ns;
+    } else {
+        step_ns = rx_ns > state->prev_ns ? rx_ns - state->prev_ns :
+                                           state->prev_ns - rx_ns;
+        if(rx_ns < state->first_ns || step_ns > REPLAY_GAP_MAX_NS) {
+            DEBUG("Replay timeline jumped %.3f s, rebasing",
+                  ((double)rx_ns - (double)state->prev_ns) / 1e9);
+            state->first_ns = rx_ns;
+            state->base_ns = publisher_now_ns();
+        }
+    }
+
+    state->prev_ns = rx_ns;
+}
+
+static bool replay_next(replay_state_t *state) {
+    uint64_t elapsed_ns;
+
+    if(state->have_pending)
+        return true;
+
+    if(!state->done &&
+       capture_read(state->fp, state->record_size, &state->pending)) {
+        replay_rebase(state);
+        state->have_pending = true;
+        return true;
+    }
+
+    if(!state->done) {
+        state->done = true;
+        elapsed_ns = publisher_now_ns() - state->start_ns;
+        INFO("Replay complete: %llu packets in %.3f s (%.0f packets/s)",
+             (unsigned long long)state->count, elapsed_ns / 1e9,
+             elapsed_ns ? state->count * 1e9 / elapsed_ns : 0.0);
+    }
+
+    return false;
+}
+
+static int nrf24_replay_read_burst(nrf24_radio_t *nrf24, sensor_struct_t *msgs,
+                                   uint8_t *pipes, int max) {
+    replay_state_t *state = (replay_state_t *)nrf24->priv;
+    uint64_t now_ns, due_ns;
+    int count = 0;
+
+    if(!replay_next(state)) {
+        replay_sleep_until(publisher_now_ns() + REPLAY_IDLE_NS);
+        return 0;
+    }
+
+    if(!nrf24->cfg->replay_fast) {
+        /* wait in short steps, so deinit isn't held up by a long gap */
+        now_ns = publisher_now_ns();
+        due_ns = state->base_ns + (state->pending.rx_ns - state->first_ns);
+        if(due_ns < now_ns)
+            due_ns = now_ns;
+        if(due_ns > now_ns + REPLAY_IDLE_NS) {
+            replay_sleep_until(now_ns + REPLAY_IDLE_NS);
+            return 0;
+        }
+        replay_sleep_until(due_ns);
+        max = 1;
+    }
+
+    while(count < max && replay_next(state)) {
+        pipes[count] = state->pending.pipe;
+        memcpy(&msgs[count++], &state->pending.msg, sizeof(sensor_struct_t));
+        state->have_pending = false;
+        state->count++;
+    }
+
+    return count;
+}
+
+static bool nrf24_replay_init(nrf24_radio_t *nrf24) {
+    replay_state_t *state;
+
+    if(!nrf24->cfg->replay_file) {
+        ERROR("No replay_file configured");
+        return false;
+    }
+
+    DEBUG("Initializing replay from %s (%s)", nrf24->cfg->replay_file,
+          nrf24->cfg->replay_fast ? "fast" : "realtime");
+
+    state = (replay_state_t *)calloc(1, sizeof(replay_state_t));
+    if(!state) {
+        ERROR("Malloc error");
+        return false;
+    }
+
+    state->fp = capture_open_read(nrf24->cfg->replay_file,
+                                  &state->record_size);
+    if(!state->fp) {
+        free(state);
+        return false;
+    }
+
+    nrf24->priv = state;
+    nrf24->wait_for_room = nrf24->cfg->replay_fast;
+    return true;
+}
+
+static bool nrf24_replay_start(nrf24_radio_t *nrf24) {
+    replay_state_t *state = (replay_state_t *)nrf24->priv;
+
+    state->start_ns = publisher_now_ns();
+    return true;
+}
+
+static void nrf24_replay_stop(nrf24_radio_t *nrf24) {
+    replay_state_t *state = (replay_state_t *)nrf24->priv;
+
+    DEBUG("Tearing down replay receiver");
+
+    if(!state)
+        return;
+
+    fclose(state->fp);
+    free(state);
+    nrf24->priv = NULL;
+}
+
+const nrf24_backend_t nrf24_replay_backend = {
+    .name = "replay",
+    .init = nrf24_replay_init,
+    .start = nrf24_replay_start,
+    .read_burst = nrf24_replay_read_burst,
+    .stop = nrf24_replay_stop,
+    .stats = NULL
+};
@@ -0,0 +1,574 @@
+/*
+ * publisher.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The receive backends do nothing but stamp packets and push them
+ * onto a ring.  Everything expensive (lookup, decode, formatting,
+ * mosquitto_publish) happens here, on the publisher workers, so the
+ * radio can get back to listening as quickly as possible.
+ *
+ * Each worker has its own broker connection and one ring per
+ * source, so every ring stays single producer, single consumer.
+ * Packets are routed to a worker by sensor address, which keeps each
+ * sensor's readings in order while the workers publish in parallel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+
+#include "nrf24-mqtt.h"
+#include "debug.h"
+#include "cfg.h"
+#include "mqtt.h"
+#include "metrics.h"
+#include "ring.h"
+#include "publisher.h"
+#include "capture.h"
+#include "dedup.h"
+
+#define PUBLISHER_IDLE_MS 100
+#define PUBLISHER_TICK_PACKETS 64
+#define PUBLISHER_POLL_ROUNDS 16
+
+typedef struct publisher_worker_t {
+    int index;
+    mqtt_worker_t *mqtt;
+    ring_t *rings;               /* one per source */
+    pthread_t tid;
+    bool started;
+    sem_t wake;
+    int sleeping;
+    uint64_t published;
+    dedup_t dedup;               /* a sensor only ever reaches one worker */
+    bool dedup_enabled;
+} publisher_worker_t;
+
+static publisher_worker_t *publisher_pool;
+static int publisher_pool_size = 0;
+static int publisher_source_count = 0;
+static int publisher_quit = 0;
+static int publisher_event_fd = -1;   /* event loop mode, instead of threads */
+
+uint64_t publisher_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t publisher_queued(publisher_worker_t *worker) {
+    uint32_t queued = 0;
+    int idx;
+
+    for(idx = 0; idx < publisher_source_count; idx++)
+        queued += ring_count(&worker->rings[idx]);
+
+    return queued;
+}
+
+static void publisher_kick(publisher_worker_t *worker) {
+    uint64_t one = 1;
+    ssize_t rc;
+
+    if(!__atomic_load_n(&worker->sleeping, __ATOMIC_SEQ_CST))
+        return;
+
+    if(publisher_event_fd == -1) {
+        sem_post(&worker->wake);
+    } else {
+        /* a full counter still wakes the loop, so failure is fine */
+        rc = write(publisher_event_fd, &one, sizeof(one));
+        (void)rc;
+    }
+}
+
+static publisher_worker_t *publisher_route(const sensor_struct_t *msg) {
+    return &publisher_pool[mqtt_worker_route(msg->addr)];
+}
+
+/*
+ * Called from the receive threads -- keep it short.  A burst shares
+ * one timestamp, rx_ns, from when the radio had it (0 for now), and
+ * each worker it touched is woken once.  pipes may be NULL if the
+ * source has no pipes.  Returns the number of packets queued.
+ */
+int publisher_submit_burst(int source, sensor_struct_t *msgs,
+                           const uint8_t *pipes, int count, uint64_t rx_ns) {
+    publisher_worker_t *worker;
+    uint32_t touched = 0;
+    packet_t pkt;
+    int queued = 0;
+    int pos;
+
+    pkt.rx_ns = rx_ns ? rx_ns : publisher_now_ns();
+
+    /* keep going on a full ring so every lost packet is counted */
+    for(pos = 0; pos < count; pos++) {
+        worker = publisher_route(&msgs[pos]);
+        memcpy(&pkt.msg, &msgs[pos], sizeof(sensor_struct_t));
+        pkt.pipe = pipes ? pipes[pos] : 0;
+        if(ring_push(&worker->rings[source], &pkt))
+            queued++;
+        touched |= 1U << worker->index;
+    }
+
+    for(pos = 0; touched; pos++, touched >>= 1) {
+        if(touched & 1)
+            publisher_kick(&publisher_pool[pos]);
+    }
+
+    return queued;
+}
+
+bool publisher_submit(int source, sensor_struct_t *msg) {
+    return publisher_submit_burst(source, msg, NULL, 1, 0) == 1;
+}
+
+/*
+ * Like publisher_submit_burst, but waits for room instead of
+ * dropping.  Only for sources that can be throttled, like replay.
+ */
+int publisher_submit_burst_wait(int source, sensor_struct_t *msgs,
+                                const uint8_t *pipes, int count,
+                                uint64_t rx_ns) {
+    publisher_worker_t *worker;
+    ring_t *ring;
+    int pos = 0;
+
+    while(pos < count) {
+        worker = publisher_route(&msgs[pos]);
+        ring = &worker->rings[source];
+        if(ring_count(ring) > ring->mask) {
+            if(__atomic_load_n(&publisher_quit, __ATOMIC_ACQUIRE))
+                break;
+            publisher_kick(worker);
+            sched_yield();
+            continue;
+        }
+
+        pos += publisher_submit_burst(source, &msgs[pos],
+                                      pipes ? &pipes[pos] : NULL, 1, rx_ns);
+    }
+
+    return pos;
+}
+
+/*
+ * About to block: from here on, pushes wake us.  Returns false if
+ * something is already waiting, and we shouldn't block after all.
+ */
+static bool publisher_worker_sleep_begin(publisher_worker_t *worker) {
+    capture_flush();
+
+    __atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+
+    /* recheck, so we don't miss a push that raced the flag */
+    return publisher_queued(worker) == 0 &&
+        !__atomic_load_n(&publisher_quit, __ATOMIC_ACQUIRE);
+}
+
+static void publisher_worker_sleep_end(publisher_worker_t *worker) {
+    __atomic_store_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+/* event loop mode, which only ever has the one worker */
+bool publisher_sleep_begin(void) {
+    return publisher_worker_sleep_begin(&publisher_pool[0]);
+}
+
+void publisher_sleep_end(void) {
+    publisher_worker_sleep_end(&publisher_pool[0]);
+}
+
+static void publisher_wait(publisher_worker_t *worker) {
+    struct timespec ts;
+
+    if(publisher_worker_sleep_begin(worker)) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += PUBLISHER_IDLE_MS * 1000000L;
+        if(ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        while(sem_timedwait(&worker->wake, &ts) == -1 && errno == EINTR);
+    }
+
+    publisher_worker_sleep_end(worker);
+}
+
+/* the broker only gets the first copy; captures were taken on receive */
+static void publisher_handle(publisher_worker_t *worker, packet_t *pkt) {
+    if(worker->dedup_enabled &&
+       dedup_seen(&worker->dedup, &pkt->msg, pkt->rx_ns)) {
+        metrics_inc(METRIC_DUPLICATES);
+        return;
+    }
+
+    mqtt_dispatch(worker->mqtt, pkt);
+    __atomic_store_n(&worker->published, worker->published + 1,
+                     __ATOMIC_RELAXED);
+}
+
+/*
+ * Take up to max packets from each of the worker's rings in turn, so
+ * one busy radio can't starve the others.  Returns how many were
+ * handled.
+ */
+static uint32_t publisher_drain(publisher_worker_t *worker, uint32_t max) {
+    packet_t pkt;
+    uint32_t total = 0;
+    uint32_t taken;
+    int idx;
+
+    for(idx = 0; idx < publisher_source_count; idx++) {
+        for(taken = 0; taken < max &&
+                ring_pop(&worker->rings[idx], &pkt); taken++)
+            publisher_handle(worker, &pkt);
+        total += taken;
+    }
+
+    return total;
+}
+
+/*
+ * Event loop mode: one bounded round of publishing, so the loop gets
+ * back to the broker socket now and then under load.  Returns true
+ * if packets are still waiting.
+ */
+bool publisher_poll(void) {
+    publisher_worker_t *worker = &publisher_pool[0];
+    uint64_t count;
+    ssize_t rc;
+    int round;
+
+    rc = read(publisher_event_fd, &count, sizeof(count));
+    (void)rc;
+
+    for(round = 0; round < PUBLISHER_POLL_ROUNDS &&
+            publisher_drain(worker, PUBLISHER_TICK_PACKETS); round++);
+
+    mqtt_tick(worker->mqtt, publisher_now_ns());
+    return publisher_queued(worker) != 0;
+}
+
+int publisher_fd(void) {
+    return publisher_event_fd;
+}
+
+static void *publisher_thread(void *data) {
+    publisher_worker_t *worker = (publisher_worker_t *)data;
+
+    DEBUG("publisher worker %d started", worker->index);
+
+    while(!__atomic_load_n(&publisher_quit, __ATOMIC_ACQUIRE)) {
+        if(!publisher_drain(worker, PUBLISHER_TICK_PACKETS))
+            publisher_wait(worker);
+
+        /* a busy ring never idles, so tick every round */
+        mqtt_tick(worker->mqtt, publisher_now_ns());
+    }
+
+    /* drain whatever is left before we go */
+    while(publisher_drain(worker, UINT32_MAX));
+
+    return NULL;
+}
+
+static bool publisher_worker_init(publisher_worker_t *worker, int index) {
+    int idx;
+
+    worker->index = index;
+    worker->mqtt = mqtt_worker_get(index);
+
+    worker->rings = (ring_t *)calloc(publisher_source_count, sizeof(ring_t));
+    if(!worker->rings) {
+        ERROR("Malloc error");
+        return false;
+    }
+
+    for(idx = 0; idx < publisher_source_count; idx++) {
+        if(!ring_init(&worker->rings[idx], config.ring_depth))
+            return false;
+    }
+
+    if(config.dedup_window_ms) {
+        if(!dedup_init(&worker->dedup, config.dedup_entries,
+                       config.dedup_window_ms))
+            return false;
+        worker->dedup_enabled = true;
+    }
+
+    return true;
+}
+
+/* rings and dedup caches, which live as long as the workers do */
+static void publisher_free_workers(void) {
+    publisher_worker_t *worker;
+    int idx, ring;
+
+    for(idx = 0; idx < publisher_pool_size; idx++) {
+        worker = &publisher_pool[idx];
+
+        if(worker->dedup_enabled)
+            dedup_deinit(&worker->dedup);
+
+        /* ring_deinit is fine with a ring that never got going */
+        for(ring = 0; worker->rings && ring < publisher_source_count; ring++)
+            ring_deinit(&worker->rings[ring]);
+        free(worker->rings);
+    }
+
+    free(publisher_pool);
+    publisher_pool = NULL;
+    publisher_pool_size = 0;
+    publisher_source_count = 0;
+}
+
+static void publisher_stop_threads(void) {
+    publisher_worker_t *worker;
+    int idx;
+
+    __atomic_store_n(&publisher_quit, 1, __ATOMIC_RELEASE);
+
+    for(idx = 0; idx < publisher_pool_size; idx++) {
+        worker = &publisher_pool[idx];
+        if(!worker->started)
+            continue;
+
+        sem_post(&worker->wake);
+        pthread_join(worker->tid, NULL);
+        sem_destroy(&worker->wake);
+        worker->started = false;
+    }
+}
+
+/*
+ * publisher_workers workers, matching the mqtt workers, each with a
+ * ring per source.  In event loop mode there is one worker and no
+ * thread; the loop watches publisher_fd() and calls publisher_poll()
+ * instead.
+ */
+bool publisher_init(int sources) {
+    publisher_worker_t *worker;
+    int workers = config.publisher_workers;
+    int idx;
+
+    DEBUG("Initializing publisher (%d workers, %d rings of %d each)",
+          workers, sources, config.ring_depth);
+
+    publisher_pool = (publisher_worker_t *)calloc(workers,
+                                                  sizeof(publisher_worker_t));
+    if(!publisher_pool) {
+        ERROR("Malloc error");
+        return false;
+    }
+    publisher_pool_size = workers;
+    publisher_source_count = sources;
+
+    for(idx = 0; idx < workers; idx++) {
+        if(!publisher_worker_init(&publisher_pool[idx], idx)) {
+            publisher_free_workers();
+            return false;
+        }
+    }
+
+    if(config.capture_file && !capture_open(config.capture_file)) {
+        publisher_free_workers();
+        return false;
+    }
+
+    if(config.event_loop) {
+        publisher_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(publisher_event_fd == -1) {
+            ERROR("Cannot create publisher eventfd: %s", strerror(errno));
+            capture_close();
+            publisher_free_workers();
+            return false;
+        }
+        return true;
+    }
+
+    for(idx = 0; idx < workers; idx++) {
+        worker = &publisher_pool[idx];
+        sem_init(&worker->wake, 0, 0);
+
+        if(pthread_create(&worker->tid, NULL, publisher_thread, worker)) {
+            ERROR("Cannot start publisher worker %d", idx);
+            sem_destroy(&worker->wake);
+            publisher_stop_threads();
+            capture_close();
+            publisher_free_workers();
+            return false;
+        }
+        worker->started = true;
+    }
+
+    return true;
+}
+
+bool publisher_deinit(void) {
+    DEBUG("Tearing down publisher");
+
+    if(publisher_event_fd == -1) {
+        publisher_stop_threads();
+    } else {
+        /* the loop has stopped, so the rest is ours to drain */
+        __atomic_store_n(&publisher_quit, 1, __ATOMIC_RELEASE);
+        while(publisher_drain(&publisher_pool[0], UINT32_MAX));
+        close(publisher_event_fd);
+        publisher_event_fd = -1;
+    }
+
+    publisher_dump_stats();
+
+    capture_close();
+    publisher_free_workers();
+    return true;
+}
+
+int publisher_worker_count(void) {
+    return publisher_pool_size;
+}
+
+/* high water is of the worker's fullest ring */
+void publisher_get_worker_stats(int index, publisher_worker_stats_t *stats) {
+    publisher_worker_t *worker = &publisher_pool[index];
+    mqtt_worker_stats_t mqtt;
+    uint32_t high_water;
+    ring_t *ring;
+    int idx;
+
+    memset(stats, 0, sizeof(publisher_worker_stats_t));
+
+    for(idx = 0; idx < publisher_source_count; idx++) {
+        ring = &worker->rings[idx];
+
+        stats->queued += ring_count(ring);
+        high_water = __atomic_load_n(&ring->high_water, __ATOMIC_RELAXED);
+        if(high_water > stats->high_water)
+            stats->high_water = high_water;
+        stats->dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+
+    mqtt_worker_get_stats(worker->mqtt, &mqtt);
+    stats->dispatched = __atomic_load_n(&worker->published,
+                                        __ATOMIC_RELAXED);
+    stats->published = mqtt.published;
+    stats->errors = mqtt.errors;
+    stats->spooled = mqtt.spooled;
+    stats->connected = mqtt.connected;
+}
+
+/* summed over every ring; depth and high water are per ring */
+void publisher_get_stats(publisher_stats_t *stats) {
+    publisher_worker_t *worker;
+    uint32_t high_water;
+    ring_t *ring;
+    int idx, source;
+
+    memset(stats, 0, sizeof(publisher_stats_t));
+
+    for(idx = 0; idx < publisher_pool_size; idx++) {
+        worker = &publisher_pool[idx];
+
+        for(source = 0; source < publisher_source_count; source++) {
+            ring = &worker->rings[source];
+
+            stats->depth = ring->mask + 1;
+            stats->queued += ring_count(ring);
+            high_water = __atomic_load_n(&ring->high_water,
+                                         __ATOMIC_RELAXED);
+            if(high_water > stats->high_water)
+                stats->high_water = high_water;
+            stats->received += __atomic_load_n(&ring->pushed,
+                                               __ATOMIC_RELAXED);
+            stats->dropped += __atomic_load_n(&ring->dropped,
+                                              __ATOMIC_RELAXED);
+        }
+
+        stats->published += __atomic_load_n(&worker->published,
+                                            __ATOMIC_RELAXED);
+    }
+
+    stats->suppressed = metrics_get(METRIC_UNCHANGED);
+    stats->duplicates = metrics_get(METRIC_DUPLICATES);
+}
+
+void publisher_dump_stats(void) {
+    publisher_worker_stats_t worker;
+    publisher_stats_t stats;
+    metrics_hist_t hist;
+    int idx;
+
+    publisher_get_stats(&stats);
+
+    if(stats.dropped) {
+        WARN("Ring: depth %u, queued %u, high water %u, received %llu, "
+             "dropped %llu, dispatched %llu, unchanged %llu, "
+             "duplicates %llu",
+             stats.depth, stats.queued, stats.high_water,
+             (unsigned long long)stats.received,
+             (unsigned long long)stats.dropped,
+             (unsigned long long)stats.published,
+             (unsigned long long)stats.suppressed,
+             (unsigned long long)stats.duplicates);
+    } else {
+        INFO("Ring: depth %u, queued %u, high water %u, received %llu, "
+             "dropped %llu, dispatched %llu, unchanged %llu, "
+             "duplicates %llu",
+             stats.depth, stats.queued, stats.high_water,
+             (unsigned long long)stats.received,
+             (unsigned long long)stats.dropped,
+             (unsigned long long)stats.published,
+             (unsigned long long)stats.suppressed,
+             (unsigned long long)stats.duplicates);
+    }
+
+    metrics_get_hist(HIST_END_TO_END, &hist);
+    if(hist.count)
+        INFO("End to end: %llu traced, p50 %lluus, p99 %lluus, max %lluus",
+             (unsigned long long)hist.count,
+             (unsigned long long)metrics_percentile(&hist, 50) / 1000,
+             (unsigned long long)metrics_percentile(&hist, 99) / 1000,
+             (unsigned long long)hist.max / 1000);
+
+    if(publisher_pool_size < 2)
+        return;
+
+    for(idx = 0; idx < publisher_pool_size; idx++) {
+        publisher_get_worker_stats(idx, &worker);
+        DEBUG_LOG(worker.dropped || worker.errors ? DBG_WARN : DBG_INFO,
+                  "Worker %d: queued %u, high water %u, dropped %llu, "
+                  "dispatched %llu, published %llu, errors %llu, "
+                  "spooled %llu%s", idx, worker.queued, worker.high_water,
+                  (unsigned long long)worker.dropped,
+                  (unsigned long long)worker.dispatched,
+                  (unsigned long long)worker.published,
+                  (unsigned long long)worker.errors,
+                  (unsigned long long)worker.spooled,
+                  worker.connected ? "" : ", disconnected");
+    }
+}
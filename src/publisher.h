@@ -0,0 +1,73 @@
+/*
+ * publisher.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PUBLISHER_H_
+#define _PUBLISHER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "nrf24-mqtt.h"
+#include "sensor.h"
+
+typedef struct publisher_stats_t {
+    uint32_t depth;
+    uint32_t queued;
+    uint32_t high_water;
+    uint64_t received;
+    uint64_t dropped;
+    uint64_t published;      /* dispatched to mqtt */
+    uint64_t suppressed;     /* unchanged, not sent to the broker */
+    uint64_t duplicates;     /* copies of a packet already dispatched */
+} publisher_stats_t;
+
+/* one publisher worker, and its broker connection */
+typedef struct publisher_worker_stats_t {
+    uint32_t queued;
+    uint32_t high_water;     /* of its fullest ring */
+    uint64_t dropped;
+    uint64_t dispatched;     /* handed to mqtt */
+    uint64_t published;      /* accepted by mosquitto */
+    uint64_t errors;         /* failed publishes */
+    uint64_t spooled;        /* waiting in its spool */
+    bool connected;
+} publisher_worker_stats_t;
+
+extern bool publisher_init(int sources);
+extern bool publisher_deinit(void);
+extern bool publisher_submit(int source, sensor_struct_t *msg);
+extern int publisher_submit_burst(int source, sensor_struct_t *msgs,
+                                  const uint8_t *pipes, int count,
+                                  uint64_t rx_ns);
+extern int publisher_submit_burst_wait(int source, sensor_struct_t *msgs,
+                                       const uint8_t *pipes, int count,
+                                       uint64_t rx_ns);
+extern void publisher_get_stats(publisher_stats_t *stats);
+extern int publisher_worker_count(void);
+extern void publisher_get_worker_stats(int index,
+                                       publisher_worker_stats_t *stats);
+
+/* event loop mode */
+extern int publisher_fd(void);
+extern bool publisher_poll(void);
+extern bool publisher_sleep_begin(void);
+extern void publisher_sleep_end(void);
+extern void publisher_dump_stats(void);
+
+extern uint64_t publisher_now_ns(void);
+
+#endif /* _PUBLISHER_H_ */
@@ -0,0 +1,86 @@
+/*
+ * ring.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "ring.h"
+
+bool ring_init(ring_t *ring, uint32_t depth) {
+    uint32_t size = 1;
+
+    /* round up to a power of two so we can mask instead of mod */
+    while(size < depth)
+        size <<= 1;
+
+    memset(ring, 0, sizeof(ring_t));
+    ring->slots = (packet_t *)calloc(size, sizeof(packet_t));
+    if(!ring->slots) {
+        ERROR("Malloc error");
+        return false;
+    }
+
+    ring->mask = size - 1;
+    return true;
+}
+
+void ring_deinit(ring_t *ring) {
+    if(ring->slots)
+        free(ring->slots);
+    ring->slots = NULL;
+}
+
+/* producer side */
+bool ring_push(ring_t *ring, const packet_t *pkt) {
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t used = head - tail;
+
+    if(used > ring->mask) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    ring->slots[head & ring->mask] = *pkt;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->pushed, ring->pushed + 1, __ATOMIC_RELAXED);
+
+    if(used + 1 > ring->high_water)
+        __atomic_store_n(&ring->high_water, used + 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+/* consumer side */
+bool ring_pop(ring_t *ring, packet_t *pkt) {
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if(head == tail)
+        return false;
+
+    *pkt = ring->slots[tail & ring->mask];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+uint32_t ring_count(ring_t *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
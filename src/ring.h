@@ -0,0 +1,51 @@
+/*
+ * ring.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "nrf24-mqtt.h"
+
+#define RING_CACHELINE 64
+
+/*
+ * Bounded single-producer/single-consumer packet ring.  The producer
+ * only ever writes head, the consumer only ever writes tail, so no
+ * locks are needed -- just acquire/release ordering on the indexes.
+ */
+typedef struct ring_t {
+    uint32_t head __attribute__((aligned(RING_CACHELINE)));
+    uint64_t pushed;
+    uint64_t dropped;
+    uint32_t high_water;
+
+    uint32_t tail __attribute__((aligned(RING_CACHELINE)));
+
+    uint32_t mask __attribute__((aligned(RING_CACHELINE)));
+    packet_t *slots;
+} ring_t;
+
+extern bool ring_init(ring_t *ring, uint32_t depth);
+extern void ring_deinit(ring_t *ring);
+extern bool ring_push(ring_t *ring, const packet_t *pkt);
+extern bool ring_pop(ring_t *ring, packet_t *pkt);
+extern uint32_t ring_count(ring_t *ring);
+
+#endif /* _RING_H_ */
@@ -0,0 +1,223 @@
+/*
+ * sensor-cache.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nrf24-mqtt.h"
+#include "debug.h"
+#include "cfg.h"
+#include "addrmap.h"
+#include "format.h"
+#include "sensor-cache.h"
+
+#define SENSOR_CACHE_INITIAL 64
+#define SENSOR_CACHE_MAX_NAME 128
+
+static uint32_t sensor_cache_hash(const uint8_t *addr, uint8_t pipe) {
+    uint64_t key = pipe;
+    int pos;
+
+    for(pos = 0; pos < 5; pos++)
+        key = (key << 8) | addr[pos];
+
+    return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static void sensor_cache_free_entry(sensor_entry_t *entry) {
+    sensor_topic_t *topic;
+
+    while(entry->topics) {
+        topic = entry->topics;
+        entry->topics = topic->next;
+        free(topic->topic);
+        free(topic->agg);
+        free(topic->series);
+        free(topic);
+    }
+
+    wheel_del(&entry->liveness);
+    free(entry->batch);
+    free(entry->name);
+    free(entry);
+}
+
+bool sensor_cache_init(sensor_cache_t *cache, const cfg_snapshot_t *snap) {
+    memset(cache, 0, sizeof(sensor_cache_t));
+    cache->snap = snap;
+
+    cache->slots = (sensor_entry_t **)calloc(SENSOR_CACHE_INITIAL,
+                                             sizeof(sensor_entry_t *));
+    if(!cache->slots) {
+        ERROR("Malloc error");
+        return false;
+    }
+
+    cache->mask = SENSOR_CACHE_INITIAL - 1;
+    return true;
+}
+
+void sensor_cache_deinit(sensor_cache_t *cache) {
+    uint32_t pos;
+
+    if(!cache->slots)
+        return;
+
+    for(pos = 0; pos <= cache->mask; pos++) {
+        if(cache->slots[pos])
+            sensor_cache_free_entry(cache->slots[pos]);
+    }
+
+    free(cache->slots);
+    memset(cache, 0, sizeof(sensor_cache_t));
+}
+
+static void sensor_cache_insert(sensor_entry_t **slots, uint32_t mask,
+                                sensor_entry_t *entry) {
+    uint32_t pos = sensor_cache_hash(entry->addr, entry->pipe) & mask;
+
+    while(slots[pos])
+        pos = (pos + 1) & mask;
+    slots[pos] = entry;
+}
+
+static bool sensor_cache_grow(sensor_cache_t *cache) {
+    sensor_entry_t **slots;
+    uint32_t mask = (cache->mask << 1) | 1;
+    uint32_t pos;
+
+    slots = (sensor_entry_t **)calloc(mask + 1, sizeof(sensor_entry_t *));
+    if(!slots) {
+        ERROR("Malloc error");
+        return false;
+    }
+
+    for(pos = 0; pos <= cache->mask; pos++) {
+        if(cache->slots[pos])
+            sensor_cache_insert(slots, mask, cache->slots[pos]);
+    }
+
+    free(cache->slots);
+    cache->slots = slots;
+    cache->mask = mask;
+    return true;
+}
+
+/*
+ * Find the cached entry for an address, creating it (and resolving
+ * the wildcard name, if any) on first sight.  NULL for unmapped
+ * addresses.  The pipe only matters if the map pins entries to
+ * pipes; otherwise a sensor heard on two pipes is the same sensor.
+ */
+sensor_entry_t *sensor_cache_lookup(sensor_cache_t *cache, uint8_t *addr,
+                                    uint8_t pipe) {
+    uint32_t pos;
+    sensor_entry_t *entry;
+    addr_map_t *map;
+    char name[SENSOR_CACHE_MAX_NAME];
+
+    if(!cache->snap->pipe_maps)
+        pipe = 0;
+
+    pos = sensor_cache_hash(addr, pipe) & cache->mask;
+    while((entry = cache->slots[pos])) {
+        if(entry->pipe == pipe && memcmp(entry->addr, addr, 5) == 0)
+            return entry;
+        pos = (pos + 1) & cache->mask;
+    }
+
+    map = cfg_find_map(cache->snap, addr, pipe);
+    if(!map)
+        return NULL;
+
+    if((cache->count + 1) * 2 > cache->mask + 1) {
+        if(!sensor_cache_grow(cache))
+            return NULL;
+    }
+
+    entry = (sensor_entry_t *)calloc(1, sizeof(sensor_entry_t));
+    if(!entry) {
+        ERROR("Malloc error");
+        return NULL;
+    }
+
+    addrmap_format_name(map, addr, name, sizeof(name));
+
+    memcpy(entry->addr, addr, 5);
+    entry->pipe = pipe;
+    entry->map = map;
+    entry->name = strdup(name);
+    if(!entry->name) {
+        ERROR("Malloc error");
+        free(entry);
+        return NULL;
+    }
+
+    sensor_cache_insert(cache->slots, cache->mask, entry);
+    cache->count++;
+
+    DEBUG("New sensor %02x%02x%02x%02x%02x -> %s",
+          addr[0], addr[1], addr[2], addr[3], addr[4], entry->name);
+    return entry;
+}
+
+/* topic for <name>/<type><instance>, built once and kept */
+sensor_topic_t *sensor_cache_topic(sensor_entry_t *entry, uint8_t type,
+                                   uint8_t type_instance,
+                                   const char *type_name) {
+    sensor_topic_t *topic;
+    size_t name_len, type_len;
+    char instance[4];
+    size_t instance_len;
+
+    for(topic = entry->topics; topic; topic = topic->next) {
+        if(topic->type == type && topic->type_instance == type_instance)
+            return topic;
+    }
+
+    topic = (sensor_topic_t *)calloc(1, sizeof(sensor_topic_t));
+    if(!topic) {
+        ERROR("Malloc error");
+        return NULL;
+    }
+
+    name_len = strlen(entry->name);
+    type_len = strlen(type_name);
+    instance_len = format_uint(instance, type_instance);
+
+    topic->topic = (char *)malloc(name_len + 1 + type_len + instance_len + 1);
+    if(!topic->topic) {
+        ERROR("Malloc error");
+        free(topic);
+        return NULL;
+    }
+
+    memcpy(topic->topic, entry->name, name_len);
+    topic->topic[name_len] = '/';
+    memcpy(topic->topic + name_len + 1, type_name, type_len);
+    memcpy(topic->topic + name_len + 1 + type_len, instance, instance_len + 1);
+
+    topic->type = type;
+    topic->type_instance = type_instance;
+    topic->channel_offset = (uint16_t)(name_len + 1);
+    topic->topic_len = (uint16_t)(name_len + 1 + type_len + instance_len);
+
+    topic->next = entry->topics;
+    entry->topics = topic;
+    return topic;
+}
@@ -0,0 +1,105 @@
+/*
+ * sensor-cache.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SENSOR_CACHE_H_
+#define _SENSOR_CACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "nrf24-mqtt.h"
+#include "cfg.h"
+#include "aggregate.h"
+#include "wheel.h"
+#include "tsdb.h"
+
+/*
+ * Per-sensor state owned by the publisher thread.  Entries are
+ * created the first time a mapped address is heard and then reused,
+ * so the steady state publish path does no allocation.
+ */
+typedef struct sensor_topic_t {
+    uint8_t type;
+    uint8_t type_instance;
+    uint16_t topic_len;
+    uint16_t channel_offset;   /* "temp0" part of the topic */
+    char *topic;
+
+    /* last value published, in thousandths, for change-only publishing */
+    bool published;
+    int32_t last_value;
+    uint64_t last_publish_ns;
+
+    agg_t *agg;                /* only when aggregating */
+    tsdb_series_t *series;     /* only when keeping history */
+
+    /* MQTT 5 topic alias, good while alias_gen is the worker's */
+    uint16_t alias;
+    uint32_t alias_gen;
+
+    struct sensor_topic_t *next;
+} sensor_topic_t;
+
+/* one reading waiting in a json batch */
+typedef struct sensor_reading_t {
+    sensor_topic_t *topic;
+    int32_t value;
+    int decimals;
+    uint64_t rx_ns;
+} sensor_reading_t;
+
+#define SENSOR_STATUS_UNKNOWN 0
+#define SENSOR_STATUS_ONLINE  1
+#define SENSOR_STATUS_OFFLINE 2
+
+typedef struct sensor_entry_t {
+    uint8_t addr[5];
+    uint8_t pipe;
+    addr_map_t *map;
+    char *name;
+    sensor_topic_t *topics;
+
+    /* json batch mode: open batch, and our place in the flush queue */
+    sensor_reading_t *batch;
+    uint16_t batch_count;
+    uint64_t batch_start_ns;
+    struct sensor_entry_t *batch_prev;
+    struct sensor_entry_t *batch_next;
+
+    /* liveness: goes off when the sensor has been quiet too long */
+    wheel_timer_t liveness;
+    uint8_t status;
+} sensor_entry_t;
+
+/* entries point into snap's map, so a new snapshot needs a new cache */
+typedef struct sensor_cache_t {
+    const cfg_snapshot_t *snap;
+    sensor_entry_t **slots;
+    uint32_t mask;
+    uint32_t count;
+} sensor_cache_t;
+
+extern bool sensor_cache_init(sensor_cache_t *cache,
+                              const cfg_snapshot_t *snap);
+extern void sensor_cache_deinit(sensor_cache_t *cache);
+extern sensor_entry_t *sensor_cache_lookup(sensor_cache_t *cache, uint8_t *addr,
+                                           uint8_t pipe);
+extern sensor_topic_t *sensor_cache_topic(sensor_entry_t *entry, uint8_t type,
+                                          uint8_t type_instance,
+                                          const char *type_name);
+
+#endif /* _SENSOR_CACHE_H_ */
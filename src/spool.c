@@ -0,0 +1,329 @@
+/*
+ * spool.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Store and forward.  While the broker is away, publishes go into a
+ * ring in a memory mapped file instead, and get replayed in order
+ * once it is back.  Since the ring lives in the page cache, a crash
+ * or restart of the daemon doesn't lose it.  When full, the oldest
+ * records are dropped to make room.
+ *
+ * Each publisher worker has its own spool, and is the only thread
+ * to touch it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nrf24-mqtt.h"
+#include "debug.h"
+#include "metrics.h"
+#include "spool.h"
+
+static void spool_write_bytes(spool_t *spool, uint64_t pos, const void *src,
+                              size_t len) {
+    uint32_t offset = (uint32_t)(pos % spool->capacity);
+    size_t first = len;
+
+    if(first > spool->capacity - offset)
+        first = spool->capacity - offset;
+
+    memcpy(spool->data + offset, src, first);
+    memcpy(spool->data, (const uint8_t *)src + first, len - first);
+}
+
+static void spool_read_bytes(spool_t *spool, uint64_t pos, void *dst,
+                             size_t len) {
+    uint32_t offset = (uint32_t)(pos % spool->capacity);
+    size_t first = len;
+
+    if(first > spool->capacity - offset)
+        first = spool->capacity - offset;
+
+    memcpy(dst, spool->data + offset, first);
+    memcpy((uint8_t *)dst + first, spool->data, len - first);
+}
+
+static void spool_reset(spool_t *spool) {
+    spool->header->head = 0;
+    spool->header->tail = 0;
+    spool->header->records = 0;
+}
+
+static uint64_t spool_record_size(const spool_record_t *record) {
+    return sizeof(spool_record_t) + record->topic_len + record->payload_len;
+}
+
+static bool spool_record_valid(const spool_record_t *record) {
+    return record->topic_len < SPOOL_TOPIC_MAX &&
+        record->payload_len <= SPOOL_PAYLOAD_MAX;
+}
+
+/*
+ * head and tail say what's spooled; records is only a count for the
+ * stats, and is written after head moves, so a crash can leave it
+ * off.  Walk from tail to head to set it right.  Returns false if a
+ * record is corrupt or runs past head.
+ */
+static bool spool_recount(spool_t *spool) {
+    spool_record_t record;
+    uint64_t pos = spool->header->tail;
+    uint64_t records = 0;
+
+    while(spool->header->head - pos >= sizeof(record)) {
+        spool_read_bytes(spool, pos, &record, sizeof(record));
+        if(!spool_record_valid(&record))
+            return false;
+        pos += spool_record_size(&record);
+        records++;
+    }
+
+    if(pos != spool->header->head)
+        return false;
+
+    spool->header->records = records;
+    return true;
+}
+
+/*
+ * Open (or create) the spool.  An existing spool keeps its own size,
+ * so a changed spool_size only applies to a new file.
+ */
+bool spool_open(spool_t *spool, const char *file, uint32_t capacity) {
+    struct stat st;
+
+    memset(spool, 0, sizeof(spool_t));
+    spool->fd = open(file, O_RDWR | O_CREAT, 0644);
+    if(spool->fd == -1) {
+        ERROR("Cannot open spool file %s: %s", file, strerror(errno));
+        return false;
+    }
+
+    if(fstat(spool->fd, &st) == -1) {
+        ERROR("Cannot stat spool file %s: %s", file, strerror(errno));
+        goto fail;
+    }
+
+    if(st.st_size == 0) {
+        spool->map_size = SPOOL_HEADER_SIZE + capacity;
+        if(ftruncate(spool->fd, spool->map_size) == -1) {
+            ERROR("Cannot size spool file %s: %s", file, strerror(errno));
+            goto fail;
+        }
+    } else if(st.st_size <= SPOOL_HEADER_SIZE) {
+        ERROR("Spool file %s is truncated", file);
+        goto fail;
+    } else {
+        spool->map_size = st.st_size;
+    }
+
+    spool->map = (uint8_t *)mmap(NULL, spool->map_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, spool->fd, 0);
+    if(spool->map == MAP_FAILED) {
+        ERROR("Cannot map spool file %s: %s", file, strerror(errno));
+        spool->map = NULL;
+        goto fail;
+    }
+
+    spool->header = (spool_header_t *)spool->map;
+    spool->data = spool->map + SPOOL_HEADER_SIZE;
+
+    if(st.st_size == 0) {
+        memcpy(spool->header->magic, SPOOL_MAGIC, sizeof(spool->header->magic));
+        spool->header->version = SPOOL_VERSION;
+        spool->header->capacity = capacity;
+        spool_reset(spool);
+    } else if(memcmp(spool->header->magic, SPOOL_MAGIC,
+                     sizeof(spool->header->magic)) ||
+              spool->header->version != SPOOL_VERSION ||
+              spool->header->capacity != spool->map_size - SPOOL_HEADER_SIZE) {
+        ERROR("%s is not a version %d spool file", file, SPOOL_VERSION);
+        goto fail;
+    }
+
+    spool->capacity = spool->header->capacity;
+    if(spool->capacity != capacity)
+        WARN("Spool %s keeps its old size of %u bytes", file, spool->capacity);
+
+    if(spool->header->head < spool->header->tail ||
+       spool->header->head - spool->header->tail > spool->capacity ||
+       !spool_recount(spool)) {
+        WARN("Spool %s is inconsistent, discarding it", file);
+        spool_reset(spool);
+    }
+
+    if(spool->header->records)
+        INFO("Spool %s holds %llu readings from before", file,
+             (unsigned long long)spool->header->records);
+    else
+        INFO("Spooling to %s (%u bytes) while disconnected", file,
+             spool->capacity);
+
+    return true;
+
+fail:
+    if(spool->map)
+        munmap(spool->map, spool->map_size);
+    spool->map = NULL;
+    spool->header = NULL;
+    close(spool->fd);
+    spool->fd = -1;
+    return false;
+}
+
+void spool_close(spool_t *spool) {
+    if(!spool->map)
+        return;
+
+    if(spool->header->records)
+        INFO("Leaving %llu readings spooled", (unsigned long long)
+             spool->header->records);
+
+    msync(spool->map, spool->map_size, MS_SYNC);
+    munmap(spool->map, spool->map_size);
+    close(spool->fd);
+
+    spool->map = NULL;
+    spool->header = NULL;
+    spool->data = NULL;
+    spool->fd = -1;
+}
+
+bool spool_enabled(const spool_t *spool) {
+    return spool->map != NULL;
+}
+
+bool spool_empty(const spool_t *spool) {
+    return !spool->map || spool->header->head == spool->header->tail;
+}
+
+uint64_t spool_count(const spool_t *spool) {
+    return spool->map ? spool->header->records : 0;
+}
+
+void spool_pop(spool_t *spool) {
+    spool_record_t record;
+    uint64_t size;
+
+    if(spool_empty(spool))
+        return;
+
+    spool_read_bytes(spool, spool->header->tail, &record, sizeof(record));
+    size = spool_record_size(&record);
+    if(!spool_record_valid(&record) ||
+       size > spool->header->head - spool->header->tail) {
+        ERROR("Corrupt spool record, discarding the spool");
+        spool_reset(spool);
+        return;
+    }
+
+    spool->header->tail += size;
+    if(spool->header->records)
+        spool->header->records--;
+    spool->dirty = true;
+}
+
+/*
+ * The record is written before head moves, so if we die half way
+ * through it is as if it was never pushed.
+ */
+bool spool_push(spool_t *spool, const char *topic, const void *payload,
+                size_t len) {
+    spool_record_t record;
+    size_t topic_len = strlen(topic);
+    uint64_t need;
+
+    if(!spool->map)
+        return false;
+
+    if(topic_len >= SPOOL_TOPIC_MAX || len > SPOOL_PAYLOAD_MAX) {
+        ERROR_LIMITED("Reading too large to spool: %s", topic);
+        return false;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.topic_len = (uint16_t)topic_len;
+    record.payload_len = (uint32_t)len;
+    need = spool_record_size(&record);
+
+    if(need > spool->capacity)
+        return false;
+
+    while(spool->capacity -
+          (spool->header->head - spool->header->tail) < need) {
+        spool_pop(spool);
+        spool->header->dropped++;
+        metrics_inc(METRIC_SPOOL_DROPS);
+        WARN_LIMITED("Spool full, dropping oldest reading");
+    }
+
+    spool_write_bytes(spool, spool->header->head, &record, sizeof(record));
+    spool_write_bytes(spool, spool->header->head + sizeof(record), topic,
+                      topic_len);
+    spool_write_bytes(spool, spool->header->head + sizeof(record) + topic_len,
+                      payload, len);
+
+    __atomic_store_n(&spool->header->head, spool->header->head + need,
+                     __ATOMIC_RELEASE);
+    spool->header->records++;
+    spool->dirty = true;
+    return true;
+}
+
+/*
+ * Copy out the oldest record.  topic must hold SPOOL_TOPIC_MAX and
+ * payload SPOOL_PAYLOAD_MAX bytes.  It stays spooled until popped.
+ */
+bool spool_peek(spool_t *spool, char *topic, void *payload, size_t *len) {
+    spool_record_t record;
+    uint64_t pos;
+
+    if(spool_empty(spool))
+        return false;
+
+    pos = spool->header->tail;
+    spool_read_bytes(spool, pos, &record, sizeof(record));
+    pos += sizeof(record);
+
+    if(!spool_record_valid(&record)) {
+        ERROR("Corrupt spool record, discarding the spool");
+        spool_reset(spool);
+        return false;
+    }
+
+    spool_read_bytes(spool, pos, topic, record.topic_len);
+    topic[record.topic_len] = '\0';
+    spool_read_bytes(spool, pos + record.topic_len, payload,
+                     record.payload_len);
+    *len = record.payload_len;
+    return true;
+}
+
+/* start writeback of anything changed since last time */
+void spool_sync(spool_t *spool) {
+    if(!spool->map || !spool->dirty)
+        return;
+
+    msync(spool->map, spool->map_size, MS_ASYNC);
+    spool->dirty = false;
+}
@@ -0,0 +1,83 @@
+/*
+ * spool.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Spool file layout: a spool_header_t, then a byte ring of capacity
+ * bytes holding back-to-back records, each a spool_record_t followed
+ * by the topic and the payload.  head and tail are byte counts that
+ * only ever grow; a record may wrap around the end of the ring.
+ * Host byte order, like capture files.
+ */
+#define SPOOL_MAGIC       "NRF24SPL"
+#define SPOOL_VERSION     1
+#define SPOOL_HEADER_SIZE 64
+#define SPOOL_TOPIC_MAX   256
+#define SPOOL_PAYLOAD_MAX 32768
+
+#ifndef __AVR__
+#pragma pack(push, 1)
+#endif
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t capacity;
+    uint64_t head;          /* where the next record goes */
+    uint64_t tail;          /* oldest record */
+    uint64_t records;
+    uint64_t dropped;       /* records pushed out when full */
+} spool_header_t;
+
+typedef struct {
+    uint16_t topic_len;
+    uint16_t reserved;
+    uint32_t payload_len;
+} spool_record_t;
+#ifndef __AVR__
+#pragma pack(pop)
+#endif
+
+/* an open spool; all zeros (map NULL) for none */
+typedef struct spool_t {
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    spool_header_t *header;
+    uint8_t *data;
+    uint32_t capacity;
+    bool dirty;
+} spool_t;
+
+extern bool spool_open(spool_t *spool, const char *file, uint32_t capacity);
+extern void spool_close(spool_t *spool);
+extern bool spool_enabled(const spool_t *spool);
+extern bool spool_empty(const spool_t *spool);
+extern uint64_t spool_count(const spool_t *spool);
+extern bool spool_push(spool_t *spool, const char *topic, const void *payload,
+                       size_t len);
+extern bool spool_peek(spool_t *spool, char *topic, void *payload,
+                       size_t *len);
+extern void spool_pop(spool_t *spool);
+extern void spool_sync(spool_t *spool);
+
+#endif /* _SPOOL_H_ */
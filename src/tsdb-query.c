@@ -0,0 +1,356 @@
+/*
+ * tsdb-query.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * nrf24-tsdb: query the history written by tsdb_dir.  Segments are
+ * memory mapped and walked block by block; blocks outside the
+ * series or time range are skipped on their headers alone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nrf24-mqtt.h"
+#include "debug.h"
+#include "tsdb.h"
+
+typedef struct query_series_t {
+    char *name;
+    uint64_t readings;
+    uint64_t blocks;
+    int64_t first_ms;
+    int64_t last_ms;
+} query_series_t;
+
+typedef struct query_t {
+    const char *series;          /* NULL to list */
+    int64_t from_ms;
+    int64_t to_ms;               /* exclusive */
+    int64_t step_ms;             /* 0 for every reading */
+
+    /* the open downsample bucket */
+    int64_t bucket_ms;
+    uint64_t count;
+    int32_t min;
+    int32_t max;
+    int64_t sum;
+
+    /* listing */
+    query_series_t *list;
+    size_t list_count;
+    size_t list_size;
+} query_t;
+
+static void query_print_ms(int64_t ms) {
+    printf("%lld.%03d", (long long)(ms / 1000), (int)(ms % 1000));
+}
+
+static void query_print_value(int64_t milli) {
+    if(milli < 0) {
+        printf("-");
+        milli = -milli;
+    }
+    printf("%lld.%03d", (long long)(milli / 1000), (int)(milli % 1000));
+}
+
+static void query_bucket_flush(query_t *query) {
+    if(!query->count)
+        return;
+
+    query_print_ms(query->bucket_ms);
+    printf(" ");
+    query_print_value(query->min);
+    printf(" ");
+    query_print_value(query->max);
+    printf(" ");
+    query_print_value(query->sum / (int64_t)query->count);
+    printf(" %llu\n", (unsigned long long)query->count);
+
+    query->count = 0;
+}
+
+static void query_reading(query_t *query, int64_t ms, int32_t value) {
+    int64_t bucket_ms;
+
+    if(ms < query->from_ms || ms >= query->to_ms)
+        return;
+
+    if(!query->step_ms) {
+        query_print_ms(ms);
+        printf(" ");
+        query_print_value(value);
+        printf("\n");
+        return;
+    }
+
+    /* readings come in time order, so a new bucket closes the last */
+    bucket_ms = ms - ((ms % query->step_ms) + query->step_ms) %
+        query->step_ms;
+    if(query->count && bucket_ms != query->bucket_ms)
+        query_bucket_flush(query);
+
+    if(!query->count) {
+        query->bucket_ms = bucket_ms;
+        query->min = query->max = value;
+        query->sum = 0;
+    }
+
+    if(value < query->min)
+        query->min = value;
+    if(value > query->max)
+        query->max = value;
+    query->sum += value;
+    query->count++;
+}
+
+static bool query_list_add(query_t *query, const tsdb_block_t *block) {
+    const char *name = tsdb_block_name(block);
+    query_series_t *series;
+    size_t pos;
+
+    for(pos = 0; pos < query->list_count; pos++) {
+        if(!strcmp(query->list[pos].name, name))
+            break;
+    }
+
+    if(pos == query->list_count) {
+        if(query->list_count == query->list_size) {
+            query->list_size = query->list_size ? query->list_size * 2 : 64;
+            series = (query_series_t *)realloc(
+                query->list, query->list_size * sizeof(query_series_t));
+            if(!series) {
+                ERROR("Malloc error");
+                return false;
+            }
+            query->list = series;
+        }
+
+        series = &query->list[query->list_count];
+        memset(series, 0, sizeof(query_series_t));
+        series->name = strdup(name);
+        if(!series->name) {
+            ERROR("Malloc error");
+            return false;
+        }
+        query->list_count++;
+        series->first_ms = block->first_ms;
+        series->last_ms = block->last_ms;
+    }
+
+    series = &query->list[pos];
+    series->readings += block->count;
+    series->blocks++;
+    if(block->first_ms < series->first_ms)
+        series->first_ms = block->first_ms;
+    if(block->last_ms > series->last_ms)
+        series->last_ms = block->last_ms;
+    return true;
+}
+
+static bool query_segment(query_t *query, const char *path) {
+    const tsdb_segment_t *header;
+    const tsdb_block_t *block;
+    tsdb_cursor_t cursor;
+    struct stat st;
+    uint8_t *map;
+    size_t pos = 0;
+    int64_t ms;
+    int32_t value;
+    bool ok = true;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        ERROR("Cannot open %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(tsdb_segment_t)) {
+        close(fd);
+        return true;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        ERROR("Cannot map %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    header = (const tsdb_segment_t *)map;
+    if(memcmp(header->magic, TSDB_MAGIC, sizeof(header->magic)) ||
+       header->version != TSDB_VERSION) {
+        WARN("%s is not a version %d segment, skipping", path, TSDB_VERSION);
+        munmap(map, st.st_size);
+        return true;
+    }
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    while(ok && (block = tsdb_block_next(map, st.st_size, &pos))) {
+        if(!query->series) {
+            ok = query_list_add(query, block);
+            continue;
+        }
+
+        if(block->last_ms < query->from_ms ||
+           block->first_ms >= query->to_ms ||
+           strcmp(tsdb_block_name(block), query->series))
+            continue;
+
+        tsdb_cursor_init(&cursor, block);
+        while(tsdb_cursor_next(&cursor, &ms, &value))
+            query_reading(query, ms, value);
+    }
+
+    munmap(map, st.st_size);
+    return ok;
+}
+
+/* names start with the segment's start time, so this is time order */
+static int query_segment_filter(const struct dirent *entry) {
+    size_t len = strlen(entry->d_name);
+
+    return len > 4 && !strcmp(entry->d_name + len - 4, ".tsd");
+}
+
+static bool query_dir(query_t *query, const char *dir) {
+    struct dirent **entries;
+    char path[PATH_MAX];
+    bool ok = true;
+    int count, idx;
+
+    count = scandir(dir, &entries, query_segment_filter, alphasort);
+    if(count == -1) {
+        ERROR("Cannot read %s: %s", dir, strerror(errno));
+        return false;
+    }
+
+    for(idx = 0; idx < count; idx++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[idx]->d_name);
+        if(ok)
+            ok = query_segment(query, path);
+        free(entries[idx]);
+    }
+    free(entries);
+
+    query_bucket_flush(query);
+    return ok;
+}
+
+static void query_list_print(query_t *query) {
+    query_series_t *series;
+    size_t pos;
+
+    for(pos = 0; pos < query->list_count; pos++) {
+        series = &query->list[pos];
+        printf("%s %llu readings in %llu blocks, ", series->name,
+               (unsigned long long)series->readings,
+               (unsigned long long)series->blocks);
+        query_print_ms(series->first_ms);
+        printf(" to ");
+        query_print_ms(series->last_ms);
+        printf("\n");
+        free(series->name);
+    }
+
+    free(query->list);
+}
+
+/* unix seconds, or negative for that long before now */
+static int64_t query_time(const char *arg) {
+    long long value = atoll(arg);
+
+    if(value < 0)
+        value += (long long)time(NULL);
+    return (int64_t)value * 1000;
+}
+
+static void query_usage(char *a0) {
+    fprintf(stderr, "Usage: %s -d <dir> [args]\n\n", a0);
+    fprintf(stderr, "Valid args:\n\n");
+    fprintf(stderr, " -d <dir>            tsdb_dir to read\n");
+    fprintf(stderr, " -s <series>         readings of one series (a topic, like\n");
+    fprintf(stderr, "                     home.office/temp0); without it, list\n");
+    fprintf(stderr, "                     the series\n");
+    fprintf(stderr, " -f <time>           from, in unix seconds, or negative for\n");
+    fprintf(stderr, "                     seconds ago\n");
+    fprintf(stderr, " -t <time>           to, likewise\n");
+    fprintf(stderr, " -i <seconds>        downsample to min, max, mean and count\n");
+    fprintf(stderr, "                     per interval\n");
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = NULL;
+    query_t query;
+    int opt;
+
+    memset(&query, 0, sizeof(query));
+    query.from_ms = INT64_MIN;
+    query.to_ms = INT64_MAX;
+
+    while((opt = getopt(argc, argv, "d:s:f:t:i:")) != -1) {
+        switch(opt) {
+        case 'd':
+            dir = optarg;
+            break;
+        case 's':
+            query.series = optarg;
+            break;
+        case 'f':
+            query.from_ms = query_time(optarg);
+            break;
+        case 't':
+            query.to_ms = query_time(optarg);
+            break;
+        case 'i':
+            query.step_ms = (int64_t)atoll(optarg) * 1000;
+            break;
+        default:
+            query_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(!dir || query.step_ms < 0) {
+        query_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    debug_level(DBG_WARN);
+
+    if(!query_dir(&query, dir))
+        return EXIT_FAILURE;
+
+    if(!query.series)
+        query_list_print(&query);
+
+    return EXIT_SUCCESS;
+}
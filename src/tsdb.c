@@ -0,0 +1,458 @@
+/*
+ * tsdb.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Local history, for sites with nothing storing readings on the
+ * broker side.  Readings collect per series in memory and go to disk
+ * a block at a time, with one append per block and no fsync until a
+ * segment is done with, so an SD card sees few, large writes.
+ *
+ * Each publisher worker has its own sink, and is the only thread to
+ * touch it.  The reading side is here too, for nrf24-tsdb.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "nrf24-mqtt.h"
+#include "debug.h"
+#include "tsdb.h"
+
+static const uint8_t tsdb_padding[8];
+
+static uint64_t tsdb_zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t tsdb_unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static uint32_t tsdb_check(uint32_t hash, const uint8_t *data, size_t len) {
+    while(len--)
+        hash = (hash ^ *data++) * 16777619U;
+    return hash;
+}
+
+static uint16_t tsdb_put_varint(uint8_t *dst, uint64_t value) {
+    uint16_t len = 0;
+
+    while(value >= 0x80) {
+        dst[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    dst[len++] = (uint8_t)value;
+    return len;
+}
+
+static bool tsdb_get_varint(const uint8_t **src, const uint8_t *end,
+                            uint64_t *value) {
+    const uint8_t *pos = *src;
+    int shift;
+
+    *value = 0;
+    for(shift = 0; pos < end && shift < 64; shift += 7) {
+        *value |= (uint64_t)(*pos & 0x7f) << shift;
+        if(!(*pos++ & 0x80)) {
+            *src = pos;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool tsdb_open(tsdb_t *db, const char *dir, int worker,
+               uint32_t segment_hours, uint32_t retention_days,
+               uint32_t flush_interval) {
+    memset(db, 0, sizeof(tsdb_t));
+    db->fd = -1;
+
+    if(mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        ERROR("Cannot create tsdb directory %s: %s", dir, strerror(errno));
+        return false;
+    }
+
+    db->dir = strdup(dir);
+    if(!db->dir) {
+        ERROR("Malloc error");
+        return false;
+    }
+
+    db->worker = worker;
+    db->segment_s = segment_hours * 3600;
+    db->retention_s = retention_days * 86400;
+    db->flush_ns = flush_interval * 1000000000ULL;
+    return true;
+}
+
+bool tsdb_enabled(const tsdb_t *db) {
+    return db->dir != NULL;
+}
+
+/* drop segments of ours that ended more than retention_s ago */
+static void tsdb_prune(tsdb_t *db, int64_t now_s) {
+    struct dirent *entry;
+    char path[PATH_MAX];
+    long long start;
+    int worker, end;
+    DIR *dir;
+
+    if(!db->retention_s)
+        return;
+
+    dir = opendir(db->dir);
+    if(!dir)
+        return;
+
+    while((entry = readdir(dir))) {
+        end = 0;
+        if(sscanf(entry->d_name, "%lld-%d.tsd%n", &start, &worker,
+                  &end) != 2 || entry->d_name[end] || worker != db->worker)
+            continue;
+
+        if(start + db->segment_s + db->retention_s > now_s)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", db->dir, entry->d_name);
+        if(unlink(path) == 0)
+            INFO("Removed expired segment %s", path);
+        else
+            WARN("Cannot remove expired segment %s: %s", path,
+                 strerror(errno));
+    }
+
+    closedir(dir);
+}
+
+static void tsdb_segment_close(tsdb_t *db) {
+    if(db->fd == -1)
+        return;
+
+    fdatasync(db->fd);
+    close(db->fd);
+    db->fd = -1;
+}
+
+/*
+ * Open the segment for the period holding ms, appending if a restart
+ * left one behind.  A torn block at its end is padded out, so what
+ * we add is still where readers look for it.
+ */
+static bool tsdb_segment_open(tsdb_t *db, int64_t ms) {
+    tsdb_segment_t header;
+    char path[PATH_MAX];
+    int64_t start_s;
+    struct stat st;
+
+    tsdb_segment_close(db);
+
+    start_s = ms / 1000 / db->segment_s * db->segment_s;
+    db->segment_end_ms = (start_s + db->segment_s) * 1000;
+    snprintf(path, sizeof(path), "%s/%010lld-%d.tsd", db->dir,
+             (long long)start_s, db->worker);
+
+    db->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(db->fd == -1) {
+        ERROR_LIMITED("Cannot open segment %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    if(fstat(db->fd, &st) == -1) {
+        ERROR_LIMITED("Cannot stat segment %s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+    if(st.st_size) {
+        if(pread(db->fd, &header, sizeof(header), 0) != sizeof(header) ||
+           memcmp(header.magic, TSDB_MAGIC, sizeof(header.magic)) ||
+           header.version != TSDB_VERSION) {
+            ERROR_LIMITED("%s is not a version %d segment", path,
+                          TSDB_VERSION);
+            goto fail;
+        }
+
+        if(st.st_size % 8 &&
+           write(db->fd, tsdb_padding, 8 - st.st_size % 8) !=
+           8 - st.st_size % 8) {
+            ERROR_LIMITED("Cannot write segment %s: %s", path,
+                          strerror(errno));
+            goto fail;
+        }
+    } else {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TSDB_MAGIC, sizeof(header.magic));
+        header.version = TSDB_VERSION;
+        header.worker = (uint32_t)db->worker;
+        header.created_ms = ms;
+
+        if(write(db->fd, &header, sizeof(header)) != sizeof(header)) {
+            ERROR_LIMITED("Cannot write segment %s: %s", path,
+                          strerror(errno));
+            goto fail;
+        }
+    }
+
+    DEBUG("Writing history to %s", path);
+    tsdb_prune(db, ms / 1000);
+    return true;
+
+fail:
+    close(db->fd);
+    db->fd = -1;
+    return false;
+}
+
+static void tsdb_unlink(tsdb_t *db, tsdb_series_t *series) {
+    if(series->prev)
+        series->prev->next = series->next;
+    else
+        db->head = series->next;
+
+    if(series->next)
+        series->next->prev = series->prev;
+    else
+        db->tail = series->prev;
+
+    series->prev = series->next = NULL;
+}
+
+/* write out the open block, if any; on error it is dropped */
+void tsdb_flush(tsdb_t *db, tsdb_series_t *series) {
+    tsdb_block_t block;
+    struct iovec iov[6];
+    size_t name_len;
+    ssize_t rc;
+
+    if(!series->count)
+        return;
+
+    tsdb_unlink(db, series);
+
+    name_len = strlen(series->name) + 1;
+    if(name_len > TSDB_NAME_MAX)
+        name_len = TSDB_NAME_MAX;
+
+    memset(&block, 0, sizeof(block));
+    block.magic = TSDB_BLOCK_MAGIC;
+    block.first_ms = series->first_ms;
+    block.last_ms = series->last_ms;
+    block.first_value = series->first_value;
+    block.min = series->min;
+    block.max = series->max;
+    block.count = series->count;
+    block.name_len = (uint16_t)name_len;
+    block.ts_len = series->ts_len;
+    block.value_len = series->value_len;
+    block.length = (uint32_t)(sizeof(block) + name_len + series->ts_len +
+                              series->value_len + 7) & ~7U;
+    block.check = tsdb_check(2166136261U, (const uint8_t *)series->name,
+                             name_len - 1);
+    block.check = tsdb_check(block.check, tsdb_padding, 1);
+    block.check = tsdb_check(block.check, series->ts, series->ts_len);
+    block.check = tsdb_check(block.check, series->values, series->value_len);
+
+    iov[0].iov_base = &block;
+    iov[0].iov_len = sizeof(block);
+    iov[1].iov_base = (void *)series->name;
+    iov[1].iov_len = name_len - 1;
+    iov[2].iov_base = (void *)tsdb_padding;          /* the terminator */
+    iov[2].iov_len = 1;
+    iov[3].iov_base = series->ts;
+    iov[3].iov_len = series->ts_len;
+    iov[4].iov_base = series->values;
+    iov[4].iov_len = series->value_len;
+    iov[5].iov_base = (void *)tsdb_padding;
+    iov[5].iov_len = block.length - sizeof(block) - name_len -
+        series->ts_len - series->value_len;
+
+    series->count = 0;
+    series->ts_len = 0;
+    series->value_len = 0;
+
+    if((db->fd == -1 || series->last_ms >= db->segment_end_ms) &&
+       !tsdb_segment_open(db, series->last_ms))
+        return;
+
+    rc = writev(db->fd, iov, 6);
+    if(rc != (ssize_t)block.length) {
+        ERROR_LIMITED("Cannot write history to %s: %s", db->dir,
+                      rc == -1 ? strerror(errno) : "short write");
+        /* reopen next time, which pads out what we left */
+        close(db->fd);
+        db->fd = -1;
+    }
+}
+
+void tsdb_flush_all(tsdb_t *db) {
+    while(db->head)
+        tsdb_flush(db, db->head);
+}
+
+/*
+ * Add a reading to the series' open block, writing the block out
+ * first if it has no room.  Readings should come in time order;
+ * anything else still round trips, just less compactly.
+ */
+void tsdb_add(tsdb_t *db, tsdb_series_t *series, int64_t ms, int32_t value,
+              uint64_t now_ns) {
+    int64_t delta;
+
+    if(series->count == TSDB_BLOCK_READINGS ||
+       series->ts_len > TSDB_COLUMN_BYTES - TSDB_VARINT_MAX ||
+       series->value_len > TSDB_COLUMN_BYTES - TSDB_VARINT_MAX)
+        tsdb_flush(db, series);
+
+    if(!series->count) {
+        series->first_ms = series->last_ms = ms;
+        series->last_delta = 0;
+        series->first_value = series->last_value = value;
+        series->min = series->max = value;
+        series->count = 1;
+        series->open_ns = now_ns;
+
+        series->prev = db->tail;
+        series->next = NULL;
+        if(db->tail)
+            db->tail->next = series;
+        else
+            db->head = series;
+        db->tail = series;
+        return;
+    }
+
+    delta = ms - series->last_ms;
+    series->ts_len += tsdb_put_varint(series->ts + series->ts_len,
+                                      tsdb_zigzag(delta -
+                                                  series->last_delta));
+    series->last_delta = delta;
+    series->last_ms = ms;
+
+    series->value_len += tsdb_put_varint(
+        series->values + series->value_len,
+        tsdb_zigzag((int64_t)value - series->last_value));
+    series->last_value = value;
+
+    if(value < series->min)
+        series->min = value;
+    if(value > series->max)
+        series->max = value;
+    series->count++;
+}
+
+/* blocks are opened in order, so only the head can be due */
+void tsdb_tick(tsdb_t *db, uint64_t now_ns) {
+    while(db->head && now_ns - db->head->open_ns >= db->flush_ns)
+        tsdb_flush(db, db->head);
+}
+
+void tsdb_close(tsdb_t *db) {
+    if(!db->dir)
+        return;
+
+    tsdb_flush_all(db);
+    tsdb_segment_close(db);
+    free(db->dir);
+    db->dir = NULL;
+}
+
+/*
+ * The next sane block at or after *pos in a mapped segment, or NULL
+ * at the end.  Anything that doesn't hold together (a torn write) is
+ * stepped over a word at a time until a block turns up again.
+ */
+const tsdb_block_t *tsdb_block_next(const uint8_t *map, size_t size,
+                                    size_t *pos) {
+    const tsdb_block_t *block;
+    size_t at = (*pos + 7) & ~(size_t)7;
+
+    if(at < sizeof(tsdb_segment_t))
+        at = sizeof(tsdb_segment_t);
+
+    for(; at + sizeof(tsdb_block_t) <= size; at += 8) {
+        block = (const tsdb_block_t *)(map + at);
+
+        if(block->magic != TSDB_BLOCK_MAGIC || !block->count ||
+           block->length % 8 || block->length > size - at ||
+           !block->name_len || block->name_len > TSDB_NAME_MAX ||
+           sizeof(tsdb_block_t) + block->name_len + block->ts_len +
+           block->value_len > block->length ||
+           map[at + sizeof(tsdb_block_t) + block->name_len - 1] ||
+           tsdb_check(2166136261U, map + at + sizeof(tsdb_block_t),
+                      block->name_len + block->ts_len + block->value_len) !=
+           block->check)
+            continue;
+
+        *pos = at + block->length;
+        return block;
+    }
+
+    *pos = size;
+    return NULL;
+}
+
+const char *tsdb_block_name(const tsdb_block_t *block) {
+    return (const char *)(block + 1);
+}
+
+void tsdb_cursor_init(tsdb_cursor_t *cursor, const tsdb_block_t *block) {
+    cursor->ts = (const uint8_t *)(block + 1) + block->name_len;
+    cursor->ts_end = cursor->ts + block->ts_len;
+    cursor->values = cursor->ts_end;
+    cursor->values_end = cursor->values + block->value_len;
+    cursor->left = block->count;
+    cursor->first = true;
+    cursor->ms = block->first_ms;
+    cursor->delta = 0;
+    cursor->value = block->first_value;
+}
+
+bool tsdb_cursor_next(tsdb_cursor_t *cursor, int64_t *ms, int32_t *value) {
+    uint64_t ts_bits, value_bits;
+
+    if(!cursor->left)
+        return false;
+
+    if(cursor->first) {
+        cursor->first = false;
+    } else {
+        if(!tsdb_get_varint(&cursor->ts, cursor->ts_end, &ts_bits) ||
+           !tsdb_get_varint(&cursor->values, cursor->values_end,
+                            &value_bits)) {
+            cursor->left = 0;
+            return false;
+        }
+
+        cursor->delta += tsdb_unzigzag(ts_bits);
+        cursor->ms += cursor->delta;
+        cursor->value = (int32_t)(cursor->value +
+                                  tsdb_unzigzag(value_bits));
+    }
+
+    cursor->left--;
+    *ms = cursor->ms;
+    *value = cursor->value;
+    return true;
+}
@@ -0,0 +1,148 @@
+/*
+ * tsdb.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TSDB_H_
+#define _TSDB_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Segment file layout: a tsdb_segment_t, then back-to-back blocks,
+ * each a tsdb_block_t followed by the series name, the timestamp
+ * column and the value column, padded to 8 bytes.  A block holds up
+ * to TSDB_BLOCK_READINGS readings of one series.  Timestamps are
+ * wall clock ms, stored as the first plus zigzag varint deltas of
+ * deltas, so a sensor reporting on a steady period costs a byte or
+ * so a reading.  Values are thousandths, the first plus zigzag
+ * varint deltas.  Host byte order, like capture files.
+ *
+ * Segments are only ever appended to.  Each worker writes its own,
+ * named <start seconds>-<worker>.tsd, and starts a new one every
+ * segment_hours.  A torn block at the end of a segment fails its
+ * check, and readers step over it to the next block magic.
+ */
+#define TSDB_MAGIC          "NRF24TSD"
+#define TSDB_VERSION        1
+#define TSDB_BLOCK_MAGIC    0x4b4c4254     /* "TBLK" */
+#define TSDB_BLOCK_READINGS 256
+#define TSDB_COLUMN_BYTES   1024
+#define TSDB_NAME_MAX       256
+#define TSDB_VARINT_MAX     10
+
+#ifndef __AVR__
+#pragma pack(push, 1)
+#endif
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t worker;
+    int64_t created_ms;
+    uint64_t reserved;
+} tsdb_segment_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t length;        /* header to the end of the padding */
+    int64_t first_ms;
+    int64_t last_ms;
+    int32_t first_value;
+    int32_t min;
+    int32_t max;
+    uint16_t count;
+    uint16_t name_len;
+    uint16_t ts_len;
+    uint16_t value_len;
+    uint32_t check;         /* FNV-1a of the name and columns */
+} tsdb_block_t;
+#ifndef __AVR__
+#pragma pack(pop)
+#endif
+
+/*
+ * The open block of one series, filled in memory and written in one
+ * go when it is full or has been open for flush_interval.
+ */
+typedef struct tsdb_series_t {
+    const char *name;              /* owned by whoever owns the series */
+    struct tsdb_series_t *prev;    /* open series, oldest first */
+    struct tsdb_series_t *next;
+    uint64_t open_ns;
+
+    int64_t first_ms;
+    int64_t last_ms;
+    int64_t last_delta;
+    int32_t first_value;
+    int32_t last_value;
+    int32_t min;
+    int32_t max;
+    uint16_t count;
+    uint16_t ts_len;
+    uint16_t value_len;
+
+    uint8_t ts[TSDB_COLUMN_BYTES];
+    uint8_t values[TSDB_COLUMN_BYTES];
+} tsdb_series_t;
+
+/* a sink; all zeros (dir NULL) for none */
+typedef struct tsdb_t {
+    char *dir;
+    int worker;
+    int fd;
+    uint32_t segment_s;
+    uint32_t retention_s;          /* 0 to keep everything */
+    uint64_t flush_ns;
+    int64_t segment_end_ms;
+    tsdb_series_t *head;
+    tsdb_series_t *tail;
+} tsdb_t;
+
+/* walking the readings of a mapped block */
+typedef struct tsdb_cursor_t {
+    const uint8_t *ts;
+    const uint8_t *ts_end;
+    const uint8_t *values;
+    const uint8_t *values_end;
+    uint16_t left;
+    bool first;
+    int64_t ms;
+    int64_t delta;
+    int32_t value;
+} tsdb_cursor_t;
+
+extern bool tsdb_open(tsdb_t *db, const char *dir, int worker,
+                      uint32_t segment_hours, uint32_t retention_days,
+                      uint32_t flush_interval);
+extern void tsdb_close(tsdb_t *db);
+extern bool tsdb_enabled(const tsdb_t *db);
+extern void tsdb_add(tsdb_t *db, tsdb_series_t *series, int64_t ms,
+                     int32_t value, uint64_t now_ns);
+extern void tsdb_flush(tsdb_t *db, tsdb_series_t *series);
+extern void tsdb_flush_all(tsdb_t *db);
+extern void tsdb_tick(tsdb_t *db, uint64_t now_ns);
+
+/* reading */
+extern const tsdb_block_t *tsdb_block_next(const uint8_t *map, size_t size,
+                                           size_t *pos);
+extern const char *tsdb_block_name(const tsdb_block_t *block);
+extern void tsdb_cursor_init(tsdb_cursor_t *cursor,
+                             const tsdb_block_t *block);
+extern bool tsdb_cursor_next(tsdb_cursor_t *cursor, int64_t *ms,
+                             int32_t *value);
+
+#endif /* _TSDB_H_ */
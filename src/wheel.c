@@ -0,0 +1,124 @@
+/*
+ * wheel.c Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+void wheel_init(wheel_t *wheel, uint64_t now) {
+    memset(wheel, 0, sizeof(wheel_t));
+    wheel->now = now;
+}
+
+/*
+ * The slot for a timer, by how far off it is.  One due now only
+ * comes from a cascade, and goes in the slot about to be run.
+ */
+static wheel_timer_t **wheel_slot(wheel_t *wheel, uint64_t expires) {
+    uint64_t delta;
+    int level;
+
+    delta = expires - wheel->now;
+    for(level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if(delta < (1ULL << (WHEEL_BITS * (level + 1))))
+            break;
+    }
+
+    if(level == WHEEL_LEVELS - 1 &&
+       delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS)))
+        expires = wheel->now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    return &wheel->slots[level][(expires >> (WHEEL_BITS * level)) &
+                                WHEEL_MASK];
+}
+
+static void wheel_link(wheel_timer_t **slot, wheel_timer_t *timer) {
+    timer->next = *slot;
+    if(timer->next)
+        timer->next->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+/* anything already due goes off on the next tick */
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, uint64_t expires) {
+    if(expires <= wheel->now)
+        expires = wheel->now + 1;
+
+    wheel_del(timer);
+    timer->expires = expires;
+    wheel_link(wheel_slot(wheel, expires), timer);
+}
+
+void wheel_del(wheel_timer_t *timer) {
+    if(!timer->pprev)
+        return;
+
+    *timer->pprev = timer->next;
+    if(timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+bool wheel_pending(const wheel_timer_t *timer) {
+    return timer->pprev != NULL;
+}
+
+/* move a higher level slot's timers down, now that they're closer */
+static void wheel_cascade(wheel_t *wheel, int level) {
+    wheel_timer_t **slot = &wheel->slots[level][(wheel->now >>
+                                                 (WHEEL_BITS * level)) &
+                                                WHEEL_MASK];
+    wheel_timer_t *timer = *slot;
+    wheel_timer_t *next;
+
+    *slot = NULL;
+    for(; timer; timer = next) {
+        next = timer->next;
+        timer->pprev = NULL;
+        wheel_link(wheel_slot(wheel, timer->expires), timer);
+    }
+}
+
+/*
+ * Step to now, one tick at a time, calling fn for every timer that
+ * expires.  fn may re-add the timer.
+ */
+void wheel_advance(wheel_t *wheel, uint64_t now, wheel_fn_t fn, void *arg) {
+    wheel_timer_t **slot;
+    wheel_timer_t *timer;
+    int level;
+
+    while(wheel->now < now) {
+        wheel->now++;
+
+        for(level = WHEEL_LEVELS - 1; level > 0; level--) {
+            if(!(wheel->now & ((1ULL << (WHEEL_BITS * level)) - 1)))
+                wheel_cascade(wheel, level);
+        }
+
+        slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+        while((timer = *slot)) {
+            wheel_del(timer);
+            fn(timer, arg);
+        }
+    }
+}
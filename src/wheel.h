@@ -0,0 +1,55 @@
+/*
+ * wheel.h Copyright (C) 2015 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _WHEEL_H_
+#define _WHEEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Hierarchical timer wheel.  Level 0 has a slot per tick, each level
+ * above covers 64 times the span of the one below, and timers move
+ * down a level as their time gets close.  Adding, removing and each
+ * tick are O(1), however many timers there are.  4 levels of 64 at
+ * one tick a second reach about 194 days; later timers are clamped.
+ */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct wheel_timer_t {
+    uint64_t expires;                /* in ticks */
+    struct wheel_timer_t *next;
+    struct wheel_timer_t **pprev;    /* NULL when not queued */
+} wheel_timer_t;
+
+typedef struct wheel_t {
+    uint64_t now;
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+typedef void (*wheel_fn_t)(wheel_timer_t *timer, void *arg);
+
+extern void wheel_init(wheel_t *wheel, uint64_t now);
+extern void wheel_add(wheel_t *wheel, wheel_timer_t *timer, uint64_t expires);
+extern void wheel_del(wheel_timer_t *timer);
+extern bool wheel_pending(const wheel_timer_t *timer);
+extern void wheel_advance(wheel_t *wheel, uint64_t now, wheel_fn_t fn,
+                          void *arg);
+
+#endif /* _WHEEL_H_ */